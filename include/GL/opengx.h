@@ -0,0 +1,154 @@
+/*****************************************************************************
+
+             OPENGX SPECIFIC EXTENSIONS
+
+     Entry points which have no OpenGL equivalent and expose GX
+     specific functionality. Include it after GL/gl.h.
+
+*****************************************************************************/
+
+#ifndef OPENGX_H
+#define OPENGX_H
+
+#include <GL/gl.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Must be called once the video and GX subsystems are up
+void InitializeGLdata();
+
+// Context creation: sets up VI (rmode, or the preferred mode if NULL), GX
+// and 2 or 3 XFBs, then initializes opengx. Nothing else is needed.
+// efb_format is one of the following, antialiased modes need RGB565_Z16.
+// Returns GL_FALSE on failure or if a context already exists.
+#define OGX_EFB_DEFAULT    0   // RGB565_Z16 with antialiasing, RGB8_Z24 otherwise
+#define OGX_EFB_RGB8_Z24   1
+#define OGX_EFB_RGBA6_Z24  2   // Destination alpha
+#define OGX_EFB_RGB565_Z16 3
+struct _gx_rmodeobj;
+GLboolean ogxCreateContext(struct _gx_rmodeobj * rmode, int buffers, int efb_format);
+// Queues the copy of the frame to the next XFB and returns, the frame is
+// shown at the first retrace after the GPU has finished it. Only waits when
+// all the XFBs are busy. Does nothing without a context. The retrace and
+// draw sync callbacks belong to the context.
+void ogxSwapBuffers();
+// Dynamic resolution (disabled by default, needs a context). While the GPU
+// time of a frame (from its first draw to the swap) exceeds a retrace
+// period the EFB height is reduced, down to min_scale of it, and
+// the display copy stretches the frame back. glViewport and glScissor are
+// scaled transparently, except for framebuffer objects. EFB reads and copies
+// (glReadPixels, glCopyTexImage2D, ...) take window coordinates too, the
+// reduced rows are stretched back to the requested height.
+void ogxSetDynamicResolution(GLboolean enable, GLfloat min_scale);
+// Fraction of the EFB height being rendered
+GLfloat ogxGetResolutionScale();
+
+// Copies the EFB to xfb (with the copy source and destination set up by the
+// application) clearing it to the current clear color and depth. A glClear
+// to the same values before the next draw is then free, so call it instead
+// of GX_CopyDisp at the end of the frame.
+void ogxCopyDisp(void * xfb);
+
+// Deferred rendering (disabled by default). GL calls are recorded and a
+// render thread translates them to GX, so the calling thread doesn't wait
+// for the GX FIFO or the retrace. Draws copy the referenced vertex data (and
+// indices), draws needing more than 64KB for that are not recorded. Calls
+// which are not recorded (queries, texture uploads, ...) and glFinish wait
+// for the render thread to be done. GL must be used from a single thread.
+void ogxSetDeferredRendering(GLboolean enable);
+
+// Asynchronous glReadPixels. The EFB region is copied by the GPU and can be
+// collected later (ie. next frame) without waiting for the GPU to go idle.
+// Returns 0 if the request can't be queued.
+GLuint ogxReadPixelsAsync(GLint x, GLint y, GLsizei width, GLsizei height, GLenum format, GLenum type);
+// Returns GL_TRUE when the GPU has finished the copy
+GLboolean ogxReadPixelsReady(GLuint request);
+// Converts the pixels to data (waiting for the GPU if needed) and releases the request
+void ogxReadPixelsCollect(GLuint request, GLvoid * data);
+
+// Asynchronous glTexImage2D (level 0). Conversion and compression run on a
+// worker thread, data must stay valid until the texture is ready. Returns
+// GL_FALSE if the upload queue is full. A later upload, glTexImage2D or
+// glDeleteTextures of the same texture cancels the pending upload, while
+// glCopyTexSubImage2D waits for it and applies to the uploaded image.
+GLboolean ogxTexImage2DAsync(GLuint texture, GLint internalFormat, GLsizei width, GLsizei height,
+                             GLenum format, GLenum type, const GLvoid * data);
+// Makes the converted textures available, call it once per frame from the
+// render thread. Returns the number of uploads still being converted.
+int ogxCompleteTexUploads();
+// Returns GL_FALSE while the texture has an upload in flight
+GLboolean ogxIsTextureReady(GLuint texture);
+
+// Instanced drawing: the vertex state is set up once and the geometry is
+// emitted instancecount times, instance i transformed by modelview *
+// matrices[i] (16 floats, column major like glLoadMatrixf). With NULL matrices
+// every instance uses the modelview. Eye linear and sphere texgen follow the
+// instance matrix. With auto culling every instance is tested against the
+// bounding box.
+void ogxDrawArraysInstanced(GLenum mode, GLint first, GLsizei count, GLsizei instancecount, const GLfloat * matrices);
+void ogxDrawElementsInstanced(GLenum mode, GLsizei count, GLenum type, const GLvoid * indices,
+                              GLsizei instancecount, const GLfloat * matrices);
+// Core entry points (missing in gl.h), same as above without matrices
+void glDrawArraysInstanced(GLenum mode, GLint first, GLsizei count, GLsizei instancecount);
+void glDrawElementsInstanced(GLenum mode, GLsizei count, GLenum type, const GLvoid * indices, GLsizei instancecount);
+
+// Bounding volume visibility against the frustum of the current modelview and
+// projection matrices (volumes are in object space). The frustum planes are
+// cached until the matrices change.
+GLboolean ogxIsBoxVisible(const GLfloat min[3], const GLfloat max[3]);
+GLboolean ogxIsSphereVisible(const GLfloat center[3], GLfloat radius);
+// Registers the object space bounding box of the following draws (NULL to
+// clear it). With auto culling enabled the draws are skipped when the box is
+// outside the frustum.
+void ogxSetBoundingBox(const GLfloat * min, const GLfloat * max);
+void ogxSetAutoCulling(GLboolean enable);
+
+// Lets GX fetch the vertex data of glDrawElements calls with GL_UNSIGNED_BYTE
+// indices from the client arrays (disabled by default), which halves the
+// FIFO traffic of small meshes. GX reads the arrays after the call returns:
+// they must not be modified or freed until the GPU is done with the draw
+// (ie. after glFinish). Vertex colors disable it.
+void ogxSetIndexedFetch(GLboolean enable);
+
+// Draw call coalescing (disabled by default). Consecutive list draws
+// (GL_QUADS, GL_TRIANGLES, GL_LINES, GL_POINTS) with no state change in
+// between are merged into a single GX_Begin. Vertex data is copied, so
+// arrays can be modified after the draw. Pending draws are emitted by
+// glFlush/glFinish, which must be called before copying the EFB to the XFB.
+void ogxSetDrawCoalescing(GLboolean enable);
+// Draw calls seen by the coalescing layer, how many of them were merged into
+// a previous draw and how many GX batches were emitted. Any can be NULL.
+void ogxGetDrawCoalescingStats(GLuint * draws, GLuint * merged, GLuint * batches);
+void ogxResetDrawCoalescingStats();
+
+// Mesh optimization (triangle lists of 16 bit indices). These don't need GX
+// and can be used offline too.
+// GX vertex cache size assumed by the simulator (FIFO replacement)
+#define OGX_VERTEX_CACHE_SIZE 16
+// Indices must be below vertex_count, otherwise nothing is done and GL_FALSE
+// (or 0) is returned.
+// Reorders the triangles for vertex cache locality (Forsyth). Returns
+// GL_FALSE if there's not enough memory, leaving the indices untouched.
+GLboolean ogxOptimizeIndices(GLushort * indices, GLsizei count, GLsizei vertex_count);
+// Renumbers the vertices in order of first use, so vertex data is fetched
+// sequentially. remap (vertex_count entries) receives the new index of every
+// vertex (0xFFFF if unused). Returns the number of used vertices, 0 if
+// vertex_count is above 65535.
+GLsizei ogxOptimizeVertexFetch(GLushort * indices, GLsizei count, GLsizei vertex_count, GLushort * remap);
+// Moves the vertices of an array (stride bytes each) to their remapped position
+void ogxRemapVertexArray(GLvoid * dst, const GLvoid * src, GLsizei vertex_count, GLsizei stride, const GLushort * remap);
+// Converts a triangle list to a single GL_TRIANGLE_STRIP, strips are joined
+// with degenerate triangles. strip must hold 2*count indices. Returns the
+// strip length (0 on failure).
+GLsizei ogxStripifyIndices(const GLushort * indices, GLsizei count, GLsizei vertex_count, GLushort * strip);
+// Average number of vertex cache misses per triangle (ACMR) for
+// GL_TRIANGLES or GL_TRIANGLE_STRIP indices
+float ogxSimulateVertexCache(const GLushort * indices, GLsizei count, GLenum mode, int cache_size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
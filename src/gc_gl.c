@@ -46,9 +46,12 @@ POSSIBILITY OF SUCH DAMAGE.
 *****************************************************************************/
 
 
+#define GL_GLEXT_PROTOTYPES
 #include <GL/gl.h>
 #include <GL/glu.h>
+#include <GL/opengx.h>
 #include <gccore.h>
+#include <ogc/lwp_watchdog.h>
 #include <string.h>
 #include <stdlib.h>
 #include <malloc.h>
@@ -60,36 +63,130 @@ POSSIBILITY OF SUCH DAMAGE.
 // Can be changed with care.
 
 #define _MAX_GL_TEX       192   // Maximum number of textures
+#define _MAX_GL_FBO         8   // Maximum number of framebuffer objects
 #define MAX_PROJ_STACK      4   // Proj. matrix stack depth
 #define MAX_MODV_STACK     16   // Modelview matrix stack depth
+#define MAX_TEX_STACK       4   // Texture matrix stack depth (per unit)
 #define NUM_VERTS_IM       64   // Maximum number of vertices that can be inside a glBegin/End
-#define MAX_LIGHTS          4   // Max num lights, DO NOT CHANGE
+#define MAX_LIGHTS          8   // Max num lights, one GX light each
+#define MAX_TEXTURE_UNITS   8   // One per GX texture map / texture coordinate
+#define MAX_PNMTX          10   // GX position/normal matrix slots, DO NOT CHANGE
+#define MAX_PALETTE_MATRICES MAX_PNMTX
+#define MAX_READBACKS       4   // Max num of pending asynchronous glReadPixels
+#define READPIXELS_PEEK_MAX 16  // Regions up to this many pixels are read with EFB peeks
+#define MAX_TEXUPLOADS      8   // Max num of queued asynchronous texture uploads
+#define TEXUPLOAD_STACK (16*1024)
+#define TEXUPLOAD_PRIO     32   // Below the main thread, conversions run in its idle time
+#define BATCH_BUFFER_SIZE (64*1024) // Bytes of vertex data in a coalesced draw batch
+#define GX_FIFO_SIZE (256*1024) // Command FIFO of the context
+#define MAX_XFB             3   // Triple buffering at most
+#define DYNRES_STEP     0.05f   // Resolution scale change per frame
+#define DYNRES_CALM_FRAMES 30   // Frames with GPU time to spare before going up again
+#define DYNRES_HIGH     0.95f   // GPU time (fraction of the retrace period) above which the scale goes down
+#define DYNRES_LOW      0.85f   // ... and below which it can go up
+#define DYNRES_IDLE_US   500    // A frame finished this soon after its submission was waiting for the CPU
+#define DEFER_RING_WORDS (32*1024) // Command ring of the deferred rendering
+#define DEFER_STACK (32*1024)
+#define DEFER_PRIO         80   // Above the main thread, it runs as soon as it's woken up
+#define MAX_BATCH_VERTS 65535   // GX_Begin vertex count limit
 
 #define ROUND_32B(x) (((x)+31)&(~31))
 
+// Matrix kinds, each one includes the previous ones so the kind of a product
+// is the greatest of the two
+#define MTX_IDENTITY    0
+#define MTX_TRANSLATION 1
+#define MTX_RIGID       2   // Rotation (or reflection) and translation
+#define MTX_UNIFORM     3   // Rigid with an uniform scale
+#define MTX_AFFINE      4
+#define MTX_PROJECTIVE  5
+
+// Matrices are stored row major like GX ones, so the first three rows of
+// an affine Mtx44 can be loaded as a position matrix without copying
 typedef struct glparams_ {
 	Mtx44 modelview_matrix;
 	Mtx44 projection_matrix;
 	Mtx44 modelview_stack[MAX_MODV_STACK];
 	Mtx44 projection_stack[MAX_PROJ_STACK];
 	int cur_modv_mat, cur_proj_mat;
+	// Kind (MTX_*) of the matrices above
+	unsigned char modelview_kind, projection_kind;
+	unsigned char modelview_stack_kind[MAX_MODV_STACK];
+	unsigned char projection_stack_kind[MAX_PROJ_STACK];
+
+	// Object space frustum planes (a,b,c,d), valid until the matrices change
+	float frustum[6][4];
+	char frustum_valid;
+	// GL_ARB_matrix_palette, palette matrices are loaded to the GX matrix slots
+	Mtx44 palette_matrix[MAX_PALETTE_MATRICES];
+	unsigned char palette_slot[MAX_PALETTE_MATRICES];
+	int cur_palette, palette_size;
+	char palette_enabled;
+
+	// Automatic culling of draws against the registered bounding box
+	char autocull, bbox_set;
+	float bbox_min[3], bbox_max[3];
+	// 8 bit indexed draws let GX fetch the client arrays (opt-in)
+	char indexed_fetch;
 
 	unsigned char srcblend,dstblend;
 	unsigned char blendenabled;
 	unsigned char zwrite,ztest,zfunc;
+	unsigned char alphatest,alphafunc,alpharef;
+	unsigned char colorupdate;
 	unsigned char matrixmode;
 	unsigned char frontcw, cullenabled;
 	GLenum glcullmode;
-	int glcurtex;
+	int glcurtex;           // Texture bound to the active unit
+	int glcurfbo;
 	GXColor clear_color;
 	float clearz;
+	float depth_range[2];
+	unsigned char pixelfmt;     // EFB format, GX_PF_*
+	// Values the whole EFB was cleared to by the last ogxCopyDisp, valid
+	// until something is drawn
+	struct _efb_clear {
+		GXColor color;
+		u32 z;
+		char clean;
+	} efb_clear;
 
 	void * index_array;
-	float * vertex_array, * texcoord_array, * normal_array, * color_array;
-	int vertex_stride, color_stride, index_stride, texcoord_stride, normal_stride;
-	char vertex_enabled, normal_enabled, texcoord_enabled, index_enabled, color_enabled;
-
-	char texture_enabled;
+	float * vertex_array, * normal_array, * color_array;
+	int vertex_stride, color_stride, index_stride, normal_stride;
+	char vertex_enabled, normal_enabled, index_enabled, color_enabled;
+	void * matrixindex_array;
+	int matrixindex_stride;
+	GLenum matrixindex_type;
+	char matrixindex_enabled;
+
+	// Texture unit N uses GX_TEXMAPN and the GX_VA_TEXN vertex attribute
+	struct texunit {
+		int glcurtex;
+		char enabled;
+		float * texcoord_array;
+		int texcoord_stride;
+		char texcoord_enabled;
+		Mtx44 texture_matrix;
+		Mtx44 texture_stack[MAX_TEX_STACK];
+		int cur_tex_mat;
+		unsigned char texgen_enabled;   // One bit per coordinate (S, T, R, Q)
+		GLenum texgen_mode[4];
+		float texgen_objplane[4][4];
+		float texgen_eyeplane[4][4];    // Already in eye space
+	} texunit[MAX_TEXTURE_UNITS];
+	int texgen_texen, texgen_flipped;   // Units (and flipped textures) the GX texgens are set up for
+	int active_texture, client_active_texture;
+	int viewport[4];
+	int scissor[4];
+
+	struct _fog {
+		float color[4];
+		float density, start, end;
+		GLenum mode, hint;
+		char enabled;
+		GXFogAdjTbl adjtable;
+	} fog;
 
 	struct imm_mode {
 		float current_color[4];
@@ -107,6 +204,9 @@ typedef struct glparams_ {
 			unsigned dirty_matrices :1;
 			unsigned dirty_lighting :1;
 			unsigned dirty_material :1;
+			unsigned dirty_fog      :1;
+			unsigned dirty_alpha    :1;
+			unsigned dirty_texmtx   :1;
 		} bits;
 		unsigned int all;
 	} dirty;
@@ -118,16 +218,27 @@ typedef struct glparams_ {
 			float spot_direction[3];
 			float ambient_color[4];
 			float diffuse_color[4];
+			float specular_color[4];
 			float atten[3];
 			float spot_cutoff;
 			int   spot_exponent;
 			char enabled;
+			char dirty;     // Its light objects must be initialized again
 		} lights[MAX_LIGHTS];
-		GXLightObj lightobj[MAX_LIGHTS*2];
+		GXLightObj lightobj[MAX_LIGHTS];   // Indexed by GX light
+		// What's loaded in each GX light: GL light n diffuse (n), specular (n+MAX_LIGHTS) or unknown (-1)
+		signed char slot_owner[MAX_LIGHTS];
+		float loaded_specular[4];   // Material the specular lights were loaded with
+		float loaded_shininess;
 		float globalambient[4];
 		float matambient[4];
 		float matdiffuse[4];
+		float matspecular[4];
+		float matemission[4];
+		float matshininess;
 		char enabled;
+		char color_material;
+		GLenum color_material_mode;
 
 		GXColor cached_ambient;
 	} lighting;
@@ -143,9 +254,172 @@ typedef struct gltexture_ {
 	char maxlevel, minlevel;
 	char onelevel;
 	unsigned char wraps, wrapt;
+	unsigned char format;   // GX_TF_* of the stored image
+	char flipped;           // Rows stored top-down (EFB copies), flip T when sampling
+	char genmipmap;         // Box filter the next level on EFB copies (GL_GENERATE_MIPMAP)
 } gltexture_;
 gltexture_ texture_list[_MAX_GL_TEX];
 
+// Framebuffer objects are emulated on the EFB: rendering goes to the top-left
+// corner of the EFB and the attached texture is resolved with an EFB copy
+// when the framebuffer is unbound.
+typedef struct glframebuffer_ {
+	char used;
+	int texture;
+	int level;
+} glframebuffer_;
+glframebuffer_ framebuffer_list[_MAX_GL_FBO];
+
+// Pending asynchronous pixel reads
+typedef struct glreadback_ {
+	unsigned char * buffer;
+	unsigned short token;
+	short xoff;              // Offset of the region inside the (aligned) copy
+	int y, y0;               // Window row of the region and EFB row of the copy
+	float yscale;            // EFB rows per window row (dynamic resolution)
+	int width, height, tw, th;
+	GLenum format, type;
+	char used;
+} glreadback_;
+glreadback_ readback_list[MAX_READBACKS];
+
+// Asynchronous texture uploads
+enum { TEXUPLOAD_FREE = 0, TEXUPLOAD_QUEUED, TEXUPLOAD_CONVERTING, TEXUPLOAD_CONVERTED, TEXUPLOAD_RETIRING };
+typedef struct gltexupload_ {
+	volatile char state;
+	volatile char cancelled; // Superseded or deleted texture, the result is dropped
+	int texture;
+	unsigned int seq;        // Queueing order
+	const void * src;
+	void * buffer;           // Converted image, becomes the texture data
+	void * oldbuffer;        // Previous texture data, freed when the GPU is done with it
+	unsigned short token;
+	unsigned short w, h;
+	GLint internalFormat;
+	GLenum format;
+	int bytespp, needswap;
+} gltexupload_;
+gltexupload_ texupload_list[MAX_TEXUPLOADS];
+unsigned int texupload_seq = 0;
+lwp_t texupload_thread = LWP_THREAD_NULL;
+mutex_t texupload_mutex;
+cond_t texupload_cond;
+cond_t texupload_done;   // Signalled by the worker when a job is converted
+
+unsigned short drawsync_token = 0;
+
+// Context created by ogxCreateContext. Frames copied to an XFB are queued
+// until the GPU is done with them, the retrace callback then shows the
+// oldest one. XFBs are used in turns, so the next one is free once fewer
+// than numxfb-1 frames are waiting.
+struct _ogx_context {
+	GXRModeObj * rmode;
+	void * fifo;
+	void * xfb[MAX_XFB];
+	int numxfb;
+	int draw;                           // XFB the next frame is copied to
+	volatile struct {
+		int xfb;
+		unsigned short token;
+	} queue[MAX_XFB];
+	volatile unsigned int head, tail;   // Popped by the retrace callback, pushed by the swap
+	volatile int shown;
+	int copy_height;                    // EFB lines copied to the XFB
+	float copy_scale;                   // Their fraction of the EFB height
+
+	// Dynamic resolution: the EFB height is scaled down while the GPU
+	// time of the frames exceeds the retrace period, the display copy
+	// stretches it back. The GPU time goes from the first draw of the frame
+	// to its display copy, both marked by draw sync tokens.
+	struct _dynres {
+		char enabled;
+		float scale, min_scale;
+		int calm;                       // Frames with time to spare in a row
+		char started;                   // The start token of the frame was issued
+		volatile unsigned short start_token, end_token;
+		volatile u64 start_time;        // When the GPU reached the start token
+		volatile u64 submit_time;       // When the display copy was queued
+		volatile int gpu_us;            // GPU time of the last frame, 0 if it was waiting for the CPU
+		volatile unsigned int measured; // Frames measured so far
+		unsigned int used;              // ... and seen by the controller
+		volatile u64 last_retrace;
+		volatile int retrace_us;        // Retrace period, the GPU time budget
+	} dynres;
+} ogx_context;
+
+// The GX position/normal matrix slots work as a cache of the last matrices
+// loaded, objects sharing a modelview don't reload (nor invert) it
+typedef struct glpnmtx_ {
+	float mtx[3][4];
+	unsigned int lastuse;    // 0 if unused
+} glpnmtx_;
+glpnmtx_ pnmtx_cache[MAX_PNMTX];
+unsigned int pnmtx_clock = 0;
+
+// Draw call coalescing: consecutive list draws with the same state are
+// accumulated (vertex data is copied) and emitted in a single GX_Begin
+typedef struct glbatch_ {
+	char enabled;
+	unsigned char gxmode;
+	int texen, texc, color_provide;
+	char vertex_enabled, normal_enabled;
+	float color[4];          // Current color, used when there are no vertex colors
+	int numverts;
+	unsigned int draws, merged, batches;
+	float data[BATCH_BUFFER_SIZE/sizeof(float)];
+} glbatch_;
+glbatch_ draw_batch;
+
+// Deferred rendering: commands are a header and their arguments
+typedef union glcmdword_ {
+	struct {
+		unsigned short op, size;   // Size in words, header included
+	} hdr;
+	GLint i;
+	GLfloat f;
+	const void * p;
+} glcmdword_;
+
+// Client arrays as seen by the recorder
+struct _defer_client {
+	float * vertex_array, * normal_array, * color_array;
+	int vertex_stride, normal_stride, color_stride;
+	char vertex_enabled, normal_enabled, color_enabled, matrixindex_enabled;
+	float * texcoord_array[MAX_TEXTURE_UNITS];
+	int texcoord_stride[MAX_TEXTURE_UNITS];
+	char texcoord_enabled[MAX_TEXTURE_UNITS];
+	int client_active_texture;
+};
+
+struct _defer {
+	char enabled, quit;
+	lwp_t thread;
+	mutex_t mutex;
+	cond_t work, done;
+	volatile unsigned int rd, wr;       // Word counters, wrapping around the ring
+	volatile unsigned int freed;        // Words up to here can be reused, GX may still fetch the ones up to rd
+	volatile char fenced;               // The GPU hasn't passed fence yet
+	unsigned short fence;               // Draw sync token after the last draw GX fetches from the ring
+	volatile char waiting;              // The render thread is waiting for work
+	unsigned int kicked;                // wr when the render thread was last woken up
+	unsigned int pending;               // Words of the command being recorded
+	char stale;                         // The client arrays must be read again
+	struct _defer_client client;
+	glcmdword_ ring[DEFER_RING_WORDS];
+} defer;
+
+enum {
+	DEFER_NOP, DEFER_ENABLE, DEFER_DISABLE, DEFER_BIND_TEXTURE, DEFER_ACTIVE_TEXTURE,
+	DEFER_MATRIX_MODE, DEFER_LOAD_IDENTITY, DEFER_PUSH_MATRIX, DEFER_POP_MATRIX,
+	DEFER_LOAD_MATRIX, DEFER_MULT_MATRIX, DEFER_TRANSLATE, DEFER_ROTATE, DEFER_SCALE,
+	DEFER_COLOR, DEFER_NORMAL, DEFER_TEXCOORD, DEFER_BEGIN, DEFER_VERTEX,
+	DEFER_LIGHT, DEFER_MATERIAL, DEFER_BLEND_FUNC, DEFER_DEPTH_FUNC, DEFER_DEPTH_MASK,
+	DEFER_CLEAR_COLOR, DEFER_CLEAR, DEFER_VIEWPORT,
+	DEFER_ENABLE_CLIENT, DEFER_DISABLE_CLIENT, DEFER_CLIENT_ACTIVE_TEXTURE,
+	DEFER_VERTEX_POINTER, DEFER_NORMAL_POINTER, DEFER_TEXCOORD_POINTER,
+	DEFER_DRAW, DEFER_FLUSH, DEFER_SWAP, DEFER_END
+};
+
 const GLubyte gl_null_string[1] = { 0 };
 
 static void swap_rgba(unsigned char * pixels, int num_pixels);
@@ -161,32 +435,52 @@ void scale_internal(int components, int widthin, int heightin,const unsigned cha
 
 void __draw_arrays_pos_normal_texc (float * ptr_pos, float * ptr_texc, float * ptr_normal, int count);
 void __draw_arrays_pos_normal (float * ptr_pos, float * ptr_normal, int count);
-void __draw_arrays_general (float * ptr_pos, float * ptr_normal, float * ptr_texc, float * ptr_color, int count,
+void __draw_arrays_general (float * ptr_pos, float * ptr_normal, float ** ptr_texc, float * ptr_color, int count,
 							int ne, int color_provide, int texen);
+void __flush_batch();
+static void _emit_vertex(unsigned int index, int texc, int color_provide);
+static int _deferring();
+static void _defer_sync();
+static glcmdword_ * _defer_begin(int op, int n);
+static void _defer_end(glcmdword_ * args);
+static int _defer_draw(GLenum mode, int first, int count, const GLvoid * indices, GLenum type);
+static void _read_client_arrays(struct _defer_client * c);
+static void _write_client_arrays(const struct _defer_client * c);
+static void _cancel_tex_uploads(int texture);
+static void _complete_tex_uploads(int texture);
+static void _flip_texture_level(gltexture_ * currtex, int level);
+
+
+
+// Matrix kernels. The 3x4 ones also work on the first three rows of an
+// affine Mtx44. On Gekko they are the paired single routines of libogc,
+// elsewhere (or with OGX_MTX_USE_C) the C versions in mtx_kernels.h.
+#if defined(GEKKO) && !defined(OGX_MTX_USE_C)
+#define _mtx_concat(a,b,ab)         ps_guMtxConcat(a,b,ab)
+#define _mtx_inverse(src,inv)       ps_guMtxInverse(src,inv)
+#define _mtx_transpose(src,xpose)   ps_guMtxTranspose(src,xpose)
+#define _mtx_vec_multiply(m,s,d)    ps_guVecMultiply(m,s,d)
+#define _mtx_vec_multiply_sr(m,s,d) ps_guVecMultiplySR(m,s,d)
+#else
+#include "mtx_kernels.h"
+#endif
+
+// General 4x4 product ab = a*b, ab can be a or b
+static void _mtx44_concat(Mtx44 a, Mtx44 b, Mtx44 ab) {
+	Mtx44 t;
+	int i, j;
+	for (i = 0; i < 4; i++)
+		for (j = 0; j < 4; j++)
+			t[i][j] = a[i][0]*b[0][j] + a[i][1]*b[1][j] + a[i][2]*b[2][j] + a[i][3]*b[3][j];
+	memcpy(ab,t,sizeof(Mtx44));
+}
 
-
-
-// We have to reverse the product, as we store the matrices as colmajor (otherwise said trasposed)
-// we need to compute C = A*B (as rowmajor, "regular") then C = B^T * A^T = (A*B)^T
-// so we compute the product and transpose the result (for storage) in one go.
-//                                        Reversed operands a and b
-inline void _gl_matrix_multiply(float * dst, float * b, float * a) {
-	dst[0] = a[0]*b[0] + a[1]*b[4] + a[2]*b[8] + a[3]*b[12];
-	dst[1] = a[0]*b[1] + a[1]*b[5] + a[2]*b[9] + a[3]*b[13];
-	dst[2] = a[0]*b[2] + a[1]*b[6] + a[2]*b[10] + a[3]*b[14];
-	dst[3] = a[0]*b[3] + a[1]*b[7] + a[2]*b[11] + a[3]*b[15];
-	dst[4] = a[4]*b[0] + a[5]*b[4] + a[6]*b[8] + a[7]*b[12];
-	dst[5] = a[4]*b[1] + a[5]*b[5] + a[6]*b[9] + a[7]*b[13];
-	dst[6] = a[4]*b[2] + a[5]*b[6] + a[6]*b[10] + a[7]*b[14];
-	dst[7] = a[4]*b[3] + a[5]*b[7] + a[6]*b[11] + a[7]*b[15];
-	dst[ 8] = a[8]*b[0] + a[9]*b[4] + a[10]*b[8] + a[11]*b[12];
-	dst[ 9] = a[8]*b[1] + a[9]*b[5] + a[10]*b[9] + a[11]*b[13];
-	dst[10] = a[8]*b[2] + a[9]*b[6] + a[10]*b[10] + a[11]*b[14];
-	dst[11] = a[8]*b[3] + a[9]*b[7] + a[10]*b[11] + a[11]*b[15];
-	dst[12] = a[12]*b[0] + a[13]*b[4] + a[14]*b[8] + a[15]*b[12];
-	dst[13] = a[12]*b[1] + a[13]*b[5] + a[14]*b[9] + a[15]*b[13];
-	dst[14] = a[12]*b[2] + a[13]*b[6] + a[14]*b[10] + a[15]*b[14];
-	dst[15] = a[12]*b[3] + a[13]*b[7] + a[14]*b[11] + a[15]*b[15];
+// Converts between GL (column major) and internal matrices
+static void _mtx44_transpose(const float * src, Mtx44 dst) {
+	int i, j;
+	for (i = 0; i < 4; i++)
+		for (j = 0; j < 4; j++)
+			dst[i][j] = src[j*4+i];
 }
 
 inline float _clampf_01(float n) {
@@ -200,49 +494,89 @@ inline float _clampf_11(float n) {
 	else return n;
 }
 
+// Draw sync tokens are written by the GPU once it has processed all the
+// previous commands, which lets us track it without waiting for it.
+static unsigned short _issue_draw_sync() {
+	GX_SetDrawSync(++drawsync_token);
+	GX_Flush();
+	return drawsync_token;
+}
+static int _draw_sync_passed(unsigned short token) {
+	// Tokens wrap around, compare the distance
+	return ((short)(GX_GetDrawSync() - token)) >= 0;
+}
+
 
 #define MODELVIEW_UPDATE \
-	{ float trans[3][4]; int i; int j; \
-	for (i = 0; i < 3; i++)  \
-		for (j = 0; j < 4; j++) \
-			trans[i][j] = glparamstate.modelview_matrix[j][i]; \
-	\
-	GX_LoadPosMtxImm(trans,GX_PNMTX3); \
-	GX_SetCurrentMtx(GX_PNMTX3); \
-	}
+	GX_SetCurrentMtx(GX_PNMTX0 + _load_pnmtx(glparamstate.modelview_matrix,glparamstate.modelview_kind)*3);
 
 #define PROJECTION_UPDATE \
-	{ float trans[4][4]; int i; int j; \
-	for (i = 0; i < 4; i++)  \
-		for (j = 0; j < 4; j++) \
-			trans[i][j] = glparamstate.projection_matrix[j][i]; \
-	if (trans[3][3] != 0) \
-		GX_LoadProjectionMtx(trans, GX_ORTHOGRAPHIC); \
+	if (glparamstate.projection_kind != MTX_PROJECTIVE) \
+		GX_LoadProjectionMtx(glparamstate.projection_matrix, GX_ORTHOGRAPHIC); \
 	else \
-		GX_LoadProjectionMtx(trans, GX_PERSPECTIVE); \
+		GX_LoadProjectionMtx(glparamstate.projection_matrix, GX_PERSPECTIVE);
+
+
+// Returns the matrix slot holding mtx (row major 3x4), loading it together
+// with its normal matrix into the least recently used slot if needed. The
+// kind (MTX_*) saves the inverse for rigid and uniformly scaled matrices.
+static int _load_pnmtx(float mtx[3][4], int kind) {
+	int i, slot = 0;
+	pnmtx_clock++;
+	for (i = 0; i < MAX_PNMTX; i++) {
+		if (pnmtx_cache[i].lastuse && memcmp(pnmtx_cache[i].mtx,mtx,sizeof(float)*12) == 0) {
+			pnmtx_cache[i].lastuse = pnmtx_clock;
+			return i;
+		}
+		if (pnmtx_cache[i].lastuse < pnmtx_cache[slot].lastuse)
+			slot = i;
 	}
 
-
-#define NORMAL_UPDATE { \
-		int i,j; \
-		Mtx mvinverse, normalm, modelview; \
-		for (i = 0; i < 3; i++) \
-			for (j = 0; j < 4; j++) \
-				modelview[i][j] = glparamstate.modelview_matrix[j][i]; \
-		\
-		guMtxInverse(modelview,mvinverse); \
-		guMtxTranspose(mvinverse,normalm); \
-		GX_LoadNrmMtxImm(normalm,GX_PNMTX3); \
+	memcpy(pnmtx_cache[slot].mtx,mtx,sizeof(float)*12);
+	pnmtx_cache[slot].lastuse = pnmtx_clock;
+	GX_LoadPosMtxImm(mtx,GX_PNMTX0 + slot*3);
+
+	// The normal matrix is the inverse transpose, which for s*R is R/s = M/s^2
+	Mtx normalm;
+	if (kind <= MTX_RIGID) {
+		GX_LoadNrmMtxImm(mtx,GX_PNMTX0 + slot*3);
+	}else if (kind == MTX_UNIFORM) {
+		float is2 = 1.0f/(mtx[0][0]*mtx[0][0] + mtx[1][0]*mtx[1][0] + mtx[2][0]*mtx[2][0]);
+		for (i = 0; i < 3; i++) {
+			normalm[i][0] = mtx[i][0]*is2;
+			normalm[i][1] = mtx[i][1]*is2;
+			normalm[i][2] = mtx[i][2]*is2;
+			normalm[i][3] = 0;
+		}
+		GX_LoadNrmMtxImm(normalm,GX_PNMTX0 + slot*3);
+	}else{
+		Mtx mvinverse;
+		_mtx_inverse(mtx,mvinverse);
+		_mtx_transpose(mvinverse,normalm);
+		GX_LoadNrmMtxImm(normalm,GX_PNMTX0 + slot*3);
 	}
+	return slot;
+}
+
+// Whether vertices select their matrix from the palette
+static inline int _palette_active() {
+	return glparamstate.palette_enabled && glparamstate.matrixindex_enabled;
+}
 
 
 void InitializeGLdata() {
 	GX_SetDispCopyGamma(GX_GM_1_0);
-	int i;
+	int i, j, k;
 	for (i = 0; i < _MAX_GL_TEX; i++) {
 		texture_list[i].used = 0;
 		texture_list[i].data = 0;
 	}
+	for (i = 0; i < _MAX_GL_FBO; i++)
+		framebuffer_list[i].used = 0;
+	for (i = 0; i < MAX_READBACKS; i++)
+		readback_list[i].used = 0;
+	framebuffer_list[0].used = 1;   // Framebuffer 0 is the EFB itself
+	glparamstate.glcurfbo = 0;
 
 	glparamstate.blendenabled = 0;
 	glparamstate.srcblend = GX_BL_ONE;
@@ -253,15 +587,54 @@ void InitializeGLdata() {
 	glparamstate.clear_color.b = 0;
 	glparamstate.clear_color.a = 1;
 	glparamstate.clearz = 1.0f;
+	glparamstate.efb_clear.clean = 0;
+	glparamstate.colorupdate = GX_TRUE;
+	glparamstate.depth_range[0] = 0.0f;
+	glparamstate.depth_range[1] = 1.0f;
+	glparamstate.pixelfmt = GX_PF_RGB8_Z24;   // Unless a context says otherwise
+
+	glparamstate.fog.enabled = 0;
+	glparamstate.fog.mode = GL_EXP;
+	glparamstate.fog.hint = GL_DONT_CARE;
+	glparamstate.fog.density = 1.0f;
+	glparamstate.fog.start = 0.0f;
+	glparamstate.fog.end = 1.0f;
+	memset(glparamstate.fog.color,0,sizeof(glparamstate.fog.color));
+
+	glparamstate.viewport[0] = 0;
+	glparamstate.viewport[1] = 0;
+	glparamstate.viewport[2] = 640;
+	glparamstate.viewport[3] = 480;
+	memcpy(glparamstate.scissor, glparamstate.viewport, sizeof(glparamstate.scissor));
 
 	glparamstate.ztest = GX_FALSE;  // Depth test disabled but z write enabled
 	glparamstate.zfunc = GX_LESS;   // Although write is efectively disabled
 	glparamstate.zwrite = GX_TRUE;  // unless test is enabled
 
+	glparamstate.alphatest = GX_FALSE;
+	glparamstate.alphafunc = GX_ALWAYS;
+	glparamstate.alpharef = 0;
+
 	glparamstate.matrixmode = 1;    // Modelview default mode
 	glparamstate.glcurtex = 0;      // Default texture is 0 (nonstardard)
 	GX_SetNumChans(1);              // One modulation color (as glColor)
-	glDisable(GL_TEXTURE_2D);
+	for (i = 0; i < MAX_TEXTURE_UNITS; i++) {
+		glparamstate.texunit[i].glcurtex = 0;
+		glparamstate.texunit[i].enabled = 0;
+		glparamstate.texunit[i].texcoord_enabled = 0;
+		glparamstate.texunit[i].cur_tex_mat = -1;
+		glparamstate.texunit[i].texgen_enabled = 0;
+		for (j = 0; j < 4; j++) {
+			glparamstate.texunit[i].texgen_mode[j] = GL_EYE_LINEAR;
+			for (k = 0; k < 4; k++) {
+				// S plane is (1,0,0,0) and T plane is (0,1,0,0), R and Q are zero
+				glparamstate.texunit[i].texgen_objplane[j][k] = (j == k && j < 2) ? 1.0f : 0.0f;
+				glparamstate.texunit[i].texgen_eyeplane[j][k] = (j == k && j < 2) ? 1.0f : 0.0f;
+			}
+		}
+	}
+	glparamstate.active_texture = 0;
+	glparamstate.client_active_texture = 0;
 
 	glparamstate.glcullmode = GL_BACK;
 	glparamstate.cullenabled = 0;
@@ -270,8 +643,30 @@ void InitializeGLdata() {
 
 	glparamstate.cur_proj_mat = -1;
 	glparamstate.cur_modv_mat = -1;
+	glparamstate.frustum_valid = 0;
+	glparamstate.palette_enabled = 0;
+	glparamstate.matrixindex_enabled = 0;
+	glparamstate.palette_size = 0;
+	glMatrixMode(GL_MATRIX_PALETTE_ARB);
+	for (i = 0; i < MAX_PALETTE_MATRICES; i++) {
+		glparamstate.cur_palette = i;
+		glparamstate.palette_slot[i] = 0;
+		glLoadIdentity();
+	}
+	glparamstate.cur_palette = 0;
+	for (i = 0; i < MAX_PNMTX; i++)
+		pnmtx_cache[i].lastuse = 0;
+	glparamstate.autocull = 0;
+	glparamstate.indexed_fetch = 0;
+	glparamstate.bbox_set = 0;
 	glMatrixMode(GL_PROJECTION);
 	glLoadIdentity();
+	glMatrixMode(GL_TEXTURE);
+	for (i = 0; i < MAX_TEXTURE_UNITS; i++) {
+		glparamstate.active_texture = i;
+		glLoadIdentity();
+	}
+	glparamstate.active_texture = 0;
 	glMatrixMode(GL_MODELVIEW);
 	glLoadIdentity();
 
@@ -285,16 +680,17 @@ void InitializeGLdata() {
 
 	glparamstate.vertex_enabled = 0;     // DisableClientState on everything
 	glparamstate.normal_enabled = 0;
-	glparamstate.texcoord_enabled = 0;
 	glparamstate.index_enabled = 0;
 	glparamstate.color_enabled = 0;
 
-	glparamstate.texture_enabled = 0;
-
 	// Set up lights default states
 	glparamstate.lighting.enabled = 0;
+	glparamstate.lighting.color_material = 0;
+	glparamstate.lighting.color_material_mode = GL_AMBIENT_AND_DIFFUSE;
 	for (i = 0; i < MAX_LIGHTS; i++) {
 		glparamstate.lighting.lights[i].enabled = false;
+		glparamstate.lighting.lights[i].dirty = 1;
+		glparamstate.lighting.slot_owner[i] = -1;
 		glparamstate.lighting.lights[i].atten[0] = 1;
 		glparamstate.lighting.lights[i].atten[1] = 0;
 		glparamstate.lighting.lights[i].atten[2] = 0;
@@ -322,6 +718,11 @@ void InitializeGLdata() {
 		glparamstate.lighting.lights[i].diffuse_color[2] = 0;
 		glparamstate.lighting.lights[i].diffuse_color[3] = 1;
 
+		glparamstate.lighting.lights[i].specular_color[0] = 0;
+		glparamstate.lighting.lights[i].specular_color[1] = 0;
+		glparamstate.lighting.lights[i].specular_color[2] = 0;
+		glparamstate.lighting.lights[i].specular_color[3] = 1;
+
 		glparamstate.lighting.lights[i].spot_cutoff = 180.0f;
 		glparamstate.lighting.lights[i].spot_exponent = 0;
 	}
@@ -336,15 +737,32 @@ void InitializeGLdata() {
 	glparamstate.lighting.matdiffuse[2] = 0.8f;
 	glparamstate.lighting.matdiffuse[3] = 1.0f;
 
+	glparamstate.lighting.matspecular[0] = 0.0f;
+	glparamstate.lighting.matspecular[1] = 0.0f;
+	glparamstate.lighting.matspecular[2] = 0.0f;
+	glparamstate.lighting.matspecular[3] = 1.0f;
+
+	glparamstate.lighting.matemission[0] = 0.0f;
+	glparamstate.lighting.matemission[1] = 0.0f;
+	glparamstate.lighting.matemission[2] = 0.0f;
+	glparamstate.lighting.matemission[3] = 1.0f;
+
+	glparamstate.lighting.matshininess = 0.0f;
+
 	// Setup data types for every possible attribute
 
 	// Typical straight float
 	GX_SetVtxAttrFmt (GX_VTXFMT0, GX_VA_POS,  GX_POS_XYZ,  GX_F32,   0);
 	GX_SetVtxAttrFmt (GX_VTXFMT0, GX_VA_NRM,  GX_NRM_XYZ,  GX_F32,   0);
-	GX_SetVtxAttrFmt (GX_VTXFMT0, GX_VA_TEX0, GX_TEX_ST,   GX_F32,   0);
 	GX_SetVtxAttrFmt (GX_VTXFMT0, GX_VA_CLR0, GX_CLR_RGBA, GX_RGBA8, 0);
+	for (i = 0; i < MAX_TEXTURE_UNITS; i++)
+		GX_SetVtxAttrFmt (GX_VTXFMT0, GX_VA_TEX0+i, GX_TEX_ST, GX_F32, 0);
 
 	
+	draw_batch.enabled = 0;
+	draw_batch.numverts = 0;
+	draw_batch.draws = draw_batch.merged = draw_batch.batches = 0;
+
 	// Mark all the hardware data as dirty, so it will be recalculated
 	// and uploaded again to the hardware
 	glparamstate.dirty.all = ~0;
@@ -352,9 +770,24 @@ void InitializeGLdata() {
 
 
 void glEnable( GLenum cap ) {  // TODO
+	glcmdword_ * cmd;
+	if (_deferring() && (cmd = _defer_begin(DEFER_ENABLE,1))) {
+		cmd[0].i = cap;
+		_defer_end(cmd);
+		return;
+	}
+	__flush_batch();
 	switch (cap) {
 	case GL_TEXTURE_2D:
-		glparamstate.texture_enabled = 1;
+		glparamstate.texunit[glparamstate.active_texture].enabled = 1;
+		break;
+	case GL_TEXTURE_GEN_S: case GL_TEXTURE_GEN_T:
+	case GL_TEXTURE_GEN_R: case GL_TEXTURE_GEN_Q:
+		glparamstate.texunit[glparamstate.active_texture].texgen_enabled |= (1 << (cap-GL_TEXTURE_GEN_S));
+		glparamstate.dirty.bits.dirty_texmtx = 1;
+		break;
+	case GL_MATRIX_PALETTE_ARB:
+		glparamstate.palette_enabled = 1;
 		break;
 	case GL_CULL_FACE:
 		switch(glparamstate.glcullmode) {
@@ -384,8 +817,22 @@ void glEnable( GLenum cap ) {  // TODO
 		glparamstate.lighting.enabled = 1;
 		glparamstate.dirty.bits.dirty_lighting = 1;
 		break;
+	case GL_COLOR_MATERIAL:
+		glparamstate.lighting.color_material = 1;
+		glparamstate.dirty.bits.dirty_material = 1;
+		break;
+	case GL_FOG:
+		glparamstate.fog.enabled = 1;
+		glparamstate.dirty.bits.dirty_fog = 1;
+		break;
+	case GL_ALPHA_TEST:
+		glparamstate.alphatest = GX_TRUE;
+		glparamstate.dirty.bits.dirty_alpha = 1;
+		break;
 	case GL_LIGHT0: case GL_LIGHT1:
 	case GL_LIGHT2: case GL_LIGHT3:
+	case GL_LIGHT4: case GL_LIGHT5:
+	case GL_LIGHT6: case GL_LIGHT7:
 		glparamstate.lighting.lights[cap-GL_LIGHT0].enabled = 1;
 		glparamstate.dirty.bits.dirty_lighting = 1;
 		break;
@@ -394,9 +841,24 @@ void glEnable( GLenum cap ) {  // TODO
 }
 
 void glDisable( GLenum cap ) {  // TODO
+	glcmdword_ * cmd;
+	if (_deferring() && (cmd = _defer_begin(DEFER_DISABLE,1))) {
+		cmd[0].i = cap;
+		_defer_end(cmd);
+		return;
+	}
+	__flush_batch();
 	switch (cap) {
 	case GL_TEXTURE_2D:
-		glparamstate.texture_enabled = 0;
+		glparamstate.texunit[glparamstate.active_texture].enabled = 0;
+		break;
+	case GL_TEXTURE_GEN_S: case GL_TEXTURE_GEN_T:
+	case GL_TEXTURE_GEN_R: case GL_TEXTURE_GEN_Q:
+		glparamstate.texunit[glparamstate.active_texture].texgen_enabled &= ~(1 << (cap-GL_TEXTURE_GEN_S));
+		glparamstate.dirty.bits.dirty_texmtx = 1;
+		break;
+	case GL_MATRIX_PALETTE_ARB:
+		glparamstate.palette_enabled = 0;
 		break;
 	case GL_CULL_FACE:
 		GX_SetCullMode(GX_CULL_NONE);
@@ -414,8 +876,22 @@ void glDisable( GLenum cap ) {  // TODO
 		glparamstate.lighting.enabled = 0;
 		glparamstate.dirty.bits.dirty_lighting = 1;
 		break;
+	case GL_COLOR_MATERIAL:
+		glparamstate.lighting.color_material = 0;
+		glparamstate.dirty.bits.dirty_material = 1;
+		break;
+	case GL_FOG:
+		glparamstate.fog.enabled = 0;
+		glparamstate.dirty.bits.dirty_fog = 1;
+		break;
+	case GL_ALPHA_TEST:
+		glparamstate.alphatest = GX_FALSE;
+		glparamstate.dirty.bits.dirty_alpha = 1;
+		break;
 	case GL_LIGHT0: case GL_LIGHT1:
 	case GL_LIGHT2: case GL_LIGHT3:
+	case GL_LIGHT4: case GL_LIGHT5:
+	case GL_LIGHT6: case GL_LIGHT7:
 		glparamstate.lighting.lights[cap-GL_LIGHT0].enabled = 0;
 		glparamstate.dirty.bits.dirty_lighting = 1;
 		break;
@@ -425,6 +901,7 @@ void glDisable( GLenum cap ) {  // TODO
 
 
 void glLightf( GLenum light, GLenum pname, GLfloat param ){
+	_defer_sync();
     int lnum = light - GL_LIGHT0;
 
 	switch(pname) {
@@ -440,14 +917,34 @@ void glLightf( GLenum light, GLenum pname, GLfloat param ){
 			glparamstate.lighting.lights[lnum].spot_exponent = (int)param; break;
 		default: break;
 	}
+	glparamstate.lighting.lights[lnum].dirty = 1;
 	glparamstate.dirty.bits.dirty_lighting = 1;
 }
 
 void glLightfv( GLenum light, GLenum pname, const GLfloat *params ) {
+	glcmdword_ * cmd;
+	if (_deferring() && (cmd = _defer_begin(DEFER_LIGHT,6))) {
+		// Scalar parameters are in params[0]
+		int i, n = 4;
+		if (pname == GL_SPOT_DIRECTION) n = 3;
+		else if (pname != GL_POSITION && pname != GL_AMBIENT && pname != GL_DIFFUSE && pname != GL_SPECULAR) n = 1;
+		cmd[0].i = light; cmd[1].i = pname;
+		for (i = 0; i < 4; i++) cmd[2+i].f = i < n ? params[i] : 0;
+		_defer_end(cmd);
+		return;
+	}
 	int lnum = light-GL_LIGHT0;
 	switch(pname) {
 	case GL_SPOT_DIRECTION:
-		memcpy(glparamstate.lighting.lights[lnum].spot_direction,params,3*sizeof(float));
+		// Transformed by the modelview (no translation) into eye space
+		{ float * dir = glparamstate.lighting.lights[lnum].spot_direction;
+			guVector v = { params[0], params[1], params[2] };
+			_mtx_vec_multiply_sr(glparamstate.modelview_matrix,&v,(guVector*)dir);
+			float len = sqrtf(dir[0]*dir[0] + dir[1]*dir[1] + dir[2]*dir[2]);
+			if (len > 0) {
+				dir[0] /= len; dir[1] /= len; dir[2] /= len;
+			}
+		}
 		break;
 	case GL_POSITION:
 		if (params[3] == 0) {
@@ -466,14 +963,9 @@ void glLightfv( GLenum light, GLenum pname, const GLfloat *params ) {
 			glparamstate.lighting.lights[lnum].position[2] = params[2];
 		}
 		glparamstate.lighting.lights[lnum].position[3] = params[3];
-		{ float modv[3][4]; int i; int j;
-			for (i = 0; i < 3; i++)
-				for (j = 0; j < 4; j++)
-					modv[i][j] = glparamstate.modelview_matrix[j][i];
-			guVecMultiply(modv,(guVector*)glparamstate.lighting.lights[lnum].position,(guVector*)glparamstate.lighting.lights[lnum].position);
-			if (params[3] == 0)
-				guVecMultiply(modv,(guVector*)glparamstate.lighting.lights[lnum].direction,(guVector*)glparamstate.lighting.lights[lnum].direction);
-		}
+		_mtx_vec_multiply(glparamstate.modelview_matrix,(guVector*)glparamstate.lighting.lights[lnum].position,(guVector*)glparamstate.lighting.lights[lnum].position);
+		if (params[3] == 0)
+			_mtx_vec_multiply_sr(glparamstate.modelview_matrix,(guVector*)glparamstate.lighting.lights[lnum].direction,(guVector*)glparamstate.lighting.lights[lnum].direction);
 		break;
 	case GL_DIFFUSE:
 		memcpy(glparamstate.lighting.lights[lnum].diffuse_color,params,sizeof(float)*4);
@@ -482,12 +974,15 @@ void glLightfv( GLenum light, GLenum pname, const GLfloat *params ) {
 		memcpy(glparamstate.lighting.lights[lnum].ambient_color,params,sizeof(float)*4);
 		break;
 	case GL_SPECULAR:
-		break;  // TO BE DONE
+		memcpy(glparamstate.lighting.lights[lnum].specular_color,params,sizeof(float)*4);
+		break;
 	}
+	glparamstate.lighting.lights[lnum].dirty = 1;
 	glparamstate.dirty.bits.dirty_lighting = 1;
 }
 
 void glLightModelfv( GLenum pname, const GLfloat *params ){
+	_defer_sync();
 	switch(pname) {
 	case GL_LIGHT_MODEL_AMBIENT: 
 		memcpy(glparamstate.lighting.globalambient,params,4*sizeof(float));
@@ -498,6 +993,16 @@ void glLightModelfv( GLenum pname, const GLfloat *params ){
 
 
 void glMaterialfv( GLenum face, GLenum pname, const GLfloat *params ){
+	glcmdword_ * cmd;
+	if (_deferring() && (cmd = _defer_begin(DEFER_MATERIAL,6))) {
+		int i, n = 4;
+		if (pname == GL_SHININESS) n = 1;
+		else if (pname == GL_COLOR_INDEXES) n = 3;
+		cmd[0].i = face; cmd[1].i = pname;
+		for (i = 0; i < 4; i++) cmd[2+i].f = i < n ? params[i] : 0;
+		_defer_end(cmd);
+		return;
+	}
 	switch(pname) {
 		case GL_DIFFUSE: memcpy(glparamstate.lighting.matdiffuse,params,4*sizeof(float)); break;
 		case GL_AMBIENT: memcpy(glparamstate.lighting.matambient,params,4*sizeof(float)); break;
@@ -505,35 +1010,93 @@ void glMaterialfv( GLenum face, GLenum pname, const GLfloat *params ){
 			memcpy(glparamstate.lighting.matambient,params,4*sizeof(float));
 			memcpy(glparamstate.lighting.matdiffuse,params,4*sizeof(float));
 			break;
+		case GL_SPECULAR: memcpy(glparamstate.lighting.matspecular,params,4*sizeof(float)); break;
+		case GL_EMISSION: memcpy(glparamstate.lighting.matemission,params,4*sizeof(float)); break;
+		case GL_SHININESS: glparamstate.lighting.matshininess = params[0]; break;
 		default: break;
 	}
 	glparamstate.dirty.bits.dirty_material = 1;
 };
 
+void glColorMaterial( GLenum face, GLenum mode ) {
+	_defer_sync();
+	glparamstate.lighting.color_material_mode = mode;
+	glparamstate.dirty.bits.dirty_material = 1;
+}
+
+void glMaterialf( GLenum face, GLenum pname, GLfloat param ){
+	_defer_sync();
+	if (pname == GL_SHININESS) {
+		glparamstate.lighting.matshininess = param;
+		glparamstate.dirty.bits.dirty_material = 1;
+	}
+}
+
 void glCullFace( GLenum mode ) {
+	_defer_sync();
 	glparamstate.glcullmode = mode;
 	if (glparamstate.cullenabled) glEnable(GL_CULL_FACE);
 	else glDisable(GL_CULL_FACE);
 }
 
 void glBindTexture(GLenum target, GLuint texture) {
+	glcmdword_ * cmd;
+	if (_deferring() && (cmd = _defer_begin(DEFER_BIND_TEXTURE,2))) {
+		cmd[0].i = target; cmd[1].i = texture;
+		_defer_end(cmd);
+		return;
+	}
+	__flush_batch();
 	if (texture < 0 || texture >= _MAX_GL_TEX) return;
 
-	// If the texture has been initialized (data!=0) then load it to GX reg 0
+	// If the texture has been initialized (data!=0) then load it to the unit's GX texture map
 	if (texture_list[texture].used) {
 		glparamstate.glcurtex = texture;
+		glparamstate.texunit[glparamstate.active_texture].glcurtex = texture;
 
 		if (texture_list[texture].data != 0)
-		    GX_LoadTexObj(&texture_list[glparamstate.glcurtex].texobj, GX_TEXMAP0);
+		    GX_LoadTexObj(&texture_list[glparamstate.glcurtex].texobj, GX_TEXMAP0 + glparamstate.active_texture);
+	}
+}
+
+void glActiveTexture(GLenum texture) {
+	glcmdword_ * cmd;
+	if (_deferring() && (cmd = _defer_begin(DEFER_ACTIVE_TEXTURE,1))) {
+		cmd[0].i = texture;
+		_defer_end(cmd);
+		return;
 	}
+	int unit = texture - GL_TEXTURE0;
+	if (unit < 0 || unit >= MAX_TEXTURE_UNITS) return;
+
+	glparamstate.active_texture = unit;
+	glparamstate.glcurtex = glparamstate.texunit[unit].glcurtex;
+}
+
+void glClientActiveTexture(GLenum texture) {
+	glcmdword_ * cmd;
+	if (_deferring() && (cmd = _defer_begin(DEFER_CLIENT_ACTIVE_TEXTURE,1))) {
+		cmd[0].i = texture;
+		_defer_end(cmd);
+		return;
+	}
+	int unit = texture - GL_TEXTURE0;
+	if (unit < 0 || unit >= MAX_TEXTURE_UNITS) return;
+
+	glparamstate.client_active_texture = unit;
 }
 
+void glActiveTextureARB(GLenum texture) { glActiveTexture(texture); }
+void glClientActiveTextureARB(GLenum texture) { glClientActiveTexture(texture); }
+
 void glDeleteTextures( GLsizei n, const GLuint *textures) {
+	__flush_batch();
 	GLuint *texlist = textures;
 	GX_DrawDone();
 	while (n-- > 0) {
 		int i = *texlist++;
 		if (!(i < 0 || i >= _MAX_GL_TEX)) {
+			_cancel_tex_uploads(i);
 			if (texture_list[i].data != 0)
 				free(texture_list[i].data);
 			texture_list[i].data = 0;
@@ -543,6 +1106,7 @@ void glDeleteTextures( GLsizei n, const GLuint *textures) {
 }
 
 void glGenTextures(	GLsizei n, GLuint * textures) {
+	_defer_sync();
 	GLuint *texlist = textures;
 	int i;
 	for (i = 0; i < _MAX_GL_TEX && n > 0; i++) {
@@ -556,44 +1120,103 @@ void glGenTextures(	GLsizei n, GLuint * textures) {
 			texture_list[i].bytespp = 0;
 			texture_list[i].maxlevel = -1;
 			texture_list[i].minlevel = 20;
+			texture_list[i].format = GX_TF_RGBA8;
+			texture_list[i].flipped = 0;
+			texture_list[i].genmipmap = 0;
 			*texlist++ = i;
 			n--;
 		}
 	}
 }
 void glBegin(GLenum mode) {
+	glcmdword_ * cmd;
+	if (_deferring() && (cmd = _defer_begin(DEFER_BEGIN,1))) {
+		cmd[0].i = mode;
+		_defer_end(cmd);
+		return;
+	}
 	// Just discard all the data!
 	glparamstate.imm_mode.current_numverts = 0;
 	glparamstate.imm_mode.prim_type = mode;
 }
 
 void glEnd() {
+	glcmdword_ * cmd;
+	if (_deferring() && (cmd = _defer_begin(DEFER_END,0))) {
+		_defer_end(cmd);
+		return;
+	}
+	// The vertices are drawn through the client arrays, which are left as they were
+	struct _defer_client saved;
+	_read_client_arrays(&saved);
+	// Immediate mode texture coordinates belong to unit 0
+	glparamstate.client_active_texture = 0;
 	glInterleavedArrays(GL_T2F_C4F_N3F_V3F,0,glparamstate.imm_mode.current_vertices);
 	glDrawArrays(glparamstate.imm_mode.prim_type,0,glparamstate.imm_mode.current_numverts);
+	_write_client_arrays(&saved);
+}
+
+// Vertical scale of the viewport, rendering to the screen at a reduced
+// resolution
+static float _viewport_scale() {
+	if (ogx_context.dynres.enabled && glparamstate.glcurfbo == 0)
+		return ogx_context.copy_scale;
+	return 1.0f;
+}
+
+// Sets the GL viewport (with the depth range) and scissor
+static void _apply_viewport() {
+	float s = _viewport_scale();
+	int * v = glparamstate.viewport, * sc = glparamstate.scissor;
+	GX_SetViewport (v[0], v[1]*s, v[2], v[3]*s, glparamstate.depth_range[0], glparamstate.depth_range[1]);
+	GX_SetScissor (sc[0], sc[1]*s, sc[2], sc[3]*s);
+}
+
+void glDepthRange(GLclampd near_val, GLclampd far_val) {
+	__flush_batch();
+	glparamstate.depth_range[0] = _clampf_01(near_val);
+	glparamstate.depth_range[1] = _clampf_01(far_val);
+	_apply_viewport();
 }
 
 void glViewport( GLint x, GLint y, GLsizei width, GLsizei height ) {
-	GX_SetViewport (x, y, width, height, 0.0f, 1.0f);
-	GX_SetScissor (x,y, width, height);
+	glcmdword_ * cmd;
+	if (_deferring() && (cmd = _defer_begin(DEFER_VIEWPORT,4))) {
+		cmd[0].i = x; cmd[1].i = y; cmd[2].i = width; cmd[3].i = height;
+		_defer_end(cmd);
+		return;
+	}
+	__flush_batch();
+	glparamstate.viewport[0] = glparamstate.scissor[0] = x;
+	glparamstate.viewport[1] = glparamstate.scissor[1] = y;
+	glparamstate.viewport[2] = glparamstate.scissor[2] = width;
+	glparamstate.viewport[3] = glparamstate.scissor[3] = height;
+	_apply_viewport();
+	glparamstate.dirty.bits.dirty_fog = 1;   // The range adjustment depends on it
 }
 
 void glScissor(GLint x, GLint y, GLsizei width, GLsizei height) {
-	GX_SetScissor (x,y, width, height);
+	__flush_batch();
+	glparamstate.scissor[0] = x;
+	glparamstate.scissor[1] = y;
+	glparamstate.scissor[2] = width;
+	glparamstate.scissor[3] = height;
+	_apply_viewport();
 }
 
 void glColor4ub (GLubyte r, GLubyte g, GLubyte b, GLubyte a) {
-	glparamstate.imm_mode.current_color[0] = r/255.0f;
-	glparamstate.imm_mode.current_color[1] = g/255.0f;
-	glparamstate.imm_mode.current_color[2] = b/255.0f;
-	glparamstate.imm_mode.current_color[3] = a/255.0f;
+	glColor4f(r/255.0f, g/255.0f, b/255.0f, a/255.0f);
 }
 void glColor4ubv( const GLubyte * color ) {
-	glparamstate.imm_mode.current_color[0] = color[0]/255.0f;
-	glparamstate.imm_mode.current_color[1] = color[1]/255.0f;
-	glparamstate.imm_mode.current_color[2] = color[2]/255.0f;
-	glparamstate.imm_mode.current_color[3] = color[3]/255.0f;
+	glColor4ub(color[0], color[1], color[2], color[3]);
 }
 void glColor4f( GLfloat red, GLfloat green, GLfloat blue, GLfloat alpha ) {
+	glcmdword_ * cmd;
+	if (_deferring() && (cmd = _defer_begin(DEFER_COLOR,4))) {
+		cmd[0].f = red; cmd[1].f = green; cmd[2].f = blue; cmd[3].f = alpha;
+		_defer_end(cmd);
+		return;
+	}
 	glparamstate.imm_mode.current_color[0] = _clampf_01(red);
 	glparamstate.imm_mode.current_color[1] = _clampf_01(green);
 	glparamstate.imm_mode.current_color[2] = _clampf_01(blue);
@@ -601,25 +1224,36 @@ void glColor4f( GLfloat red, GLfloat green, GLfloat blue, GLfloat alpha ) {
 }
 
 void glColor3f( GLfloat red, GLfloat green, GLfloat blue ) {
-	glparamstate.imm_mode.current_color[0] = _clampf_01(red);
-	glparamstate.imm_mode.current_color[1] = _clampf_01(green);
-	glparamstate.imm_mode.current_color[2] = _clampf_01(blue);
-	glparamstate.imm_mode.current_color[3] = 1.0f;
+	glColor4f(red, green, blue, 1.0f);
 }
 
 void glColor4fv( const GLfloat *v ) {
-	glparamstate.imm_mode.current_color[0] = _clampf_01(v[0]);
-	glparamstate.imm_mode.current_color[1] = _clampf_01(v[1]);
-	glparamstate.imm_mode.current_color[2] = _clampf_01(v[2]);
-	glparamstate.imm_mode.current_color[3] = _clampf_01(v[3]);
+	glColor4f(v[0], v[1], v[2], v[3]);
 }
 
 void glTexCoord2f( GLfloat u, GLfloat v) {
+	glcmdword_ * cmd;
+	if (_deferring() && (cmd = _defer_begin(DEFER_TEXCOORD,2))) {
+		cmd[0].f = u; cmd[1].f = v;
+		_defer_end(cmd);
+		return;
+	}
 	glparamstate.imm_mode.current_texcoord[0] = u;
 	glparamstate.imm_mode.current_texcoord[1] = v;
 }
 
+// Immediate mode only carries coordinates for the first unit
+void glMultiTexCoord2f( GLenum target, GLfloat s, GLfloat t ) {
+	if (target == GL_TEXTURE0) glTexCoord2f(s,t);
+}
+
 void glNormal3f( GLfloat nx, GLfloat ny, GLfloat nz ) {
+	glcmdword_ * cmd;
+	if (_deferring() && (cmd = _defer_begin(DEFER_NORMAL,3))) {
+		cmd[0].f = nx; cmd[1].f = ny; cmd[2].f = nz;
+		_defer_end(cmd);
+		return;
+	}
 	glparamstate.imm_mode.current_normal[0] = nx;
 	glparamstate.imm_mode.current_normal[0] = ny;
 	glparamstate.imm_mode.current_normal[0] = nz;
@@ -634,6 +1268,12 @@ void glVertex2f( GLfloat x, GLfloat y ) {
 }
 
 void glVertex3f( GLfloat x, GLfloat y, GLfloat z) {
+	glcmdword_ * cmd;
+	if (_deferring() && (cmd = _defer_begin(DEFER_VERTEX,3))) {
+		cmd[0].f = x; cmd[1].f = y; cmd[2].f = z;
+		_defer_end(cmd);
+		return;
+	}
 	if (glparamstate.imm_mode.current_numverts >= NUM_VERTS_IM) return;
 
 	// GL_T2F_C4F_N3F_V3F
@@ -656,6 +1296,12 @@ void glVertex3f( GLfloat x, GLfloat y, GLfloat z) {
 }
 
 void glMatrixMode( GLenum mode ) {
+	glcmdword_ * cmd;
+	if (_deferring() && (cmd = _defer_begin(DEFER_MATRIX_MODE,1))) {
+		cmd[0].i = mode;
+		_defer_end(cmd);
+		return;
+	}
 	switch(mode) {
 	case GL_MODELVIEW:
 		glparamstate.matrixmode = 1;
@@ -663,213 +1309,775 @@ void glMatrixMode( GLenum mode ) {
 	case GL_PROJECTION:
 		glparamstate.matrixmode = 0;
 		break;
+	case GL_TEXTURE:
+		glparamstate.matrixmode = 2;
+		break;
+	case GL_MATRIX_PALETTE_ARB:
+		glparamstate.matrixmode = 3;
+		break;
 	default:
 		glparamstate.matrixmode = -1;
 		break;
 	}
 }
+// Flags the matrix selected by glMatrixMode as modified
+static void _matrix_changed() {
+	if (glparamstate.matrixmode == 2) {
+		glparamstate.dirty.bits.dirty_texmtx = 1;
+	}else{
+		glparamstate.dirty.bits.dirty_matrices = 1;
+		glparamstate.frustum_valid = 0;
+	}
+}
 void glPopMatrix (void) {
+	glcmdword_ * cmd;
+	if (_deferring() && (cmd = _defer_begin(DEFER_POP_MATRIX,0))) {
+		_defer_end(cmd);
+		return;
+	}
 	switch(glparamstate.matrixmode) {
 	case 0:
 		memcpy(glparamstate.projection_matrix,glparamstate.projection_stack[glparamstate.cur_proj_mat],sizeof(Mtx44));
+		glparamstate.projection_kind = glparamstate.projection_stack_kind[glparamstate.cur_proj_mat];
 		glparamstate.cur_proj_mat--;
+		break;
 	case 1:
 		memcpy(glparamstate.modelview_matrix,glparamstate.modelview_stack[glparamstate.cur_modv_mat],sizeof(Mtx44));
+		glparamstate.modelview_kind = glparamstate.modelview_stack_kind[glparamstate.cur_modv_mat];
 		glparamstate.cur_modv_mat--;
+		break;
+	case 2: {
+		struct texunit * unit = &glparamstate.texunit[glparamstate.active_texture];
+		memcpy(unit->texture_matrix,unit->texture_stack[unit->cur_tex_mat],sizeof(Mtx44));
+		unit->cur_tex_mat--;
+		} break;
 	default: break;
 	}
-	glparamstate.dirty.bits.dirty_matrices = 1;
+	_matrix_changed();
 }
 void glPushMatrix (void) {
+	glcmdword_ * cmd;
+	if (_deferring() && (cmd = _defer_begin(DEFER_PUSH_MATRIX,0))) {
+		_defer_end(cmd);
+		return;
+	}
 	switch(glparamstate.matrixmode) {
 	case 0:
 		glparamstate.cur_proj_mat++;
 		memcpy(glparamstate.projection_stack[glparamstate.cur_proj_mat],glparamstate.projection_matrix,sizeof(Mtx44));
+		glparamstate.projection_stack_kind[glparamstate.cur_proj_mat] = glparamstate.projection_kind;
 		break;
 	case 1:
 		glparamstate.cur_modv_mat++;
 		memcpy(glparamstate.modelview_stack[glparamstate.cur_modv_mat],glparamstate.modelview_matrix,sizeof(Mtx44));
+		glparamstate.modelview_stack_kind[glparamstate.cur_modv_mat] = glparamstate.modelview_kind;
 		break;
+	case 2: {
+		struct texunit * unit = &glparamstate.texunit[glparamstate.active_texture];
+		unit->cur_tex_mat++;
+		memcpy(unit->texture_stack[unit->cur_tex_mat],unit->texture_matrix,sizeof(Mtx44));
+		} break;
 	default: break;
 	}
 }
-void glLoadMatrixf( const GLfloat *m ) {
+// Matrix selected by glMatrixMode, NULL if none
+static float * _current_matrix() {
 	switch(glparamstate.matrixmode) {
-	case 0: memcpy(glparamstate.projection_matrix,m,sizeof(Mtx44)); break;
-	case 1: memcpy(glparamstate.modelview_matrix,m,sizeof(Mtx44)); break;
-	default: return;
+	case 0: return &glparamstate.projection_matrix[0][0];
+	case 1: return &glparamstate.modelview_matrix[0][0];
+	case 2: return &glparamstate.texunit[glparamstate.active_texture].texture_matrix[0][0];
+	case 3: return &glparamstate.palette_matrix[glparamstate.cur_palette][0][0];
+	default: return NULL;
 	}
-	glparamstate.dirty.bits.dirty_matrices = 1;
 }
-void glMultMatrixf( const GLfloat *m ) {
-	Mtx44 curr;
-
+// Kind of the selected matrix, only tracked for modelview and projection
+static unsigned char * _current_kind() {
+	static unsigned char untracked;
 	switch(glparamstate.matrixmode) {
-	case 0:
-		memcpy((float*)curr,&glparamstate.projection_matrix[0][0],sizeof(Mtx44));
-		_gl_matrix_multiply(&glparamstate.projection_matrix[0][0],(float*)curr,(float*)m);
-		break;
-	case 1:
-		memcpy((float*)curr,&glparamstate.modelview_matrix[0][0],sizeof(Mtx44));
-		_gl_matrix_multiply(&glparamstate.modelview_matrix[0][0],(float*)curr,(float*)m);
-		break;
-	default: break;
+	case 0: return &glparamstate.projection_kind;
+	case 1: return &glparamstate.modelview_kind;
+	default:
+		untracked = MTX_PROJECTIVE;
+		return &untracked;
 	}
-	glparamstate.dirty.bits.dirty_matrices = 1;
+}
+#define MTX_EPSILON 1e-5f
+static inline int _nearly(float a, float b) {
+	return fabsf(a - b) <= MTX_EPSILON*(1.0f + fabsf(b));
+}
+// Classifies a column major matrix
+static unsigned char _matrix_kind(const float * m) {
+	if (m[3] != 0 || m[7] != 0 || m[11] != 0 || m[15] != 1)
+		return MTX_PROJECTIVE;
+
+	// Squared lengths and dot products of the 3x3 columns
+	float l0 = m[0]*m[0] + m[1]*m[1] + m[2]*m[2];
+	float l1 = m[4]*m[4] + m[5]*m[5] + m[6]*m[6];
+	float l2 = m[8]*m[8] + m[9]*m[9] + m[10]*m[10];
+	float d01 = m[0]*m[4] + m[1]*m[5] + m[2]*m[6];
+	float d02 = m[0]*m[8] + m[1]*m[9] + m[2]*m[10];
+	float d12 = m[4]*m[8] + m[5]*m[9] + m[6]*m[10];
+	if (!_nearly(d01,0) || !_nearly(d02,0) || !_nearly(d12,0) || l0 == 0 ||
+	    !_nearly(l1,l0) || !_nearly(l2,l0))
+		return MTX_AFFINE;
+	if (!_nearly(l0,1))
+		return MTX_UNIFORM;
+	if (m[0] != 1 || m[5] != 1 || m[10] != 1)
+		return MTX_RIGID;
+	if (m[12] != 0 || m[13] != 0 || m[14] != 0)
+		return MTX_TRANSLATION;
+	return MTX_IDENTITY;
+}
+static inline void _combine_kind(unsigned char kind) {
+	unsigned char * k = _current_kind();
+	if (kind > *k) *k = kind;
+}
+void glLoadMatrixf( const GLfloat *m ) {
+	glcmdword_ * cmd;
+	if (_deferring() && (cmd = _defer_begin(DEFER_LOAD_MATRIX,16))) {
+		int i;
+		for (i = 0; i < 16; i++) cmd[i].f = m[i];
+		_defer_end(cmd);
+		return;
+	}
+	float * mtrx = _current_matrix();
+	if (!mtrx) return;
+
+	_mtx44_transpose(m,(float (*)[4])mtrx);
+	*_current_kind() = _matrix_kind(m);
+	_matrix_changed();
+}
+void glMultMatrixf( const GLfloat *m ) {
+	glcmdword_ * cmd;
+	if (_deferring() && (cmd = _defer_begin(DEFER_MULT_MATRIX,16))) {
+		int i;
+		for (i = 0; i < 16; i++) cmd[i].f = m[i];
+		_defer_end(cmd);
+		return;
+	}
+	Mtx44 mt;
+	float * mtrx = _current_matrix();
+	if (!mtrx) return;
+
+	_combine_kind(_matrix_kind(m));
+	_mtx44_transpose(m,mt);
+	// Affine products don't need the last row
+	if (*_current_kind() < MTX_PROJECTIVE)
+		_mtx_concat((float (*)[4])mtrx,mt,(float (*)[4])mtrx);
+	else
+		_mtx44_concat((float (*)[4])mtrx,mt,(float (*)[4])mtrx);
+	_matrix_changed();
 }
 void glLoadIdentity() {
-	float * mtrx;
-	switch(glparamstate.matrixmode) {
-	case 0: mtrx = &glparamstate.projection_matrix[0][0]; break;
-	case 1: mtrx = &glparamstate.modelview_matrix[0][0];  break;
-	default: return;
+	glcmdword_ * cmd;
+	if (_deferring() && (cmd = _defer_begin(DEFER_LOAD_IDENTITY,0))) {
+		_defer_end(cmd);
+		return;
 	}
+	float * mtrx = _current_matrix();
+	if (!mtrx) return;
 
 	mtrx[ 0] = 1.0f; mtrx[ 1] = 0.0f; mtrx[ 2] = 0.0f; mtrx[ 3] = 0.0f;
 	mtrx[ 4] = 0.0f; mtrx[ 5] = 1.0f; mtrx[ 6] = 0.0f; mtrx[ 7] = 0.0f;
 	mtrx[ 8] = 0.0f; mtrx[ 9] = 0.0f; mtrx[10] = 1.0f; mtrx[11] = 0.0f;
 	mtrx[12] = 0.0f; mtrx[13] = 0.0f; mtrx[14] = 0.0f; mtrx[15] = 1.0f;
+	*_current_kind() = MTX_IDENTITY;
 
-	glparamstate.dirty.bits.dirty_matrices = 1;
+	_matrix_changed();
 }
+// The transforms below multiply in place (M = M * T) touching only the
+// columns which change, and the last row only if it's not (0,0,0,1)
 void glScalef(GLfloat x, GLfloat y, GLfloat z) {
-	Mtx44 newmat; Mtx44 curr;
-	newmat[0][0] =    x; newmat[0][1] = 0.0f; newmat[0][2] = 0.0f; newmat[0][3] = 0.0f;
-	newmat[1][0] = 0.0f; newmat[1][1] =    y; newmat[1][2] = 0.0f; newmat[1][3] = 0.0f;
-	newmat[2][0] = 0.0f; newmat[2][1] = 0.0f; newmat[2][2] =    z; newmat[2][3] = 0.0f;
-	newmat[3][0] = 0.0f; newmat[3][1] = 0.0f; newmat[3][2] = 0.0f; newmat[3][3] = 1.0f;
-
-	switch(glparamstate.matrixmode) {
-	case 0:
-		memcpy((float*)curr,&glparamstate.projection_matrix[0][0],sizeof(Mtx44));
-		_gl_matrix_multiply(&glparamstate.projection_matrix[0][0],(float*)curr,(float*)newmat);
-		break;
-	case 1:
-		memcpy((float*)curr,&glparamstate.modelview_matrix[0][0],sizeof(Mtx44));
-		_gl_matrix_multiply(&glparamstate.modelview_matrix[0][0],(float*)curr,(float*)newmat);
-		break;
-	default: break;
+	glcmdword_ * cmd;
+	if (_deferring() && (cmd = _defer_begin(DEFER_SCALE,3))) {
+		cmd[0].f = x; cmd[1].f = y; cmd[2].f = z;
+		_defer_end(cmd);
+		return;
 	}
-
-	glparamstate.dirty.bits.dirty_matrices = 1;
+	float * mtrx = _current_matrix();
+	if (!mtrx) return;
+
+	int i, rows = *_current_kind() == MTX_PROJECTIVE ? 4 : 3;
+	for (i = 0; i < rows; i++) {
+		mtrx[i*4]   *= x;
+		mtrx[i*4+1] *= y;
+		mtrx[i*4+2] *= z;
+	}
+	if (x != y || y != z || x == 0)
+		_combine_kind(MTX_AFFINE);
+	else if (x != 1.0f)
+		_combine_kind(x == -1.0f ? MTX_RIGID : MTX_UNIFORM);
+	_matrix_changed();
 }
 void glTranslatef(GLfloat x, GLfloat y, GLfloat z) {
-	Mtx44 newmat; Mtx44 curr;
-	newmat[0][0] = 1.0f; newmat[0][1] = 0.0f; newmat[0][2] = 0.0f; newmat[0][3] = 0.0f;
-	newmat[1][0] = 0.0f; newmat[1][1] = 1.0f; newmat[1][2] = 0.0f; newmat[1][3] = 0.0f;
-	newmat[2][0] = 0.0f; newmat[2][1] = 0.0f; newmat[2][2] = 1.0f; newmat[2][3] = 0.0f;
-	newmat[3][0] =    x; newmat[3][1] =    y; newmat[3][2] =    z; newmat[3][3] = 1.0f;
-
-	switch(glparamstate.matrixmode) {
-	case 0:
-		memcpy((float*)curr,&glparamstate.projection_matrix[0][0],sizeof(Mtx44));
-		_gl_matrix_multiply(&glparamstate.projection_matrix[0][0],(float*)curr,(float*)newmat);
-		break;
-	case 1:
-		memcpy((float*)curr,&glparamstate.modelview_matrix[0][0],sizeof(Mtx44));
-		_gl_matrix_multiply(&glparamstate.modelview_matrix[0][0],(float*)curr,(float*)newmat);
-		break;
-	default: break;
+	glcmdword_ * cmd;
+	if (_deferring() && (cmd = _defer_begin(DEFER_TRANSLATE,3))) {
+		cmd[0].f = x; cmd[1].f = y; cmd[2].f = z;
+		_defer_end(cmd);
+		return;
 	}
-
-	glparamstate.dirty.bits.dirty_matrices = 1;
+	float * mtrx = _current_matrix();
+	if (!mtrx) return;
+
+	int i, rows = *_current_kind() == MTX_PROJECTIVE ? 4 : 3;
+	for (i = 0; i < rows; i++)
+		mtrx[i*4+3] += mtrx[i*4]*x + mtrx[i*4+1]*y + mtrx[i*4+2]*z;
+	_combine_kind(MTX_TRANSLATION);
+	_matrix_changed();
 }
 void glRotatef(GLfloat angle, GLfloat x, GLfloat y, GLfloat z) {
+	glcmdword_ * cmd;
+	if (_deferring() && (cmd = _defer_begin(DEFER_ROTATE,4))) {
+		cmd[0].f = angle; cmd[1].f = x; cmd[2].f = y; cmd[3].f = z;
+		_defer_end(cmd);
+		return;
+	}
+	float * mtrx = _current_matrix();
+	if (!mtrx) return;
+
 	angle *= (M_PI/180.0f);
 	float c = cosf(angle);
 	float s = sinf(angle);
 	float t = 1.0f-c;
-	Mtx44 newmat; Mtx44 curr;
+	float rot[3][3];
 
 	float imod = 1.0f/sqrtf(x*x+y*y+z*z);
 	x *= imod; y *= imod; z *= imod;
 
-	newmat[0][0] = t*x*x+c;   newmat[0][1] = t*x*y+s*z; newmat[0][2] = t*x*z-s*y; newmat[0][3] = 0;
-	newmat[1][0] = t*x*y-s*z; newmat[1][1] = t*y*y+c;   newmat[1][2] = t*y*z+s*x; newmat[1][3] = 0;
-	newmat[2][0] = t*x*z+s*y; newmat[2][1] = t*y*z-s*x; newmat[2][2] = t*z*z+c;   newmat[2][3] = 0;
-	newmat[3][0] = 0;         newmat[3][1] = 0;         newmat[3][2] = 0;         newmat[3][3] = 1;
+	// Transposed: rot[j] is column j
+	rot[0][0] = t*x*x+c;   rot[0][1] = t*x*y+s*z; rot[0][2] = t*x*z-s*y;
+	rot[1][0] = t*x*y-s*z; rot[1][1] = t*y*y+c;   rot[1][2] = t*y*z+s*x;
+	rot[2][0] = t*x*z+s*y; rot[2][1] = t*y*z-s*x; rot[2][2] = t*z*z+c;
+
+	int i, rows = *_current_kind() == MTX_PROJECTIVE ? 4 : 3;
+	for (i = 0; i < rows; i++) {
+		float * row = &mtrx[i*4];
+		float m0 = row[0], m1 = row[1], m2 = row[2];
+		row[0] = m0*rot[0][0] + m1*rot[0][1] + m2*rot[0][2];
+		row[1] = m0*rot[1][0] + m1*rot[1][1] + m2*rot[1][2];
+		row[2] = m0*rot[2][0] + m1*rot[2][1] + m2*rot[2][2];
+	}
+	_combine_kind(MTX_RIGID);
+	_matrix_changed();
+}
 
-	switch(glparamstate.matrixmode) {
-	case 0:
-		memcpy((float*)curr,&glparamstate.projection_matrix[0][0],sizeof(Mtx44));
-		_gl_matrix_multiply(&glparamstate.projection_matrix[0][0],(float*)curr,(float*)newmat);
+// Extracts the frustum planes from projection * modelview, so they are in
+// object space. GX clips Z to [-w,0]. Planes are normalized for sphere tests.
+static void _update_frustum() {
+	float clip[4][4];
+	int i, j;
+	if (glparamstate.frustum_valid) return;
+
+	_mtx44_concat(glparamstate.projection_matrix,glparamstate.modelview_matrix,clip);
+
+	for (j = 0; j < 4; j++) {
+		glparamstate.frustum[0][j] = clip[3][j] + clip[0][j];  // Left
+		glparamstate.frustum[1][j] = clip[3][j] - clip[0][j];  // Right
+		glparamstate.frustum[2][j] = clip[3][j] + clip[1][j];  // Bottom
+		glparamstate.frustum[3][j] = clip[3][j] - clip[1][j];  // Top
+		glparamstate.frustum[4][j] = clip[3][j] + clip[2][j];  // Near
+		glparamstate.frustum[5][j] = -clip[2][j];              // Far
+	}
+	for (i = 0; i < 6; i++) {
+		float * p = glparamstate.frustum[i];
+		float len = sqrtf(p[0]*p[0] + p[1]*p[1] + p[2]*p[2]);
+		if (len > 0) {
+			p[0] /= len; p[1] /= len; p[2] /= len; p[3] /= len;
+		}
+	}
+	glparamstate.frustum_valid = 1;
+}
+
+GLboolean ogxIsBoxVisible(const GLfloat min[3], const GLfloat max[3]) {
+	_defer_sync();
+	int i;
+	_update_frustum();
+	for (i = 0; i < 6; i++) {
+		const float * p = glparamstate.frustum[i];
+		// Corner which is the furthest along the plane normal
+		float x = p[0] >= 0 ? max[0] : min[0];
+		float y = p[1] >= 0 ? max[1] : min[1];
+		float z = p[2] >= 0 ? max[2] : min[2];
+		if (p[0]*x + p[1]*y + p[2]*z + p[3] < 0)
+			return GL_FALSE;
+	}
+	return GL_TRUE;
+}
+
+GLboolean ogxIsSphereVisible(const GLfloat center[3], GLfloat radius) {
+	_defer_sync();
+	int i;
+	_update_frustum();
+	for (i = 0; i < 6; i++) {
+		const float * p = glparamstate.frustum[i];
+		if (p[0]*center[0] + p[1]*center[1] + p[2]*center[2] + p[3] < -radius)
+			return GL_FALSE;
+	}
+	return GL_TRUE;
+}
+
+void ogxSetBoundingBox(const GLfloat * min, const GLfloat * max) {
+	_defer_sync();
+	if (min && max) {
+		memcpy(glparamstate.bbox_min,min,sizeof(float)*3);
+		memcpy(glparamstate.bbox_max,max,sizeof(float)*3);
+		glparamstate.bbox_set = 1;
+	}else{
+		glparamstate.bbox_set = 0;
+	}
+}
+
+void ogxSetAutoCulling(GLboolean enable) {
+	_defer_sync();
+	glparamstate.autocull = (enable != GL_FALSE);
+}
+
+// Whether a draw can be skipped, as its bounding box is not visible
+static int _draw_culled() {
+	return glparamstate.autocull && glparamstate.bbox_set &&
+	       !ogxIsBoxVisible(glparamstate.bbox_min,glparamstate.bbox_max);
+}
+
+void ogxSetIndexedFetch(GLboolean enable) {
+	_defer_sync();
+	glparamstate.indexed_fetch = (enable != GL_FALSE);
+}
+
+void ogxSetDrawCoalescing(GLboolean enable) {
+	__flush_batch();
+	draw_batch.enabled = (enable != GL_FALSE);
+}
+
+void ogxGetDrawCoalescingStats(GLuint * draws, GLuint * merged, GLuint * batches) {
+	_defer_sync();
+	if (draws)   *draws   = draw_batch.draws;
+	if (merged)  *merged  = draw_batch.merged;
+	if (batches) *batches = draw_batch.batches;
+}
+
+void ogxResetDrawCoalescingStats() {
+	_defer_sync();
+	draw_batch.draws = draw_batch.merged = draw_batch.batches = 0;
+}
+
+// Texture coordinate generation. Eye planes are transformed by the inverse
+// of the modelview matrix at the time they are specified, as GL does.
+void glTexGenfv(GLenum coord, GLenum pname, const GLfloat * params) {
+	__flush_batch();
+	int c = coord - GL_S;
+	if (c < 0 || c > 3) return;
+	struct texunit * unit = &glparamstate.texunit[glparamstate.active_texture];
+
+	switch (pname) {
+	case GL_TEXTURE_GEN_MODE:
+		glTexGeni(coord,pname,(GLint)params[0]);
 		break;
-	case 1:
-		memcpy((float*)curr,&glparamstate.modelview_matrix[0][0],sizeof(Mtx44));
-		_gl_matrix_multiply(&glparamstate.modelview_matrix[0][0],(float*)curr,(float*)newmat);
+	case GL_OBJECT_PLANE:
+		memcpy(unit->texgen_objplane[c],params,sizeof(float)*4);
 		break;
+	case GL_EYE_PLANE: {
+		int j;
+		Mtx mvinverse;
+		_mtx_inverse(glparamstate.modelview_matrix,mvinverse);
+
+		// plane * inverse(modelview), last row of the inverse is (0,0,0,1)
+		for (j = 0; j < 4; j++)
+			unit->texgen_eyeplane[c][j] = params[0]*mvinverse[0][j] + params[1]*mvinverse[1][j] + params[2]*mvinverse[2][j];
+		unit->texgen_eyeplane[c][3] += params[3];
+		} break;
 	default: break;
-	}
+	};
+	glparamstate.dirty.bits.dirty_texmtx = 1;
+}
+void glTexGeni(GLenum coord, GLenum pname, GLint param) {
+	__flush_batch();
+	int c = coord - GL_S;
+	if (c < 0 || c > 3 || pname != GL_TEXTURE_GEN_MODE) return;
 
-	glparamstate.dirty.bits.dirty_matrices = 1;
+	switch (param) {
+	case GL_OBJECT_LINEAR:
+	case GL_EYE_LINEAR:
+		glparamstate.texunit[glparamstate.active_texture].texgen_mode[c] = param;
+		break;
+	case GL_SPHERE_MAP:
+		if (c < 2) glparamstate.texunit[glparamstate.active_texture].texgen_mode[c] = param;
+		break;
+	default: break;
+	};
+	glparamstate.dirty.bits.dirty_texmtx = 1;
+}
+void glTexGenf(GLenum coord, GLenum pname, GLfloat param) {
+	glTexGeni(coord,pname,(GLint)param);
+}
+void glTexGeniv(GLenum coord, GLenum pname, const GLint * params) {
+	GLfloat p[4] = { params[0], 0, 0, 0 };
+	if (pname != GL_TEXTURE_GEN_MODE) {
+		p[1] = params[1]; p[2] = params[2]; p[3] = params[3];
+	}
+	glTexGenfv(coord,pname,p);
 }
 
 void glClearColor(GLclampf red, GLclampf green, GLclampf blue, GLclampf alpha) {
+	glcmdword_ * cmd;
+	if (_deferring() && (cmd = _defer_begin(DEFER_CLEAR_COLOR,4))) {
+		cmd[0].f = red; cmd[1].f = green; cmd[2].f = blue; cmd[3].f = alpha;
+		_defer_end(cmd);
+		return;
+	}
 	glparamstate.clear_color.r = _clampf_01(red)*255.0f;
 	glparamstate.clear_color.g = _clampf_01(green)*255.0f;
 	glparamstate.clear_color.b = _clampf_01(blue)*255.0f;
 	glparamstate.clear_color.a = _clampf_01(alpha)*255.0f;
 }
 void glClearDepth(GLclampd depth) {
+	_defer_sync();
 	glparamstate.clearz = _clampf_01(depth);
 }
 
 
-// Clearing is simulated by rendering a big square with the depth value
-// and the desired color
-void glClear(GLbitfield mask) {
-	// Tweak the Z value to avoid floating point errors. dpeth goes from 0.001 to 0.998
-	float depth = (0.998f*glparamstate.clearz)+0.001f;
-	if (mask & GL_DEPTH_BUFFER_BIT) GX_SetZMode(GX_TRUE,GX_ALWAYS,GX_TRUE);
-	else GX_SetZMode(GX_FALSE,GX_ALWAYS,GX_FALSE);
-
-	if (mask & GL_COLOR_BUFFER_BIT) GX_SetColorUpdate(GX_TRUE);
-	else GX_SetColorUpdate(GX_TRUE);
+// Clear depth rounded to the precision of the EFB Z format. Depth values are
+// 24 bit, Z16 formats only keep the top 16 bits.
+static u32 _clear_z_value() {
+	if (glparamstate.pixelfmt == GX_PF_RGB565_Z16)
+		return ((u32)(glparamstate.clearz*0xFFFF + 0.5f)) << 8;
+	return glparamstate.clearz*0x00FFFFFF + 0.5f;
+}
 
-	GX_SetBlendMode(GX_BM_NONE, GX_BL_ONE, GX_BL_ZERO, GX_LO_COPY);
-	GX_SetCullMode(GX_CULL_NONE);
+// Copies the EFB to the XFB and clears it in the same pass, using the
+// current clear values since the next frame most likely clears to them
+void ogxCopyDisp(void * xfb) {
+	__flush_batch();
+	u32 z = _clear_z_value();
+	GX_SetCopyClear(glparamstate.clear_color, z);
+	GX_CopyDisp(xfb, GX_TRUE);
+
+	glparamstate.efb_clear.color = glparamstate.clear_color;
+	glparamstate.efb_clear.z = z;
+	glparamstate.efb_clear.clean = 1;
+}
 
-	static float modl[3][4];
-	modl[0][0] = 1.0f; modl[0][1] = 0.0f; modl[0][2] = 0.0f; modl[0][3] = 0.0f;
-	modl[1][0] = 0.0f; modl[1][1] = 1.0f; modl[1][2] = 0.0f; modl[1][3] = 0.0f;
-	modl[2][0] = 0.0f; modl[2][1] = 0.0f; modl[2][2] = 1.0f; modl[2][3] = 0.0f;
-	GX_LoadPosMtxImm(modl,GX_PNMTX3);
-	GX_SetCurrentMtx(GX_PNMTX3);
+/*
 
-	Mtx44 proj;
-	guOrtho (proj,-1,1,-1,1,-1,1);
-	GX_LoadProjectionMtx(proj, GX_ORTHOGRAPHIC);
+  Context and buffer swapping. opengx owns the XFBs and the copies to
+  them, the swap only queues the copy so the CPU can go on with the next
+  frame while the GPU finishes this one. It only waits when all the XFBs
+  are in use (the frame rate is then paced by the retrace).
 
-	GX_SetNumChans(1);
-	GX_SetNumTevStages(1);
-	GX_SetNumTexGens(0);
+*/
 
-	GX_SetTevOp(GX_TEVSTAGE0,GX_PASSCLR);
-    GX_SetTevOrder(GX_TEVSTAGE0, GX_TEXCOORDNULL, GX_TEXMAP_NULL, GX_COLOR0A0);
-	GX_SetChanCtrl(GX_COLOR0A0, GX_DISABLE, GX_SRC_VTX, GX_SRC_VTX, 0, GX_DF_NONE, GX_AF_NONE);
+// Called by VI just before the new framebuffer address is latched
+static void _retrace_callback(u32 retrace) {
+	u64 now = gettime();
+	if (ogx_context.dynres.last_retrace)
+		ogx_context.dynres.retrace_us = diff_usec(ogx_context.dynres.last_retrace, now);
+	ogx_context.dynres.last_retrace = now;
 
-	GX_ClearVtxDesc();
-	GX_SetVtxDesc(GX_VA_POS, GX_DIRECT);
-	GX_SetVtxDesc(GX_VA_CLR0, GX_DIRECT);
-	GX_SetVtxAttrFmt(GX_VTXFMT0, GX_VA_POS, GX_POS_XYZ, GX_F32, 0);
-	GX_SetVtxAttrFmt(GX_VTXFMT0, GX_VA_CLR0, GX_CLR_RGBA, GX_RGBA8, 0);
-	GX_InvVtxCache();
+	if (ogx_context.head == ogx_context.tail) return;
 
-	GX_Begin(GX_QUADS,GX_VTXFMT0,4);
-	GX_Position3f32(-1,-1,-depth);
-	GX_Color4u8(glparamstate.clear_color.r,glparamstate.clear_color.g,glparamstate.clear_color.b,glparamstate.clear_color.a);
-	GX_Position3f32( 1,-1,-depth);
-	GX_Color4u8(glparamstate.clear_color.r,glparamstate.clear_color.g,glparamstate.clear_color.b,glparamstate.clear_color.a);
-	GX_Position3f32( 1, 1,-depth);
-	GX_Color4u8(glparamstate.clear_color.r,glparamstate.clear_color.g,glparamstate.clear_color.b,glparamstate.clear_color.a);
-	GX_Position3f32(-1, 1,-depth);
-	GX_Color4u8(glparamstate.clear_color.r,glparamstate.clear_color.g,glparamstate.clear_color.b,glparamstate.clear_color.a);
-	GX_End();
+	int i = ogx_context.head % MAX_XFB;
+	if (!_draw_sync_passed(ogx_context.queue[i].token)) return;
 
-	glparamstate.dirty.all = ~0;
+	ogx_context.shown = ogx_context.queue[i].xfb;
+	VIDEO_SetNextFramebuffer(ogx_context.xfb[ogx_context.shown]);
+	VIDEO_Flush();
+	ogx_context.head++;
+}
+
+// Timestamps the frame start and end tokens as the GPU passes them. A frame
+// which ends right after being submitted kept the GPU waiting for the CPU,
+// its GPU time doesn't tell anything about the GPU load.
+static void _drawsync_callback(u16 token) {
+	struct _dynres * d = &ogx_context.dynres;
+	u64 now = gettime();
+	if (token == d->start_token) {
+		d->start_time = now;
+	}else if (token == d->end_token && d->start_time) {
+		if (diff_usec(d->submit_time, now) < DYNRES_IDLE_US)
+			d->gpu_us = 0;
+		else
+			d->gpu_us = diff_usec(d->start_time, now);
+		d->start_time = 0;
+		d->measured++;
+	}
+}
+
+// Marks the start of the frame for the GPU time, at its first draw
+static inline void _dynres_frame_start() {
+	if (!ogx_context.dynres.enabled || ogx_context.dynres.started) return;
+	ogx_context.dynres.started = 1;
+	ogx_context.dynres.start_token = drawsync_token + 1;   // The one issued next
+	_issue_draw_sync();
+}
+
+// The EFB lines to copy, stretched to the XFB height
+static void _setup_disp_copy(int efbheight) {
+	GXRModeObj * rmode = ogx_context.rmode;
+	u32 xfbheight = GX_SetDispCopyYScale(GX_GetYScaleFactor(efbheight, rmode->xfbHeight));
+	GX_SetDispCopySrc(0, 0, rmode->fbWidth, efbheight);
+	GX_SetDispCopyDst(rmode->fbWidth, xfbheight);
+	ogx_context.copy_height = efbheight;
+	ogx_context.copy_scale = (float)efbheight/rmode->efbHeight;
+}
+
+GLboolean ogxCreateContext(GXRModeObj * rmode, int buffers, int efb_format) {
+	int i;
+	// A single context, GX and the XFBs are in use once created
+	if (ogx_context.rmode || buffers < 2 || buffers > MAX_XFB) return GL_FALSE;
+
+	VIDEO_Init();
+	if (!rmode) rmode = VIDEO_GetPreferredMode(NULL);
+
+	// Antialiasing needs the 16 bit format, otherwise the cheapest one
+	// with 8 bits per channel
+	unsigned char pixelfmt;
+	switch (efb_format) {
+	case OGX_EFB_DEFAULT:    pixelfmt = rmode->aa ? GX_PF_RGB565_Z16 : GX_PF_RGB8_Z24; break;
+	case OGX_EFB_RGB8_Z24:   pixelfmt = GX_PF_RGB8_Z24; break;
+	case OGX_EFB_RGBA6_Z24:  pixelfmt = GX_PF_RGBA6_Z24; break;
+	case OGX_EFB_RGB565_Z16: pixelfmt = GX_PF_RGB565_Z16; break;
+	default: return GL_FALSE;
+	}
+	if (rmode->aa && pixelfmt != GX_PF_RGB565_Z16) return GL_FALSE;
+
+	ogx_context.fifo = memalign(32, GX_FIFO_SIZE);
+	if (!ogx_context.fifo) return GL_FALSE;
+	memset(ogx_context.fifo, 0, GX_FIFO_SIZE);
+
+	for (i = 0; i < buffers; i++) {
+		void * xfb = SYS_AllocateFramebuffer(rmode);
+		if (!xfb) {
+			while (i-- > 0) free(MEM_K1_TO_K0(ogx_context.xfb[i]));
+			free(ogx_context.fifo);
+			return GL_FALSE;
+		}
+		ogx_context.xfb[i] = MEM_K0_TO_K1(xfb);
+		VIDEO_ClearFrameBuffer(rmode, ogx_context.xfb[i], COLOR_BLACK);
+	}
+	ogx_context.rmode = rmode;
+	ogx_context.numxfb = buffers;
+	ogx_context.shown = 0;
+	ogx_context.draw = 1;
+	ogx_context.head = ogx_context.tail = 0;
+	ogx_context.dynres.enabled = 0;
+	ogx_context.dynres.scale = 1.0f;
+
+	VIDEO_Configure(rmode);
+	VIDEO_SetNextFramebuffer(ogx_context.xfb[0]);
+	VIDEO_SetBlack(FALSE);
+	VIDEO_Flush();
+	VIDEO_WaitVSync();
+	if (rmode->viTVMode & VI_NON_INTERLACE) VIDEO_WaitVSync();
+
+	GX_Init(ogx_context.fifo, GX_FIFO_SIZE);
+	_setup_disp_copy(rmode->efbHeight);
+	GX_SetCopyFilter(rmode->aa, rmode->sample_pattern, GX_TRUE, rmode->vfilter);
+	GX_SetFieldMode(rmode->field_rendering, (rmode->viHeight == 2*rmode->xfbHeight) ? GX_ENABLE : GX_DISABLE);
+	GX_SetPixelFmt(pixelfmt, GX_ZC_LINEAR);
+	GX_SetAlphaUpdate(pixelfmt == GX_PF_RGBA6_Z24);
+	GX_SetCullMode(GX_CULL_NONE);
+
+	InitializeGLdata();
+	glparamstate.pixelfmt = pixelfmt;
+	glViewport(0, 0, rmode->fbWidth, rmode->efbHeight);
+
+	// Start with a clear EFB, glClear is free on the first frame too. The
+	// copy goes to an XFB which is not shown yet.
+	ogxCopyDisp(ogx_context.xfb[ogx_context.draw]);
+	GX_DrawDone();
+
+	VIDEO_SetPreRetraceCallback(_retrace_callback);
+	GX_SetDrawSyncCallback(_drawsync_callback);
+	return GL_TRUE;
+}
+
+// Goes down as soon as a frame takes the GPU longer than a retrace and up
+// slowly, the new scale is used starting from the next frame. Frames which
+// are CPU bound don't change it.
+static void _update_resolution() {
+	struct _dynres * d = &ogx_context.dynres;
+	if (d->measured == d->used || d->retrace_us == 0) return;
+	d->used = d->measured;
+
+	float scale = d->scale;
+	int gpu_us = d->gpu_us;
+	if (gpu_us > d->retrace_us*DYNRES_HIGH) {
+		scale -= DYNRES_STEP;
+		d->calm = 0;
+	}else if (gpu_us < d->retrace_us*DYNRES_LOW) {
+		if (++d->calm >= DYNRES_CALM_FRAMES) {
+			scale += DYNRES_STEP;
+			d->calm = 0;
+		}
+	}else{
+		d->calm = 0;
+	}
+
+	if (scale < ogx_context.dynres.min_scale) scale = ogx_context.dynres.min_scale;
+	if (scale > 1.0f) scale = 1.0f;
+	ogx_context.dynres.scale = scale;
+
+	// The copy source must have an even number of lines
+	int height = ((int)(ogx_context.rmode->efbHeight*scale)) & ~1;
+	if (height == ogx_context.copy_height) return;
+
+	// Lines below the last copy were not cleared by it
+	if (height > ogx_context.copy_height)
+		glparamstate.efb_clear.clean = 0;
+	_setup_disp_copy(height);
+	_apply_viewport();
+}
+
+void ogxSwapBuffers() {
+	glcmdword_ * cmd;
+	if (_deferring() && (cmd = _defer_begin(DEFER_SWAP,0))) {
+		_defer_end(cmd);
+		return;
+	}
+	if (!ogx_context.rmode) return;   // No context
+
+	// With double buffering this waits for the previous frame to be shown
+	while (ogx_context.tail - ogx_context.head >= ogx_context.numxfb-1)
+		VIDEO_WaitVSync();
+
+	int i = ogx_context.tail % MAX_XFB;
+	_dynres_frame_start();   // Frames with no draws
+	ogxCopyDisp(ogx_context.xfb[ogx_context.draw]);
+	ogx_context.dynres.submit_time = gettime();
+	ogx_context.dynres.end_token = drawsync_token + 1;
+	ogx_context.queue[i].xfb = ogx_context.draw;
+	ogx_context.queue[i].token = _issue_draw_sync();
+	ogx_context.tail++;
+	ogx_context.dynres.started = 0;
+
+	ogx_context.draw = (ogx_context.draw + 1) % ogx_context.numxfb;
+
+	if (ogx_context.dynres.enabled)
+		_update_resolution();
+}
+
+void ogxSetDynamicResolution(GLboolean enable, GLfloat min_scale) {
+	__flush_batch();
+	// Needs the display copy of the context
+	ogx_context.dynres.enabled = (enable && ogx_context.rmode) ? 1 : 0;
+	ogx_context.dynres.min_scale = _clampf_01(min_scale);
+	ogx_context.dynres.scale = 1.0f;
+	ogx_context.dynres.calm = 0;
+	ogx_context.dynres.started = 0;
+	ogx_context.dynres.used = ogx_context.dynres.measured;
+	if (ogx_context.rmode && ogx_context.copy_height != ogx_context.rmode->efbHeight) {
+		_setup_disp_copy(ogx_context.rmode->efbHeight);
+		glparamstate.efb_clear.clean = 0;
+	}
+	_apply_viewport();
+}
+
+GLfloat ogxGetResolutionScale() {
+	_defer_sync();
+	return ogx_context.dynres.enabled ? ogx_context.copy_scale : 1.0f;
+}
+
+// Right after ogxCopyDisp the EFB already holds the clear values, whatever
+// the scissor. Otherwise clearing is simulated by rendering a big square with
+// the depth value and the desired color
+void glClear(GLbitfield mask) {
+	glcmdword_ * cmd;
+	if (_deferring() && (cmd = _defer_begin(DEFER_CLEAR,1))) {
+		cmd[0].i = mask;
+		_defer_end(cmd);
+		return;
+	}
+	__flush_batch();
+	if (glparamstate.efb_clear.clean) {
+		GXColor c = glparamstate.clear_color, e = glparamstate.efb_clear.color;
+		int color_ok = !(mask & GL_COLOR_BUFFER_BIT) ||
+		               (c.r == e.r && c.g == e.g && c.b == e.b && c.a == e.a);
+		int depth_ok = !(mask & GL_DEPTH_BUFFER_BIT) || _clear_z_value() == glparamstate.efb_clear.z;
+		if (color_ok && depth_ok) return;
+	}
+	glparamstate.efb_clear.clean = 0;
+	_dynres_frame_start();
+
+	// The quad covers the scissor rectangle, and its Z goes straight to the
+	// EFB: it is not clipped and glDepthRange doesn't apply to it
+	float s = _viewport_scale();
+	int * sc = glparamstate.scissor;
+	GX_SetViewport(sc[0], sc[1]*s, sc[2], sc[3]*s, 0.0f, 1.0f);
+	GX_SetClipMode(GX_CLIP_DISABLE);
+	float depth = _clear_z_value()/16777215.0f - 1.0f;
+	if (mask & GL_DEPTH_BUFFER_BIT) GX_SetZMode(GX_TRUE,GX_ALWAYS,glparamstate.zwrite);
+	else GX_SetZMode(GX_FALSE,GX_ALWAYS,GX_FALSE);
+
+	if (mask & GL_COLOR_BUFFER_BIT) GX_SetColorUpdate(glparamstate.colorupdate);
+	else GX_SetColorUpdate(GX_FALSE);
+
+	GX_SetBlendMode(GX_BM_NONE, GX_BL_ONE, GX_BL_ZERO, GX_LO_COPY);
+	GX_SetCullMode(GX_CULL_NONE);
+	if (glparamstate.fog.enabled) {
+		GXColor nofog = {0,0,0,0};
+		GX_SetFog(GX_FOG_NONE, 0, 1, 0.1f, 1, nofog);
+	}
+	if (glparamstate.alphatest)
+		GX_SetAlphaCompare(GX_ALWAYS, 0, GX_AOP_AND, GX_ALWAYS, 0);
+
+	static float modl[3][4];
+	modl[0][0] = 1.0f; modl[0][1] = 0.0f; modl[0][2] = 0.0f; modl[0][3] = 0.0f;
+	modl[1][0] = 0.0f; modl[1][1] = 1.0f; modl[1][2] = 0.0f; modl[1][3] = 0.0f;
+	modl[2][0] = 0.0f; modl[2][1] = 0.0f; modl[2][2] = 1.0f; modl[2][3] = 0.0f;
+	GX_SetCurrentMtx(GX_PNMTX0 + _load_pnmtx(modl,MTX_IDENTITY)*3);
+
+	// Clip space Z in [-1,0] is mapped to the whole depth range
+	Mtx44 proj;
+	memset(proj, 0, sizeof(proj));
+	proj[0][0] = proj[1][1] = proj[2][2] = proj[3][3] = 1.0f;
+	GX_LoadProjectionMtx(proj, GX_ORTHOGRAPHIC);
+
+	GX_SetNumChans(1);
+	GX_SetNumTevStages(1);
+	GX_SetNumTexGens(0);
+
+	GX_SetTevOp(GX_TEVSTAGE0,GX_PASSCLR);
+    GX_SetTevOrder(GX_TEVSTAGE0, GX_TEXCOORDNULL, GX_TEXMAP_NULL, GX_COLOR0A0);
+	GX_SetChanCtrl(GX_COLOR0A0, GX_DISABLE, GX_SRC_VTX, GX_SRC_VTX, 0, GX_DF_NONE, GX_AF_NONE);
+
+	GX_ClearVtxDesc();
+	GX_SetVtxDesc(GX_VA_POS, GX_DIRECT);
+	GX_SetVtxDesc(GX_VA_CLR0, GX_DIRECT);
+	GX_SetVtxAttrFmt(GX_VTXFMT0, GX_VA_POS, GX_POS_XYZ, GX_F32, 0);
+	GX_SetVtxAttrFmt(GX_VTXFMT0, GX_VA_CLR0, GX_CLR_RGBA, GX_RGBA8, 0);
+	GX_InvVtxCache();
+
+	GX_Begin(GX_QUADS,GX_VTXFMT0,4);
+	GX_Position3f32(-1,-1,depth);
+	GX_Color4u8(glparamstate.clear_color.r,glparamstate.clear_color.g,glparamstate.clear_color.b,glparamstate.clear_color.a);
+	GX_Position3f32( 1,-1,depth);
+	GX_Color4u8(glparamstate.clear_color.r,glparamstate.clear_color.g,glparamstate.clear_color.b,glparamstate.clear_color.a);
+	GX_Position3f32( 1, 1,depth);
+	GX_Color4u8(glparamstate.clear_color.r,glparamstate.clear_color.g,glparamstate.clear_color.b,glparamstate.clear_color.a);
+	GX_Position3f32(-1, 1,depth);
+	GX_Color4u8(glparamstate.clear_color.r,glparamstate.clear_color.g,glparamstate.clear_color.b,glparamstate.clear_color.a);
+	GX_End();
+
+	// Restore what the quad changed, render stages and vertex formats are
+	// set up by every draw anyway
+	GX_SetColorUpdate(glparamstate.colorupdate);
+	GX_SetClipMode(GX_CLIP_ENABLE);
+	_apply_viewport();
+	if (glparamstate.cullenabled) glEnable(GL_CULL_FACE);
+	glparamstate.dirty.bits.dirty_z = 1;
+	glparamstate.dirty.bits.dirty_blend = 1;
+	glparamstate.dirty.bits.dirty_alpha = 1;
+	glparamstate.dirty.bits.dirty_fog = 1;
+	glparamstate.dirty.bits.dirty_matrices = 1;
+	glparamstate.dirty.bits.dirty_texmtx = 1;
 }
 
 void glDepthFunc(GLenum func) {
+	glcmdword_ * cmd;
+	if (_deferring() && (cmd = _defer_begin(DEFER_DEPTH_FUNC,1))) {
+		cmd[0].i = func;
+		_defer_end(cmd);
+		return;
+	}
 	switch (func) {
 	case GL_NEVER:     glparamstate.zfunc = GX_NEVER; break;
 	case GL_LESS:      glparamstate.zfunc = GX_LESS; break;
@@ -884,6 +2092,12 @@ void glDepthFunc(GLenum func) {
 	glparamstate.dirty.bits.dirty_z = 1;
 }
 void glDepthMask(GLboolean flag) {
+	glcmdword_ * cmd;
+	if (_deferring() && (cmd = _defer_begin(DEFER_DEPTH_MASK,1))) {
+		cmd[0].i = flag;
+		_defer_end(cmd);
+		return;
+	}
 	if (flag == GL_FALSE || flag == 0)
 		glparamstate.zwrite = GX_FALSE;
 	else
@@ -891,14 +2105,71 @@ void glDepthMask(GLboolean flag) {
 	glparamstate.dirty.bits.dirty_z = 1;
 }
 
-void glFlush() {} // All commands are sent immediately to draw, no queue, so pointless
+void glFogf(GLenum pname, GLfloat param) {
+	_defer_sync();
+	switch (pname) {
+	case GL_FOG_MODE:    glparamstate.fog.mode = (GLenum)param; break;
+	case GL_FOG_DENSITY: glparamstate.fog.density = param; break;
+	case GL_FOG_START:   glparamstate.fog.start = param; break;
+	case GL_FOG_END:     glparamstate.fog.end = param; break;
+	default: return;
+	}
+	glparamstate.dirty.bits.dirty_fog = 1;
+}
+void glFogi(GLenum pname, GLint param) {
+	_defer_sync();
+	if (pname == GL_FOG_MODE) {
+		glparamstate.fog.mode = param;
+		glparamstate.dirty.bits.dirty_fog = 1;
+	}else{
+		glFogf(pname,param);
+	}
+}
+void glFogfv(GLenum pname, const GLfloat * params) {
+	_defer_sync();
+	if (pname == GL_FOG_COLOR) {
+		memcpy(glparamstate.fog.color,params,sizeof(float)*4);
+		glparamstate.dirty.bits.dirty_fog = 1;
+	}else{
+		glFogf(pname,params[0]);
+	}
+}
+void glFogiv(GLenum pname, const GLint * params) {
+	_defer_sync();
+	if (pname == GL_FOG_COLOR) {
+		// Integer colors map [-2^31,2^31-1] to [-1,1]
+		int i;
+		for (i = 0; i < 4; i++)
+			glparamstate.fog.color[i] = params[i]/2147483647.0f;
+		glparamstate.dirty.bits.dirty_fog = 1;
+	}else{
+		glFogi(pname,params[0]);
+	}
+}
+
+// Commands are sent immediately to draw, except coalesced draws
+void glFlush() {
+	glcmdword_ * cmd;
+	if (_deferring() && (cmd = _defer_begin(DEFER_FLUSH,0))) {
+		_defer_end(cmd);
+		return;
+	}
+	__flush_batch();
+}
 
 // Waits for all the commands to be successfully executed
 void glFinish() {
+	__flush_batch();
 	GX_DrawDone(); // Be careful, WaitDrawDone waits for the DD command, this sends AND waits for it
 }
 
 void glBlendFunc( GLenum sfactor, GLenum dfactor ) {
+	glcmdword_ * cmd;
+	if (_deferring() && (cmd = _defer_begin(DEFER_BLEND_FUNC,2))) {
+		cmd[0].i = sfactor; cmd[1].i = dfactor;
+		_defer_end(cmd);
+		return;
+	}
 	switch (sfactor) {
 	case GL_ZERO:                glparamstate.srcblend = GX_BL_ZERO; break;
 	case GL_ONE:                 glparamstate.srcblend = GX_BL_ONE; break;
@@ -941,6 +2212,7 @@ void glBlendFunc( GLenum sfactor, GLenum dfactor ) {
 }
 
 void glLineWidth(GLfloat width) {
+	__flush_batch();
 	GX_SetLineWidth((unsigned int)(width*16),GX_TO_ZERO);
 }
 
@@ -990,74 +2262,22 @@ static int _calc_mipmap_offset(int level, int w, int h, int b) {
 }
 
 
-void glTexImage2D(GLenum target, GLint level, GLint internalFormat, GLsizei width, GLsizei  height, 
-					GLint  border, GLenum  format, GLenum  type, const GLvoid *  data) {
-
-	// Initial checks
-	if (texture_list[glparamstate.glcurtex].used == 0) return;
-	if (target != GL_TEXTURE_2D) return; // FIXME Implement non 2D textures
-
-	GX_DrawDone(); // Very ugly, we should have a list of used textures and only wait if we are using the curr tex.
-				// This way we are sure that we are not modifying a texture which is being drawn
-
-	gltexture_ * currtex = &texture_list[glparamstate.glcurtex];
-
-	// Just simplify it a little ;)
-	     if (internalFormat == GL_BGR)   internalFormat = GL_RGB;
-	else if (internalFormat == GL_BGRA)  internalFormat = GL_RGBA;
-	else if (internalFormat == GL_RGB4)  internalFormat = GL_RGB;
-	else if (internalFormat == GL_RGB5)  internalFormat = GL_RGB;
-	else if (internalFormat == GL_RGB8)  internalFormat = GL_RGB;
-	else if (internalFormat == 3)        internalFormat = GL_RGB;
-	else if (internalFormat == 4)        internalFormat = GL_RGBA;
-
-	// Simplify but keep in mind the swapping
-	int needswap = 0;
-	if (format == GL_BGR) {
-		format = GL_RGB;
-		needswap = 1;
-	}
-	if (format == GL_BGRA) {
-		format = GL_RGBA;
-		needswap = 1;
-	}
-
-	// Fallbacks for formats which we can't handle
-	if (internalFormat == GL_COMPRESSED_RGBA_ARB) internalFormat = GL_RGBA;  // Cannot compress RGBA!
-
-	// Simplify and avoid stupid conversions (which waste space for no gain)
-	if (format == GL_RGB && internalFormat == GL_RGBA) internalFormat = GL_RGB;
-
-	if (format == GL_LUMINANCE_ALPHA && internalFormat == GL_RGBA) internalFormat = GL_LUMINANCE_ALPHA;
-
-	// TODO: Implement GL_LUMINANCE/GL_INTENSITY? and fallback from GL_LUM_ALPHA to GL_LUM instead of RGB (2bytes to 1byte)
-	//	if (format == GL_LUMINANCE_ALPHA && internalFormat == GL_RGB) internalFormat = GL_LUMINANCE_ALPHA;
-
-	int bytesperpixelinternal = 4, bytesperpixelsrc = 4;
-
-	     if (format == GL_RGB)             bytesperpixelsrc = 3;
-	else if (format == GL_RGBA)            bytesperpixelsrc = 4;
-	else if (format == GL_LUMINANCE_ALPHA) bytesperpixelsrc = 2;
-
-	     if (internalFormat == GL_RGB)             bytesperpixelinternal = 2;
-	else if (internalFormat == GL_RGBA)            bytesperpixelinternal = 4;
-	else if (internalFormat == GL_LUMINANCE_ALPHA) bytesperpixelinternal = 2;
-
-	if (internalFormat == GL_COMPRESSED_RGB_ARB && format == GL_RGB)  // Only compress on demand and non-alpha textures
-		bytesperpixelinternal = -2; // 0.5 bytes per pixel
-
-	if (bytesperpixelinternal < 0 && (width < 8 || height < 8)) return;   // Cannot take compressed textures under 8x8 (4 blocks of 4x4, 32B)
-
+// Makes sure the texture has room for the given level, reallocating the buffer
+// if the geometry changed or a onelevel texture needs to become mipmapped
+static void _allocate_texture_level(gltexture_ * currtex, int level, int width, int height, int bytesperpixelinternal) {
 	// We *may* need to delete and create a new texture, depending if the user wants to add some mipmap levels
 	// or wants to create a new texture from scratch
 	int wi = _calc_original_size(level,width);
 	int he = _calc_original_size(level,height);
-	currtex->bytespp = bytesperpixelinternal;
 
 	// Check if the texture has changed its geometry and proceed to delete it
 	// If the specified level is zero, create a onelevel texture to save memory
 	if (wi != currtex->w || he != currtex->h || bytesperpixelinternal != currtex->bytespp) {
-		if (currtex->data != 0) free(currtex->data);
+		// The GPU may still be sampling from the old buffer
+		if (currtex->data != 0) {
+			GX_DrawDone();
+			free(currtex->data);
+		}
 		if (level == 0) {
 			int required_size = _calc_memory(width,height,bytesperpixelinternal);
 			int tex_size_rnd = ROUND_32B(required_size);
@@ -1072,6 +2292,7 @@ void glTexImage2D(GLenum target, GLint level, GLint internalFormat, GLsizei widt
 		currtex->minlevel = level;
 		currtex->maxlevel = level;
 	}
+	currtex->bytespp = bytesperpixelinternal;
 	currtex->w = wi; currtex->h = he;
 	if (currtex->maxlevel < level) currtex->maxlevel = level;
 	if (currtex->minlevel > level) currtex->minlevel = level;
@@ -1083,6 +2304,7 @@ void glTexImage2D(GLenum target, GLint level, GLint internalFormat, GLsizei widt
 		unsigned int tsize = _calc_memory(wi,he,bytesperpixelinternal);
 		unsigned char * tempbuf = malloc(tsize);
 		memcpy(tempbuf,currtex->data,tsize);
+		GX_DrawDone();
 		free(currtex->data);
 		
 		int required_size = _calc_tex_size(wi,he,bytesperpixelinternal);
@@ -1093,6 +2315,86 @@ void glTexImage2D(GLenum target, GLint level, GLint internalFormat, GLsizei widt
 		memcpy(currtex->data,tempbuf,tsize);
 		free(tempbuf);
 	}
+}
+
+// Maps the (simplified) GL internal format to the GX texture format
+static unsigned char _gl_texture_format(GLint internalFormat, int bytespp) {
+	if (bytespp < 0) return GX_TF_CMPR;
+	switch (internalFormat) {
+	case GL_RGBA:            return GX_TF_RGBA8;
+	case GL_LUMINANCE_ALPHA: return GX_TF_IA8;
+	case GL_RGB:
+	default:                 return GX_TF_RGB565;
+	}
+}
+
+// Reloads the texture object in the units it's bound to
+static void _reload_texture_units(gltexture_ * currtex) {
+	int i;
+	for (i = 0; i < MAX_TEXTURE_UNITS; i++)
+		if (&texture_list[glparamstate.texunit[i].glcurtex] == currtex)
+			GX_LoadTexObj(&currtex->texobj, GX_TEXMAP0 + i);
+}
+
+static void _init_texture_object(gltexture_ * currtex, unsigned char format) {
+	currtex->format = format;
+	GX_InitTexObj (	&currtex->texobj,currtex->data,
+					currtex->w,currtex->h,format,currtex->wraps,currtex->wrapt,GX_TRUE);
+	GX_InitTexObjLOD(&currtex->texobj,GX_LIN_MIP_LIN,GX_LIN_MIP_LIN,currtex->minlevel,currtex->maxlevel, 0,GX_ENABLE,GX_ENABLE,GX_ANISO_1);
+	_reload_texture_units(currtex);
+}
+
+
+// Simplifies the GL formats to the ones we can store and returns the bytes
+// per pixel of the internal format (negative for compressed formats)
+static int _prepare_tex_formats(GLint * internalFormat, GLenum * format, int * needswap) {
+	// Just simplify it a little ;)
+	     if (*internalFormat == GL_BGR)   *internalFormat = GL_RGB;
+	else if (*internalFormat == GL_BGRA)  *internalFormat = GL_RGBA;
+	else if (*internalFormat == GL_RGB4)  *internalFormat = GL_RGB;
+	else if (*internalFormat == GL_RGB5)  *internalFormat = GL_RGB;
+	else if (*internalFormat == GL_RGB8)  *internalFormat = GL_RGB;
+	else if (*internalFormat == 3)        *internalFormat = GL_RGB;
+	else if (*internalFormat == 4)        *internalFormat = GL_RGBA;
+
+	// Simplify but keep in mind the swapping
+	*needswap = 0;
+	if (*format == GL_BGR) {
+		*format = GL_RGB;
+		*needswap = 1;
+	}
+	if (*format == GL_BGRA) {
+		*format = GL_RGBA;
+		*needswap = 1;
+	}
+
+	// Fallbacks for formats which we can't handle
+	if (*internalFormat == GL_COMPRESSED_RGBA_ARB) *internalFormat = GL_RGBA;  // Cannot compress RGBA!
+
+	// Simplify and avoid stupid conversions (which waste space for no gain)
+	if (*format == GL_RGB && *internalFormat == GL_RGBA) *internalFormat = GL_RGB;
+
+	if (*format == GL_LUMINANCE_ALPHA && *internalFormat == GL_RGBA) *internalFormat = GL_LUMINANCE_ALPHA;
+
+	// TODO: Implement GL_LUMINANCE/GL_INTENSITY? and fallback from GL_LUM_ALPHA to GL_LUM instead of RGB (2bytes to 1byte)
+	//	if (format == GL_LUMINANCE_ALPHA && internalFormat == GL_RGB) internalFormat = GL_LUMINANCE_ALPHA;
+
+	int bytesperpixelinternal = 4;
+
+	     if (*internalFormat == GL_RGB)             bytesperpixelinternal = 2;
+	else if (*internalFormat == GL_RGBA)            bytesperpixelinternal = 4;
+	else if (*internalFormat == GL_LUMINANCE_ALPHA) bytesperpixelinternal = 2;
+
+	if (*internalFormat == GL_COMPRESSED_RGB_ARB && *format == GL_RGB)  // Only compress on demand and non-alpha textures
+		bytesperpixelinternal = -2; // 0.5 bytes per pixel
+
+	return bytesperpixelinternal;
+}
+
+// Converts the image to the internal format and writes it tiled (or compressed) to dst
+// Only touches memory, so it's safe to run it outside the render thread
+static void _convert_texture(const void * data, unsigned char * dst_addr, int width, int height,
+							GLenum format, GLint internalFormat, int bytesperpixelinternal, int needswap) {
 
 	// Inconditionally convert to 565 all inputs without alpha channel
 	// Alpha inputs may be stripped if the user specifies an alpha-free internal format
@@ -1128,11 +2430,6 @@ void glTexImage2D(GLenum target, GLint level, GLint internalFormat, GLsizei widt
 			else swap_rgb565((unsigned short*)tempbuf,width*height);
 		}
 
-		// Calculate the offset and address of the mipmap
-		int offset = _calc_mipmap_offset(level,currtex->w,currtex->h,currtex->bytespp);
-		unsigned char* dst_addr = currtex->data;
-		dst_addr += offset;
-
 		// Finally write to the dest. buffer scrambling the data
 		if (bytesperpixelinternal == 4) {
 			scramble_4b(tempbuf,dst_addr,width,height);
@@ -1140,45 +2437,768 @@ void glTexImage2D(GLenum target, GLint level, GLint internalFormat, GLsizei widt
 			scramble_2b((unsigned short*)tempbuf,dst_addr,width,height);
 		}
 		free(tempbuf);
-
-		DCFlushRange(dst_addr,width*height*bytesperpixelinternal);
 	}else{
 		// Compressed texture
+		convert_rgb_image_to_DXT1((unsigned char*)data,dst_addr,width,height,needswap);
+	}
+}
 
-		// Calculate the offset and address of the mipmap
-		int offset = _calc_mipmap_offset(level,currtex->w,currtex->h,currtex->bytespp);
-		unsigned char* dst_addr = currtex->data;
-		dst_addr += offset;
+void glTexImage2D(GLenum target, GLint level, GLint internalFormat, GLsizei width, GLsizei  height, 
+					GLint  border, GLenum  format, GLenum  type, const GLvoid *  data) {
+	_defer_sync();
 
-		convert_rgb_image_to_DXT1((unsigned char*)data,dst_addr,width,height,needswap);
+	// Initial checks
+	if (texture_list[glparamstate.glcurtex].used == 0) return;
+	if (target != GL_TEXTURE_2D) return; // FIXME Implement non 2D textures
+
+	__flush_batch();
+	GX_DrawDone(); // Very ugly, we should have a list of used textures and only wait if we are using the curr tex.
+				// This way we are sure that we are not modifying a texture which is being drawn
+
+	gltexture_ * currtex = &texture_list[glparamstate.glcurtex];
+	_cancel_tex_uploads(glparamstate.glcurtex);   // The new image wins over pending uploads
 
-		DCFlushRange(dst_addr,_calc_memory(width,height,bytesperpixelinternal));
+	int needswap;
+	int bytesperpixelinternal = _prepare_tex_formats(&internalFormat,&format,&needswap);
+
+	if (bytesperpixelinternal < 0 && (width < 8 || height < 8)) return;   // Cannot take compressed textures under 8x8 (4 blocks of 4x4, 32B)
+	if (bytesperpixelinternal < 0 && data == 0) bytesperpixelinternal = 2;  // Nothing to compress, keep it RGB
+
+	_allocate_texture_level(currtex,level,width,height,bytesperpixelinternal);
+	if (currtex->flipped) {
+		// The other levels were copied from the EFB, turn them the GL way up
+		int l;
+		for (l = currtex->minlevel; l <= currtex->maxlevel; l++)
+			if (l != level) _flip_texture_level(currtex, l);
+		currtex->flipped = 0;
+	}
+
+	// Allocate only, contents are undefined (ie. render to texture targets)
+	if (data == 0) {
+		_init_texture_object(currtex,_gl_texture_format(internalFormat,bytesperpixelinternal));
+		return;
 	}
 
+	// Calculate the offset and address of the mipmap
+	int offset = _calc_mipmap_offset(level,currtex->w,currtex->h,currtex->bytespp);
+	unsigned char* dst_addr = currtex->data;
+	dst_addr += offset;
+
+	_convert_texture(data,dst_addr,width,height,format,internalFormat,bytesperpixelinternal,needswap);
+	DCFlushRange(dst_addr,_calc_memory(width,height,bytesperpixelinternal));
+
 	// Slow but necessary! The new textures may be in the same region of some old cached textures
 	GX_InvalidateTexAll();
 
-	if (internalFormat == GL_RGBA) {
-		GX_InitTexObj (	&currtex->texobj,currtex->data,
-						currtex->w,currtex->h,GX_TF_RGBA8,currtex->wraps,currtex->wrapt,GX_TRUE);
-	}else if (internalFormat == GL_RGB) {
-		GX_InitTexObj (	&currtex->texobj,currtex->data,
-						currtex->w,currtex->h,GX_TF_RGB565,currtex->wraps,currtex->wrapt,GX_TRUE);
-	}else if (internalFormat == GL_LUMINANCE_ALPHA) {
-		GX_InitTexObj (	&currtex->texobj,currtex->data,
-						currtex->w,currtex->h,GX_TF_IA8,currtex->wraps,currtex->wrapt,GX_TRUE);
+	_init_texture_object(currtex,_gl_texture_format(internalFormat,bytesperpixelinternal));
+}
+
+/*
+
+  Asynchronous texture uploads. A worker thread converts (and compresses)
+  the image into a fresh buffer while the render thread keeps going. The
+  render thread only swaps the buffer in once it's ready, and frees the old
+  one when the GPU has stopped using it (no GX_DrawDone involved).
+
+  The worker runs with a lower priority than the main thread, so it uses
+  the time the main thread spends waiting (vsync, FIFO, ...).
+
+  Uploads of the same texture supersede each other, and so do glTexImage2D
+  and glDeleteTextures: older jobs are cancelled and their result dropped,
+  so the last specified image always wins. Updates of a part of the texture
+  (glCopyTexSubImage2D) complete the pending upload first instead, so they
+  apply to the new image.
+
+*/
+
+// Cancels the uploads in flight for the texture (call from the render thread)
+static void _cancel_tex_uploads(int texture) {
+	int i;
+	if (texupload_thread == LWP_THREAD_NULL) return;
+
+	LWP_MutexLock(texupload_mutex);
+	for (i = 0; i < MAX_TEXUPLOADS; i++) {
+		gltexupload_ * job = &texupload_list[i];
+		if (job->texture != texture) continue;
+		if (job->state == TEXUPLOAD_QUEUED)
+			job->state = TEXUPLOAD_FREE;
+		else if (job->state == TEXUPLOAD_CONVERTING || job->state == TEXUPLOAD_CONVERTED)
+			job->cancelled = 1;
+	}
+	LWP_MutexUnlock(texupload_mutex);
+}
+
+static void _texupload_convert(gltexupload_ * job) {
+	int size = ROUND_32B(_calc_memory(job->w,job->h,job->bytespp));
+	job->buffer = memalign(32,size);
+	if (job->buffer) {
+		_convert_texture(job->src,job->buffer,job->w,job->h,job->format,job->internalFormat,job->bytespp,job->needswap);
+		DCFlushRange(job->buffer,size);
 	}else{
-		GX_InitTexObj (	&currtex->texobj,currtex->data,
-						currtex->w,currtex->h,GX_TF_CMPR,currtex->wraps,currtex->wrapt,GX_TRUE);		
+		job->cancelled = 1;   // Out of memory, the texture is left untouched
 	}
-	GX_InitTexObjLOD(&currtex->texobj,GX_LIN_MIP_LIN,GX_LIN_MIP_LIN,currtex->minlevel,currtex->maxlevel, 0,GX_ENABLE,GX_ENABLE,GX_ANISO_1);
+}
+
+// Waits for the upload in flight for the texture (converting it right away
+// if the worker didn't start yet) and makes it current, so the texture can
+// be updated in place (call from the render thread)
+static void _complete_tex_uploads(int texture) {
+	int i, busy;
+	if (texupload_thread == LWP_THREAD_NULL) return;
+
+	LWP_MutexLock(texupload_mutex);
+	do {
+		busy = 0;
+		for (i = 0; i < MAX_TEXUPLOADS; i++) {
+			gltexupload_ * job = &texupload_list[i];
+			if (job->texture != texture || job->cancelled) continue;
+			if (job->state == TEXUPLOAD_QUEUED) {
+				job->state = TEXUPLOAD_CONVERTING;
+				LWP_MutexUnlock(texupload_mutex);
+				_texupload_convert(job);
+				LWP_MutexLock(texupload_mutex);
+				job->state = TEXUPLOAD_CONVERTED;
+			}else if (job->state == TEXUPLOAD_CONVERTING) {
+				busy = 1;
+			}
+		}
+		// The worker has a lower priority, block so it can finish
+		if (busy) LWP_CondWait(texupload_done,texupload_mutex);
+	} while (busy);
+	LWP_MutexUnlock(texupload_mutex);
+
+	ogxCompleteTexUploads();
+}
+
+static void * _texupload_worker(void * arg) {
+	while (1) {
+		int i;
+		gltexupload_ * job = 0;
+
+		// Oldest job first
+		LWP_MutexLock(texupload_mutex);
+		for (i = 0; i < MAX_TEXUPLOADS; i++)
+			if (texupload_list[i].state == TEXUPLOAD_QUEUED &&
+				(!job || (int)(texupload_list[i].seq - job->seq) < 0))
+				job = &texupload_list[i];
+		if (!job) {
+			LWP_CondWait(texupload_cond,texupload_mutex);
+			LWP_MutexUnlock(texupload_mutex);
+			continue;
+		}
+		job->state = TEXUPLOAD_CONVERTING;
+		LWP_MutexUnlock(texupload_mutex);
+
+		_texupload_convert(job);
+
+		LWP_MutexLock(texupload_mutex);
+		job->state = TEXUPLOAD_CONVERTED;
+		LWP_CondBroadcast(texupload_done);
+		LWP_MutexUnlock(texupload_mutex);
+	}
+	return 0;
+}
+
+GLboolean ogxTexImage2DAsync(GLuint texture, GLint internalFormat, GLsizei width, GLsizei height,
+								GLenum format, GLenum type, const GLvoid * data) {
+	_defer_sync();
+
+	if (texture >= _MAX_GL_TEX || !texture_list[texture].used || data == 0) return GL_FALSE;
+
+	int needswap;
+	int bytesperpixelinternal = _prepare_tex_formats(&internalFormat,&format,&needswap);
+	if (bytesperpixelinternal < 0 && (width < 8 || height < 8)) return GL_FALSE;
+
+	if (texupload_thread == LWP_THREAD_NULL) {
+		LWP_MutexInit(&texupload_mutex,GX_FALSE);
+		LWP_CondInit(&texupload_cond);
+		LWP_CondInit(&texupload_done);
+		LWP_CreateThread(&texupload_thread,_texupload_worker,0,0,TEXUPLOAD_STACK,TEXUPLOAD_PRIO);
+	}
+
+	int i;
+	_cancel_tex_uploads(texture);
+	LWP_MutexLock(texupload_mutex);
+	for (i = 0; i < MAX_TEXUPLOADS; i++) {
+		gltexupload_ * job = &texupload_list[i];
+		if (job->state != TEXUPLOAD_FREE) continue;
+
+		job->texture = texture;
+		job->seq = texupload_seq++;
+		job->cancelled = 0;
+		job->src = data;
+		job->w = width; job->h = height;
+		job->internalFormat = internalFormat;
+		job->format = format;
+		job->bytespp = bytesperpixelinternal;
+		job->needswap = needswap;
+		job->state = TEXUPLOAD_QUEUED;
+		LWP_CondSignal(texupload_cond);
+		LWP_MutexUnlock(texupload_mutex);
+		return GL_TRUE;
+	}
+	LWP_MutexUnlock(texupload_mutex);
+	return GL_FALSE;
+}
+
+int ogxCompleteTexUploads() {
+	__flush_batch();
+	int i, pending = 0, completed = 0;
+	if (texupload_thread == LWP_THREAD_NULL) return 0;
+
+	LWP_MutexLock(texupload_mutex);
+	for (i = 0; i < MAX_TEXUPLOADS; i++) {
+		gltexupload_ * job = &texupload_list[i];
+
+		switch (job->state) {
+		case TEXUPLOAD_QUEUED:
+		case TEXUPLOAD_CONVERTING:
+			if (!job->cancelled) pending++;
+			break;
+		case TEXUPLOAD_RETIRING:
+			if (_draw_sync_passed(job->token)) {
+				free(job->oldbuffer);
+				job->state = TEXUPLOAD_FREE;
+			}
+			break;
+		case TEXUPLOAD_CONVERTED: {
+			gltexture_ * currtex = &texture_list[job->texture];
+			if (job->cancelled || !currtex->used) {   // Superseded or deleted in the meanwhile
+				free(job->buffer);
+				job->state = TEXUPLOAD_FREE;
+				break;
+			}
+
+			job->oldbuffer = currtex->data;
+			currtex->data = job->buffer;
+			currtex->w = job->w; currtex->h = job->h;
+			currtex->bytespp = job->bytespp;
+			currtex->onelevel = 1;
+			currtex->minlevel = 0;
+			currtex->maxlevel = 0;
+			currtex->flipped = 0;
+			_init_texture_object(currtex,_gl_texture_format(job->internalFormat,job->bytespp));
+			completed++;
+
+			if (job->oldbuffer) {
+				job->token = _issue_draw_sync();
+				job->state = TEXUPLOAD_RETIRING;
+			}else{
+				job->state = TEXUPLOAD_FREE;
+			}
+			} break;
+		default: break;
+		}
+	}
+	LWP_MutexUnlock(texupload_mutex);
+
+	// The new buffers may be in the same region of some old cached textures
+	if (completed) GX_InvalidateTexAll();
+	return pending;
+}
+
+GLboolean ogxIsTextureReady(GLuint texture) {
+	_defer_sync();
+	int i;
+	for (i = 0; i < MAX_TEXUPLOADS; i++) {
+		char state = texupload_list[i].state;
+		if (texupload_list[i].texture == texture && !texupload_list[i].cancelled &&
+			(state == TEXUPLOAD_QUEUED || state == TEXUPLOAD_CONVERTING || state == TEXUPLOAD_CONVERTED))
+			return GL_FALSE;
+	}
+	return GL_TRUE;
+}
+
+/*
+
+  Render to texture. EFB regions are copied straight into the tiled
+  texture buffers by the GPU (GX_CopyTex), no CPU conversion involved.
+
+  The EFB is copied top to bottom, so copied textures are stored upside
+  down compared to GL and get their T coordinate flipped at draw time.
+
+*/
+
+// Offset of texel (x,y) in a tiled level of width w. All the formats we
+// copy to use 4x4 tiles: 32 bytes for 16 bit texels and 64 bytes for RGBA8,
+// which stores the AR texels of the tile followed by the GB texels (+32).
+static int _texel_offset(int x, int y, int w, int bytespp) {
+	int tile = (y >> 2)*((w + 3) >> 2) + (x >> 2);
+	int texel = ((y & 3) << 2) + (x & 3);
+	return tile*bytespp*16 + texel*2;
+}
+
+// Issues the EFB copy of a width x height region at (x,y) into dst.
+// If halfsize is set the region is box filtered down to half its size
+static void _efb_copy(void * dst, int format, int x, int y, int width, int height, int halfsize) {
+	__flush_batch();
+	GX_SetTexCopySrc(x, y, width, height);
+	if (halfsize)
+		GX_SetTexCopyDst(width/2, height/2, format, GX_TRUE);
+	else
+		GX_SetTexCopyDst(width, height, format, GX_FALSE);
+	GX_CopyTex(dst, GX_FALSE);
+}
+
+// Turns a level of the texture upside down on the CPU (not for compressed
+// textures), so levels copied from the EFB and uploaded ones can be mixed
+static void _flip_texture_level(gltexture_ * currtex, int level) {
+	int lw = currtex->w >> level; if (lw == 0) lw = 1;
+	int lh = currtex->h >> level; if (lh == 0) lh = 1;
+	int size = _calc_memory(lw,lh,currtex->bytespp);
+	unsigned char * data = currtex->data;
+	data += _calc_mipmap_offset(level,currtex->w,currtex->h,currtex->bytespp);
+	DCInvalidateRange(data,ROUND_32B(size));
+
+	int i, j, k;
+	for (j = 0; j < lh/2; j++) {
+		for (i = 0; i < lw; i++) {
+			int a = _texel_offset(i, j, lw, currtex->bytespp);
+			int b = _texel_offset(i, lh - 1 - j, lw, currtex->bytespp);
+			for (k = 0; k < currtex->bytespp; k += 2) {
+				// RGBA8 keeps the GB part 32 bytes after the AR one
+				int o = k ? 32 : 0;
+				unsigned short t = *(unsigned short*)&data[a+o];
+				*(unsigned short*)&data[a+o] = *(unsigned short*)&data[b+o];
+				*(unsigned short*)&data[b+o] = t;
+			}
+		}
+	}
+	DCFlushRange(data,size);
+}
+
+// Copies the EFB region at (x,y) through a scratch buffer and retiles it on
+// the CPU at (xoffset,yoffset) of the texture level, in the orientation of
+// the texture. With halfsize the region is box filtered to half its size.
+// yscale maps window rows to EFB rows (dynamic resolution), the rows the
+// region was rendered to are stretched back to its height.
+static void _efb_copy_retile(gltexture_ * currtex, int level, int xoffset, int yoffset,
+                             int x, int y, int width, int height, int halfsize, float yscale) {
+	int lw = currtex->w >> level; if (lw == 0) lw = 1;
+	int lh = currtex->h >> level; if (lh == 0) lh = 1;
+	unsigned char * dst_addr = currtex->data;
+	dst_addr += _calc_mipmap_offset(level,currtex->w,currtex->h,currtex->bytespp);
+
+	int ey = y*yscale, eh = (int)((y + height - 1)*yscale) - ey + 1;
+	if (halfsize) eh = (eh + 1) & ~1;
+	int cw = halfsize ? width/2 : width, ch = halfsize ? height/2 : height;
+	int sh = halfsize ? eh/2 : eh;   // Rows in the scratch buffer
+	int tw = (cw + 3) & ~3, th = (sh + 3) & ~3;
+	int tsize = ROUND_32B(tw*th*currtex->bytespp);
+	unsigned char * tempbuf = memalign(32,tsize);
+	if (!tempbuf) return;
+	DCInvalidateRange(tempbuf,tsize);
+	_efb_copy(tempbuf, currtex->format, x, ey, width, eh, halfsize);
+	GX_DrawDone();   // We need the data on the CPU side
+	DCInvalidateRange(tempbuf,tsize);
+
+	// Rows of a flipped texture are stored top-down, like the EFB
+	int dsty = currtex->flipped ? (lh - yoffset - ch) : yoffset;
+	int i, j;
+	for (j = 0; j < ch; j++) {
+		int dy = currtex->flipped ? (dsty + j) : (dsty + ch - 1 - j);
+		int sy = j*sh/ch;
+		for (i = 0; i < cw; i++) {
+			int so = _texel_offset(i, sy, tw, currtex->bytespp);
+			int doff = _texel_offset(xoffset + i, dy, lw, currtex->bytespp);
+			memcpy(&dst_addr[doff],&tempbuf[so],2);
+			if (currtex->bytespp == 4)
+				memcpy(&dst_addr[doff+32],&tempbuf[so+32],2);
+		}
+	}
+	free(tempbuf);
+
+	DCFlushRange(dst_addr,_calc_memory(lw,lh,currtex->bytespp));
+}
+
+// Copies the EFB region at (x,y) into a whole level of the texture and
+// makes the texture usable. A texture made of EFB copies only is stored
+// upside down (the GPU copies straight into it), one with uploaded levels
+// too keeps the GL orientation and the copies are retiled on the CPU.
+// GL_GENERATE_MIPMAP only generates the next level (the copy box filter
+// halves the region once), smaller levels are dropped. yscale maps window
+// rows to EFB rows, scaled regions are retiled on the CPU too.
+static void _copy_efb_to_texture(gltexture_ * currtex, int level, int x, int y, float yscale) {
+	int lw = currtex->w >> level; if (lw == 0) lw = 1;
+	int lh = currtex->h >> level; if (lh == 0) lh = 1;
+	int genmip = currtex->genmipmap && lw > 1 && lh > 1;
+
+	// A new texture (no other levels) takes the EFB orientation
+	if (currtex->minlevel == level && currtex->maxlevel == level)
+		currtex->flipped = 1;
+
+	// Make room for the generated level before the GPU starts writing
+	if (genmip) {
+		_allocate_texture_level(currtex,level+1,lw/2,lh/2,currtex->bytespp);
+		currtex->maxlevel = level+1;
+	}
+
+	if (!currtex->flipped || yscale != 1.0f) {
+		_efb_copy_retile(currtex, level, 0, 0, x, y, lw, lh, 0, yscale);
+		if (genmip)
+			_efb_copy_retile(currtex, level+1, 0, 0, x, y, lw, lh, 1, yscale);
+		GX_InvalidateTexAll();
+		_init_texture_object(currtex,currtex->format);
+		return;
+	}
+
+	unsigned char * dst_addr = currtex->data;
+	dst_addr += _calc_mipmap_offset(level,currtex->w,currtex->h,currtex->bytespp);
+	// Drop any cached data, the GPU is going to overwrite the buffer
+	DCInvalidateRange(dst_addr,ROUND_32B(_calc_memory(lw,lh,currtex->bytespp)));
+	_efb_copy(dst_addr, currtex->format, x, y, lw, lh, 0);
+
+	// Generate the next level from the same EFB region using the copy box filter
+	if (genmip) {
+		dst_addr = currtex->data;
+		dst_addr += _calc_mipmap_offset(level+1,currtex->w,currtex->h,currtex->bytespp);
+		DCInvalidateRange(dst_addr,ROUND_32B(_calc_memory(lw/2,lh/2,currtex->bytespp)));
+		_efb_copy(dst_addr, currtex->format, x, y, lw, lh, 1);
+	}
+
+	// Make sure the copy has landed before any texture fetch
+	GX_PixModeSync();
+	GX_InvalidateTexAll();
+
+	_init_texture_object(currtex,currtex->format);
+}
+
+void glCopyTexImage2D(GLenum target, GLint level, GLenum internalFormat, GLint x, GLint y,
+						GLsizei width, GLsizei height, GLint border) {
+	_defer_sync();
+
+	if (texture_list[glparamstate.glcurtex].used == 0) return;
+	if (target != GL_TEXTURE_2D) return;
+
+	gltexture_ * currtex = &texture_list[glparamstate.glcurtex];
+	_cancel_tex_uploads(glparamstate.glcurtex);
+
+	// The EFB can be copied as RGBA8, RGB565 or IA8 (no compression)
+	int bytesperpixelinternal = 2;
+	     if (internalFormat == GL_RGBA || internalFormat == GL_RGBA8 || internalFormat == 4)
+		bytesperpixelinternal = 4;
+	else if (internalFormat != GL_LUMINANCE_ALPHA)
+		internalFormat = GL_RGB;
+
+	_allocate_texture_level(currtex,level,width,height,bytesperpixelinternal);
+	currtex->format = _gl_texture_format(internalFormat,bytesperpixelinternal);
+
+	_copy_efb_to_texture(currtex,level,x,y,_viewport_scale());
+}
+
+void glCopyTexSubImage2D(GLenum target, GLint level, GLint xoffset, GLint yoffset,
+						GLint x, GLint y, GLsizei width, GLsizei height) {
+	_defer_sync();
+
+	if (texture_list[glparamstate.glcurtex].used == 0) return;
+	if (target != GL_TEXTURE_2D) return;
+
+	// The update applies to the image of a pending async upload
+	_complete_tex_uploads(glparamstate.glcurtex);
+
+	gltexture_ * currtex = &texture_list[glparamstate.glcurtex];
+	if (currtex->data == 0 || currtex->format == GX_TF_CMPR) return;
+	if (level < currtex->minlevel || level > currtex->maxlevel) return;
+
+	int lw = currtex->w >> level; if (lw == 0) lw = 1;
+	int lh = currtex->h >> level; if (lh == 0) lh = 1;
+	if (xoffset < 0 || yoffset < 0 || xoffset + width > lw || yoffset + height > lh) return;
+
+	unsigned char * dst_addr = currtex->data;
+	dst_addr += _calc_mipmap_offset(level,currtex->w,currtex->h,currtex->bytespp);
+	int tilebytes = currtex->bytespp*16;
+
+	// Rows of a flipped texture are stored top-down, like the EFB
+	int dsty = currtex->flipped ? (lh - yoffset - height) : yoffset;
+
+	float s = _viewport_scale();
+
+	// Fast path: whole tile rows of a flipped texture can be copied in place
+	if (currtex->flipped && s == 1.0f && xoffset == 0 && width == lw &&
+		(dsty & 3) == 0 && ((height & 3) == 0 || dsty + height == lh)) {
+
+		dst_addr += (dsty >> 2)*((lw + 3) >> 2)*tilebytes;
+		DCInvalidateRange(dst_addr,ROUND_32B(((height + 3) >> 2)*((lw + 3) >> 2)*tilebytes));
+		_efb_copy(dst_addr, currtex->format, x, y, width, height, 0);
+		GX_PixModeSync();
+		GX_InvalidateTexAll();
+		return;
+	}
+
+	// Slow path: copy to a scratch buffer and retile on the CPU
+	_efb_copy_retile(currtex, level, xoffset, yoffset, x, y, width, height, 0, s);
+	GX_InvalidateTexAll();
+}
+
+/*
+
+  Pixel readback. Tiny regions (picking) are peeked straight from the EFB,
+  bigger ones are copied by the GPU as RGBA8/Z24X8 and untiled on the CPU.
+  Rows are returned bottom to top, as GL does.
+
+*/
+
+// Bytes a pixel takes in client memory, 0 if unsupported
+static int _pixel_size(GLenum format, GLenum type) {
+	if (format == GL_DEPTH_COMPONENT) {
+		switch (type) {
+		case GL_FLOAT:          return 4;
+		case GL_UNSIGNED_INT:   return 4;
+		case GL_UNSIGNED_SHORT: return 2;
+		default:                return 0;
+		}
+	}
+	if (type != GL_UNSIGNED_BYTE) return 0;
+	switch (format) {
+	case GL_RGBA: case GL_BGRA: return 4;
+	case GL_RGB:  case GL_BGR:  return 3;
+	case GL_ALPHA:
+	case GL_LUMINANCE:          return 1;
+	default:                    return 0;
+	}
+}
+
+// Writes a pixel in client format. Color comes in c, 24 bit depth in z
+static void _pack_pixel(unsigned char * dst, GLenum format, GLenum type, GXColor c, u32 z) {
+	switch (format) {
+	case GL_DEPTH_COMPONENT:
+		if (type == GL_FLOAT)
+			*(float*)dst = z / 16777215.0f;
+		else if (type == GL_UNSIGNED_INT)
+			*(unsigned int*)dst = (z << 8) | (z >> 16);
+		else
+			*(unsigned short*)dst = z >> 8;
+		break;
+	case GL_RGBA: dst[0] = c.r; dst[1] = c.g; dst[2] = c.b; dst[3] = c.a; break;
+	case GL_BGRA: dst[0] = c.b; dst[1] = c.g; dst[2] = c.r; dst[3] = c.a; break;
+	case GL_RGB:  dst[0] = c.r; dst[1] = c.g; dst[2] = c.b; break;
+	case GL_BGR:  dst[0] = c.b; dst[1] = c.g; dst[2] = c.r; break;
+	case GL_ALPHA:     dst[0] = c.a; break;
+	case GL_LUMINANCE: dst[0] = (c.r + c.g + c.b)/3; break;
+	}
+}
+
+// Starts the EFB copy of the region into a newly allocated RGBA8 (or Z24X8)
+// buffer. The copy origin must be even, so the region is enlarged if needed.
+// With dynamic resolution the rows the region was rendered to are copied.
+// Returns 0 if the buffer can't be allocated.
+static int _readback_start(glreadback_ * rb, GLint x, GLint y, GLsizei width, GLsizei height, GLenum format, GLenum type) {
+	float s = _viewport_scale();
+	int ey = y*s, eh = (int)((y + height - 1)*s) - ey + 1;
+	int x0 = x & ~1, y0 = ey & ~1;
+	int cw = (x + width - x0 + 1) & ~1;
+	int ch = (ey + eh - y0 + 1) & ~1;
+
+	rb->xoff = x - x0;
+	rb->y = y; rb->y0 = y0; rb->yscale = s;
+	rb->width = width; rb->height = height;
+	rb->tw = (cw + 3) & ~3;
+	rb->th = (ch + 3) & ~3;
+	rb->format = format; rb->type = type;
+
+	int size = ROUND_32B(rb->tw*rb->th*4);
+	rb->buffer = memalign(32,size);
+	if (!rb->buffer) return 0;
+	DCInvalidateRange(rb->buffer,size);
+
+	_efb_copy(rb->buffer, format == GL_DEPTH_COMPONENT ? GX_TF_Z24X8 : GX_TF_RGBA8, x0, y0, cw, ch, 0);
+	return 1;
+}
+
+// Untiles the copied region into client memory (bottom row first)
+static void _readback_finish(glreadback_ * rb, GLvoid * data) {
+	int bpp = _pixel_size(rb->format,rb->type);
+	unsigned char * dst = data;
+	int i, j;
+
+	DCInvalidateRange(rb->buffer,ROUND_32B(rb->tw*rb->th*4));
+	for (j = rb->height - 1; j >= 0; j--) {
+		int row = (int)((rb->y + j)*rb->yscale) - rb->y0;
+		for (i = 0; i < rb->width; i++) {
+			// Same layout for RGBA8 and Z24X8: AR block followed by the GB block
+			unsigned char * src = &rb->buffer[_texel_offset(rb->xoff + i, row, rb->tw, 4)];
+			GXColor c = { src[1], src[32], src[33], src[0] };
+			u32 z = (src[1] << 16) | (src[32] << 8) | src[33];
+			_pack_pixel(dst, rb->format, rb->type, c, z);
+			dst += bpp;
+		}
+	}
+	free(rb->buffer);
+	rb->buffer = 0;
+}
+
+void glReadPixels(GLint x, GLint y, GLsizei width, GLsizei height, GLenum format, GLenum type, GLvoid * data) {
+	__flush_batch();
+	int bpp = _pixel_size(format,type);
+	if (bpp == 0 || width <= 0 || height <= 0) return;
+
+	if (width*height <= READPIXELS_PEEK_MAX) {
+		// Peeking is cheaper than a copy for a handful of pixels
+		unsigned char * dst = data;
+		float s = _viewport_scale();
+		int i, j;
+		GX_DrawDone();
+		for (j = y + height - 1; j >= y; j--) {
+			int row = j*s;
+			for (i = x; i < x + width; i++) {
+				GXColor c = {0,0,0,0};
+				u32 z = 0;
+				if (format == GL_DEPTH_COMPONENT)
+					GX_PeekZ(i,row,&z);
+				else
+					GX_PeekARGB(i,row,&c);
+				_pack_pixel(dst, format, type, c, z);
+				dst += bpp;
+			}
+		}
+		return;
+	}
+
+	glreadback_ rb;
+	if (!_readback_start(&rb,x,y,width,height,format,type)) return;
+	GX_DrawDone();
+	_readback_finish(&rb,data);
+}
+
+GLuint ogxReadPixelsAsync(GLint x, GLint y, GLsizei width, GLsizei height, GLenum format, GLenum type) {
+	_defer_sync();
+	if (_pixel_size(format,type) == 0 || width <= 0 || height <= 0) return 0;
+
+	int i;
+	for (i = 0; i < MAX_READBACKS; i++) {
+		if (readback_list[i].used) continue;
+
+		glreadback_ * rb = &readback_list[i];
+		if (!_readback_start(rb,x,y,width,height,format,type)) return 0;
+
+		// The GPU reports the token once the copy is done, no need to wait for it
+		rb->token = _issue_draw_sync();
+		rb->used = 1;
+		return i + 1;
+	}
+	return 0;
+}
+
+GLboolean ogxReadPixelsReady(GLuint request) {
+	_defer_sync();
+	if (request == 0 || request > MAX_READBACKS || !readback_list[request-1].used) return GL_FALSE;
+
+	return _draw_sync_passed(readback_list[request-1].token) ? GL_TRUE : GL_FALSE;
+}
+
+void ogxReadPixelsCollect(GLuint request, GLvoid * data) {
+	_defer_sync();
+	if (request == 0 || request > MAX_READBACKS || !readback_list[request-1].used) return;
+
+	glreadback_ * rb = &readback_list[request-1];
+	if (!ogxReadPixelsReady(request))
+		GX_DrawDone();
+	_readback_finish(rb,data);
+	rb->used = 0;
+}
+
+// Framebuffer objects (GL_EXT_framebuffer_object subset)
+// Only a color texture attachment is supported, the EFB always provides
+// the depth buffer. Render targets should be drawn before the main scene
+// since they share the EFB with it.
+
+static void _resolve_framebuffer(int fb) {
+	glframebuffer_ * fbo = &framebuffer_list[fb];
+	if (fbo->texture < 0) return;
+
+	gltexture_ * currtex = &texture_list[fbo->texture];
+	if (!currtex->used || currtex->data == 0 || currtex->format == GX_TF_CMPR) return;
+
+	_copy_efb_to_texture(currtex,fbo->level,0,0,1.0f);
+}
+
+void glGenFramebuffersEXT(GLsizei n, GLuint * framebuffers) {
+	_defer_sync();
+	GLuint *fblist = framebuffers;
+	int i;
+	for (i = 1; i < _MAX_GL_FBO && n > 0; i++) {
+		if (framebuffer_list[i].used == 0) {
+			framebuffer_list[i].used = 1;
+			framebuffer_list[i].texture = -1;
+			framebuffer_list[i].level = 0;
+			*fblist++ = i;
+			n--;
+		}
+	}
+}
+
+void glDeleteFramebuffersEXT(GLsizei n, const GLuint * framebuffers) {
+	_defer_sync();
+	while (n-- > 0) {
+		GLuint i = *framebuffers++;
+		if (i == 0 || i >= _MAX_GL_FBO) continue;
+		if (i == glparamstate.glcurfbo)
+			glBindFramebufferEXT(GL_FRAMEBUFFER_EXT,0);
+		framebuffer_list[i].used = 0;
+	}
+}
+
+GLboolean glIsFramebufferEXT(GLuint framebuffer) {
+	_defer_sync();
+	if (framebuffer == 0 || framebuffer >= _MAX_GL_FBO) return GL_FALSE;
+	return framebuffer_list[framebuffer].used ? GL_TRUE : GL_FALSE;
+}
+
+void glBindFramebufferEXT(GLenum target, GLuint framebuffer) {
+	_defer_sync();
+	if (target != GL_FRAMEBUFFER_EXT) return;
+	if (framebuffer >= _MAX_GL_FBO || !framebuffer_list[framebuffer].used) return;
+	if (framebuffer == glparamstate.glcurfbo) return;
+
+	// Leaving a framebuffer: copy what has been rendered to its texture
+	if (glparamstate.glcurfbo != 0)
+		_resolve_framebuffer(glparamstate.glcurfbo);
+
+	glparamstate.glcurfbo = framebuffer;
+	_apply_viewport();   // Framebuffer objects are not scaled
+}
+
+void glFramebufferTexture2DEXT(GLenum target, GLenum attachment, GLenum textarget, GLuint texture, GLint level) {
+	_defer_sync();
+	if (target != GL_FRAMEBUFFER_EXT || glparamstate.glcurfbo == 0) return;
+	if (attachment != GL_COLOR_ATTACHMENT0_EXT) return;  // Depth comes from the EFB
+
+	glframebuffer_ * fbo = &framebuffer_list[glparamstate.glcurfbo];
+	if (texture == 0 || texture >= _MAX_GL_TEX || textarget != GL_TEXTURE_2D) {
+		fbo->texture = -1;
+		return;
+	}
+	fbo->texture = texture;
+	fbo->level = level;
+}
+
+GLenum glCheckFramebufferStatusEXT(GLenum target) {
+	_defer_sync();
+	if (glparamstate.glcurfbo == 0) return GL_FRAMEBUFFER_COMPLETE_EXT;
+
+	glframebuffer_ * fbo = &framebuffer_list[glparamstate.glcurfbo];
+	if (fbo->texture < 0) return GL_FRAMEBUFFER_INCOMPLETE_MISSING_ATTACHMENT_EXT;
+
+	gltexture_ * currtex = &texture_list[fbo->texture];
+	if (!currtex->used || currtex->data == 0 || currtex->format == GX_TF_CMPR)
+		return GL_FRAMEBUFFER_UNSUPPORTED_EXT;
+	// Must fit in the EFB (640x528)
+	if ((currtex->w >> fbo->level) > 640 || (currtex->h >> fbo->level) > 528)
+		return GL_FRAMEBUFFER_UNSUPPORTED_EXT;
+
+	return GL_FRAMEBUFFER_COMPLETE_EXT;
 }
 
 void glColorMask( GLboolean red, GLboolean green, GLboolean blue, GLboolean alpha ) {
+	__flush_batch();
 	if ((red | green | blue | alpha) != 0)
-		GX_SetColorUpdate(GX_TRUE);
+		glparamstate.colorupdate = GX_TRUE;
 	else
-		GX_SetColorUpdate(GX_FALSE);
+		glparamstate.colorupdate = GX_FALSE;
+	GX_SetColorUpdate(glparamstate.colorupdate);
+	// Destination alpha is only stored by the RGBA6 format
+	if (glparamstate.pixelfmt == GX_PF_RGBA6_Z24)
+		GX_SetAlphaUpdate(alpha ? GX_TRUE : GX_FALSE);
 }
 
 /*
@@ -1188,10 +3208,23 @@ void glColorMask( GLboolean red, GLboolean green, GLboolean blue, GLboolean alph
 */
 
 void glDisableClientState( GLenum cap ) {
+	glcmdword_ * cmd;
+	if (_deferring() && (cmd = _defer_begin(DEFER_DISABLE_CLIENT,1))) {
+		switch(cap) {
+		case GL_NORMAL_ARRAY:         defer.client.normal_enabled = 0; break;
+		case GL_TEXTURE_COORD_ARRAY:  defer.client.texcoord_enabled[defer.client.client_active_texture] = 0; break;
+		case GL_VERTEX_ARRAY:         defer.client.vertex_enabled = 0; break;
+		case GL_MATRIX_INDEX_ARRAY_ARB: defer.client.matrixindex_enabled = 0; break;
+		}
+		cmd[0].i = cap;
+		_defer_end(cmd);
+		return;
+	}
 	switch(cap) {
 	case GL_INDEX_ARRAY:          glparamstate.index_enabled = 0; break;
 	case GL_NORMAL_ARRAY:         glparamstate.normal_enabled = 0; break;
-	case GL_TEXTURE_COORD_ARRAY:  glparamstate.texcoord_enabled = 0; break;
+	case GL_MATRIX_INDEX_ARRAY_ARB: glparamstate.matrixindex_enabled = 0; break;
+	case GL_TEXTURE_COORD_ARRAY:  glparamstate.texunit[glparamstate.client_active_texture].texcoord_enabled = 0; break;
 	case GL_VERTEX_ARRAY:         glparamstate.vertex_enabled = 0; break;
 	case GL_EDGE_FLAG_ARRAY:
 	case GL_FOG_COORD_ARRAY:
@@ -1201,11 +3234,24 @@ void glDisableClientState( GLenum cap ) {
 	}
 }
 void glEnableClientState( GLenum cap ) {
+	glcmdword_ * cmd;
+	if (_deferring() && (cmd = _defer_begin(DEFER_ENABLE_CLIENT,1))) {
+		switch(cap) {
+		case GL_NORMAL_ARRAY:         defer.client.normal_enabled = 1; break;
+		case GL_TEXTURE_COORD_ARRAY:  defer.client.texcoord_enabled[defer.client.client_active_texture] = 1; break;
+		case GL_VERTEX_ARRAY:         defer.client.vertex_enabled = 1; break;
+		case GL_MATRIX_INDEX_ARRAY_ARB: defer.client.matrixindex_enabled = 1; break;
+		}
+		cmd[0].i = cap;
+		_defer_end(cmd);
+		return;
+	}
 	switch(cap) {
 	case GL_INDEX_ARRAY:          glparamstate.index_enabled = 1; break;
 	case GL_NORMAL_ARRAY:         glparamstate.normal_enabled = 1; break;
-	case GL_TEXTURE_COORD_ARRAY:  glparamstate.texcoord_enabled = 1; break;
+	case GL_TEXTURE_COORD_ARRAY:  glparamstate.texunit[glparamstate.client_active_texture].texcoord_enabled = 1; break;
 	case GL_VERTEX_ARRAY:         glparamstate.vertex_enabled = 1; break;
+	case GL_MATRIX_INDEX_ARRAY_ARB: glparamstate.matrixindex_enabled = 1; break;
 	case GL_EDGE_FLAG_ARRAY:
 	case GL_FOG_COORD_ARRAY:
 	case GL_SECONDARY_COLOR_ARRAY:
@@ -1215,30 +3261,77 @@ void glEnableClientState( GLenum cap ) {
 }
 
 void glVertexPointer(GLint size, GLenum type, GLsizei stride, const GLvoid * pointer) {
+	glcmdword_ * cmd;
+	if (_deferring() && (cmd = _defer_begin(DEFER_VERTEX_POINTER,4))) {
+		defer.client.vertex_array = (float*)pointer;
+		defer.client.vertex_stride = stride ? stride : size;
+		cmd[0].i = size; cmd[1].i = type; cmd[2].i = stride; cmd[3].p = pointer;
+		_defer_end(cmd);
+		return;
+	}
 	glparamstate.vertex_array = (float*)pointer;
 	glparamstate.vertex_stride = stride;
 	if (stride == 0) glparamstate.vertex_stride = size;
 }
 void glNormalPointer(GLenum type, GLsizei stride, const GLvoid * pointer) {
+	glcmdword_ * cmd;
+	if (_deferring() && (cmd = _defer_begin(DEFER_NORMAL_POINTER,3))) {
+		defer.client.normal_array = (float*)pointer;
+		defer.client.normal_stride = stride ? stride : 3;
+		cmd[0].i = type; cmd[1].i = stride; cmd[2].p = pointer;
+		_defer_end(cmd);
+		return;
+	}
 	glparamstate.normal_array = (float*)pointer;
 	glparamstate.normal_stride = stride;
 	if (stride == 0) glparamstate.normal_stride = 3;
 }
 void glTexCoordPointer(GLint size, GLenum type, GLsizei stride, const GLvoid * pointer) {
-	glparamstate.texcoord_array = (float*)pointer;
-	glparamstate.texcoord_stride = stride;
-	if (stride == 0) glparamstate.texcoord_stride = size;
+	glcmdword_ * cmd;
+	if (_deferring() && (cmd = _defer_begin(DEFER_TEXCOORD_POINTER,4))) {
+		defer.client.texcoord_array[defer.client.client_active_texture] = (float*)pointer;
+		defer.client.texcoord_stride[defer.client.client_active_texture] = stride ? stride : size;
+		cmd[0].i = size; cmd[1].i = type; cmd[2].i = stride; cmd[3].p = pointer;
+		_defer_end(cmd);
+		return;
+	}
+	struct texunit * unit = &glparamstate.texunit[glparamstate.client_active_texture];
+	unit->texcoord_array = (float*)pointer;
+	unit->texcoord_stride = stride;
+	if (stride == 0) unit->texcoord_stride = size;
+}
+
+// Only the first index of every vertex is used: GX selects a single matrix
+// per vertex, there's no vertex blending
+void glMatrixIndexPointerARB(GLint size, GLenum type, GLsizei stride, const GLvoid * pointer) {
+	_defer_sync();
+	glparamstate.matrixindex_array = (void*)pointer;
+	glparamstate.matrixindex_type = type;
+	glparamstate.matrixindex_stride = stride;
+	if (stride == 0) glparamstate.matrixindex_stride = size;
+}
+
+void glCurrentPaletteMatrixARB(GLint index) {
+	_defer_sync();
+	if (index < 0 || index >= MAX_PALETTE_MATRICES) return;
+	glparamstate.cur_palette = index;
+	if (index >= glparamstate.palette_size)
+		glparamstate.palette_size = index + 1;
 }
 
 void glInterleavedArrays( GLenum format, GLsizei stride, const GLvoid *pointer ) {
+	_defer_sync();
+	// Texture coordinates go to the client active unit
+	struct texunit * unit = &glparamstate.texunit[glparamstate.client_active_texture];
+
 	glparamstate.vertex_array = (float*)pointer;
 	glparamstate.normal_array = (float*)pointer;
-	glparamstate.texcoord_array = (float*)pointer;
+	unit->texcoord_array = (float*)pointer;
 	glparamstate.color_array = (float*)pointer;
 
 	glparamstate.index_enabled = 0;
 	glparamstate.normal_enabled = 0;
-	glparamstate.texcoord_enabled = 0;
+	unit->texcoord_enabled = 0;
 	glparamstate.vertex_enabled = 0;
 	glparamstate.color_enabled = 0;
 
@@ -1260,14 +3353,14 @@ void glInterleavedArrays( GLenum format, GLsizei stride, const GLvoid *pointer )
 		break;
 	case GL_T2F_V3F:
 		glparamstate.vertex_enabled = 1;
-		glparamstate.texcoord_enabled = 1;
+		unit->texcoord_enabled = 1;
 		cstride = 5;
 		glparamstate.vertex_array += 2;
 		break;
 	case GL_T2F_N3F_V3F:
 		glparamstate.vertex_enabled = 1;
 		glparamstate.normal_enabled = 1;
-		glparamstate.texcoord_enabled = 1;
+		unit->texcoord_enabled = 1;
 		cstride = 8;
 
 		glparamstate.vertex_array += 5;
@@ -1293,7 +3386,7 @@ void glInterleavedArrays( GLenum format, GLsizei stride, const GLvoid *pointer )
 	case GL_T2F_C3F_V3F:
 		glparamstate.vertex_enabled = 1;
 		glparamstate.color_enabled = 1;
-		glparamstate.texcoord_enabled = 1;
+		unit->texcoord_enabled = 1;
 		cstride = 8;
 
 		glparamstate.vertex_array += 5;
@@ -1303,7 +3396,7 @@ void glInterleavedArrays( GLenum format, GLsizei stride, const GLvoid *pointer )
 		glparamstate.vertex_enabled = 1;
 		glparamstate.normal_enabled = 1;
 		glparamstate.color_enabled = 1;
-		glparamstate.texcoord_enabled = 1;
+		unit->texcoord_enabled = 1;
 		cstride = 12;
 
 		glparamstate.vertex_array += 9;
@@ -1326,7 +3419,7 @@ void glInterleavedArrays( GLenum format, GLsizei stride, const GLvoid *pointer )
 	glparamstate.color_stride = cstride;
 	glparamstate.normal_stride = cstride;
 	glparamstate.vertex_stride = cstride;
-	glparamstate.texcoord_stride = cstride;
+	unit->texcoord_stride = cstride;
 }
 
 /*
@@ -1348,102 +3441,180 @@ void glInterleavedArrays( GLenum format, GLsizei stride, const GLvoid *pointer )
 
    GX hardware can do lights with:
     - Distance based attenuation
-    - Angle based attenuation (for diffuse lights)
-   
-   We simulate each light this way:
+    - Angle based attenuation (spotlights, GX_AF_SPOT)
+    - Specular attenuation (GX_AF_SPEC)
 
-    - Ambient: Using distance based attenuation, disabling
-      angle-based attenuation (GX_DF_NONE).
-    - Diffuse: Using distance based attenuation, enabling 
+   As there are only two color channels we can't have
+   a channel for each term, so:
+
+    - Ambient: Not attenuated, so the contribution of
+      every light is summed with the global ambient
+      into the ambient register of the diffuse channel.
+    - Diffuse: Distance and spotlight attenuation,
       angle-based attenuation in clamp mode (GX_DF_CLAMP)
-    - Specular: Specular based attenuation (GX_AF_SPEC)
-      
-   As each channel is configured for all the TEV stages
-   we CANNOT emulate the three types of light at once.
-   So we emulate two types only.
+    - Specular: Specular attenuation using the half
+      angle vector for an infinite viewer. Emission
+      goes into the ambient register of this channel.
 
    For unlit scenes the setup is:
      - TEV 0: Modulate vertex color with texture
               Speed hack: use constant register
               If no tex, just pass color
-   For ambient+diffuse lights:
-     - TEV 0: Pass RAS0 color with material color
-          set to vertex color (to modulate vert color).
-          Set the ambient value for this channel to 0.
-         Speed hack: Use material register for constant
-          color
-     - TEV 1: Sum RAS1 color with material color
-          set to vertex color (to modulate vert color)
-          to the previous value. Also set the ambient
-          value to the global ambient value.
-         Speed hack: Use material register for constant
-          color
-     - TEV 2: If texture is enabled multiply the texture
-          rasterized color with the previous value.
-      The result is:
-
-     Color = TexC * (VertColor*AmbientLightColor*Atten
-      + VertColor*DiffuseLightColor*Atten*DifAtten)
-
-     As we use the material register for vertex color
-     the material colors will be multiplied with the 
-     light color and uploaded as light color.
-
-     We'll be using 0-3 lights for ambient and 4-7 lights
-     for diffuse
+   For lit scenes there's at most one color per vertex:
+     - TEV 0: RAS0 color is diffuse*(ambient register +
+          diffuse lights), the material register holds the
+          diffuse material (or the vertex color is used, with
+          glColorMaterial). The ambient register holds the
+          global and per-light ambient when the vertex color
+          is the ambient material too, or ambient*MatAmbient/
+          MatDiffuse when that fits in [0,1]. Otherwise the
+          ambient register is black and ambient*MatAmbient is
+          a konst color added to RAS0 in this stage, and all
+          the textures get a stage of their own. Modulated by
+          the first texture if any.
+     - TEV 1..N: Multiply the other textures with the
+          previous value.
+     - TEV N+1: Only with specular lights or emission, sum
+          RAS1 color, the specular channel, to the previous
+          value. The material register holds white (the
+          material specular color is premultiplied into
+          the light colors) and the ambient register the
+          emission.
+      The result is (specular isn't textured, like
+      GL_SEPARATE_SPECULAR_COLOR):
+
+     Color = TexC * (AmbientColor*MatAmbient + MatDiffuse*DiffuseLightColor*Atten*DifAtten)
+      + Emission + SpecularLightColor*SpecAtten
+
+     Material changes are just register writes, the light
+     objects are cached and only loaded again when the
+     light changes (or the specular material does).
+
+     Each enabled GL light uses the GX light with the same
+     number for diffuse, the specular lights take the GX
+     lights which are left (so with more than four lights
+     some highlights may be missing)
 
 ******************************************************/
 
+static const float _one4[4] = {1,1,1,1};
 
-int __prepare_lighting() {
-	int i, mask = 0;
-	for (i = 0; i < MAX_LIGHTS; i++) {
-		if (!glparamstate.lighting.lights[i].enabled) continue;
+static GXColor _lit_color(const float * mat, const float * light) {
+	GXColor c = {
+		_clampf_01(mat[0]*light[0])*255.0f,
+		_clampf_01(mat[1]*light[1])*255.0f,
+		_clampf_01(mat[2]*light[2])*255.0f,
+		_clampf_01(mat[3]*light[3])*255.0f  };
+	return c;
+}
 
-		// Multiply the light color by the material color and set as light color
-		GXColor amb_col = {
-				_clampf_01(glparamstate.lighting.matambient[0]*glparamstate.lighting.lights[i].ambient_color[0])*255.0f,
-				_clampf_01(glparamstate.lighting.matambient[1]*glparamstate.lighting.lights[i].ambient_color[1])*255.0f,
-				_clampf_01(glparamstate.lighting.matambient[2]*glparamstate.lighting.lights[i].ambient_color[2])*255.0f,
-				_clampf_01(glparamstate.lighting.matambient[3]*glparamstate.lighting.lights[i].ambient_color[3])*255.0f  };
+// GX has a few fixed spotlight falloffs, pick the closest to the GL exponent
+static unsigned char _spot_function(float cutoff, int exponent) {
+	if (cutoff >= 180.0f) return GX_SP_OFF;
+	if (exponent == 0) return GX_SP_FLAT;
+	if (exponent <= 2) return GX_SP_COS;
+	if (exponent <= 8) return GX_SP_COS2;
+	return GX_SP_SHARP;
+}
 
-		GXColor diff_col = {
-				_clampf_01(glparamstate.lighting.matdiffuse[0]*glparamstate.lighting.lights[i].diffuse_color[0])*255.0f,
-				_clampf_01(glparamstate.lighting.matdiffuse[1]*glparamstate.lighting.lights[i].diffuse_color[1])*255.0f,
-				_clampf_01(glparamstate.lighting.matdiffuse[2]*glparamstate.lighting.lights[i].diffuse_color[2])*255.0f,
-				_clampf_01(glparamstate.lighting.matdiffuse[3]*glparamstate.lighting.lights[i].diffuse_color[3])*255.0f  };
+// Loads the diffuse lights (returned mask), GL light i is GX light i, and the
+// specular ones (spec_mask). Light objects are cached, only the lights which
+// changed (or whose GX light was taken by another one) are loaded again.
+int __prepare_lighting(const float * ms, int * spec_mask) {
+	int i, mask = 0;
+	char has_spec = (ms[0] > 0 || ms[1] > 0 || ms[2] > 0);
+	signed char * owner = glparamstate.lighting.slot_owner;
+
+	// Specular lights are premultiplied by the material
+	char spec_changed = memcmp(glparamstate.lighting.loaded_specular, ms, 4*sizeof(float)) != 0 ||
+	                    glparamstate.lighting.loaded_shininess != glparamstate.lighting.matshininess;
+	if (spec_changed) {
+		memcpy(glparamstate.lighting.loaded_specular, ms, 4*sizeof(float));
+		glparamstate.lighting.loaded_shininess = glparamstate.lighting.matshininess;
+	}
 
-		GX_InitLightColor (&glparamstate.lighting.lightobj[i],  amb_col);
-		GX_InitLightColor (&glparamstate.lighting.lightobj[i+4],diff_col);
+	*spec_mask = 0;
+	for (i = 0; i < MAX_LIGHTS; i++) {
+		struct alight * light = &glparamstate.lighting.lights[i];
+		if (!light->enabled) continue;
+		mask |= (1<<(i));
+		if (!light->dirty && owner[i] == i) continue;
 
-		GX_InitLightPosv(&glparamstate.lighting.lightobj[i],  &glparamstate.lighting.lights[i].position[0]);
-		GX_InitLightPosv(&glparamstate.lighting.lightobj[i+4],&glparamstate.lighting.lights[i].position[0]);
+		// The material color is in the channel register
+		GXLightObj * diff = &glparamstate.lighting.lightobj[i];
+		GX_InitLightColor(diff, _lit_color(light->diffuse_color, _one4));
+		GX_InitLightPosv(diff, &light->position[0]);
 
-		// FIXME: Need to consider spotlights
-		if (glparamstate.lighting.lights[i].position[3] == 0) {
+		if (light->position[3] == 0) {
 			// Directional light, it's a point light very far without atenuation
-			GX_InitLightAttn(&glparamstate.lighting.lightobj[i],   1,0,0, 1,0,0);
-			GX_InitLightAttn(&glparamstate.lighting.lightobj[i+4], 1,0,0, 1,0,0);
+			GX_InitLightAttn(diff, 1,0,0, 1,0,0);
 		}else{
-			// Point light
-			GX_InitLightAttn(&glparamstate.lighting.lightobj[i],   1,0,0,
-					glparamstate.lighting.lights[i].atten[0],glparamstate.lighting.lights[i].atten[1],glparamstate.lighting.lights[i].atten[2]);
-			GX_InitLightAttn(&glparamstate.lighting.lightobj[i+4], 1,0,0,
-					glparamstate.lighting.lights[i].atten[0],glparamstate.lighting.lights[i].atten[1],glparamstate.lighting.lights[i].atten[2]);
-
-			GX_InitLightDir(&glparamstate.lighting.lightobj[i  ], 0,-1,0);
-			GX_InitLightDir(&glparamstate.lighting.lightobj[i+4], 0,-1,0);
+			// Point light or spotlight
+			GX_InitLightDirv(diff, &light->spot_direction[0]);
+			GX_InitLightSpot(diff, light->spot_cutoff, _spot_function(light->spot_cutoff, light->spot_exponent));
+			GX_InitLightAttnK(diff, light->atten[0], light->atten[1], light->atten[2]);
 		}
+		GX_LoadLightObj(diff, 1<<i);
+		owner[i] = i;
+	}
 
-		GX_LoadLightObj(&glparamstate.lighting.lightobj[i],1<<i);
-		GX_LoadLightObj(&glparamstate.lighting.lightobj[i+4],(1<<i)<<4);
-
-		mask |= (1<<(i));
+	// Specular lights use the GX lights left free by the disabled GL lights
+	int slot = MAX_LIGHTS-1;
+	for (i = 0; i < MAX_LIGHTS && has_spec; i++) {
+		struct alight * light = &glparamstate.lighting.lights[i];
+		if (!light->enabled) continue;
+
+		float * ls = light->specular_color;
+		if (ls[0] > 0 || ls[1] > 0 || ls[2] > 0) {
+			while (slot >= 0 && (mask & (1<<slot))) slot--;
+			if (slot < 0) break;  // Out of lights, no more highlights
+
+			*spec_mask |= (1<<slot);
+			if (light->dirty || spec_changed || owner[slot] != i + MAX_LIGHTS) {
+				GXLightObj * spec = &glparamstate.lighting.lightobj[slot];
+				GX_InitLightColor(spec, _lit_color(ms, ls));
+				// The direction the light travels, point lights use the one at the origin
+				float dir[3];
+				if (light->position[3] == 0) {
+					dir[0] = -light->direction[0];
+					dir[1] = -light->direction[1];
+					dir[2] = -light->direction[2];
+				}else{
+					float len = sqrtf(light->position[0]*light->position[0] +
+					                  light->position[1]*light->position[1] +
+					                  light->position[2]*light->position[2]);
+					if (len == 0) len = 1;
+					dir[0] = -light->position[0] / len;
+					dir[1] = -light->position[1] / len;
+					dir[2] = -light->position[2] / len;
+				}
+				GX_InitSpecularDirv(spec, dir);
+				GX_InitLightShininess(spec, glparamstate.lighting.matshininess);
+				GX_LoadLightObj(spec, 1<<slot);
+				owner[slot] = i + MAX_LIGHTS;
+			}
+			slot--;
+		}
 	}
+
+	// Every enabled light is up to date now
+	for (i = 0; i < MAX_LIGHTS; i++)
+		if (glparamstate.lighting.lights[i].enabled)
+			glparamstate.lighting.lights[i].dirty = 0;
 	return mask;
 
 }
 
+// Whether the vertex colors are sent. When lit they are only used if they
+// replace the diffuse material (glColorMaterial)
+int __vertex_colors() {
+	if (!glparamstate.color_enabled) return 0;
+	if (!glparamstate.lighting.enabled) return 1;
+	return glparamstate.lighting.color_material &&
+	       (glparamstate.lighting.color_material_mode == GL_DIFFUSE ||
+	        glparamstate.lighting.color_material_mode == GL_AMBIENT_AND_DIFFUSE);
+}
+
 unsigned char __draw_mode(GLenum mode) {
 	unsigned char gxmode;
 	switch(mode) {
@@ -1464,79 +3635,316 @@ unsigned char __draw_mode(GLenum mode) {
 	return gxmode;
 }
 
+// Texture coordinate generation for the enabled units (texen is a unit mask).
+// Generated coordinates are packed: the Nth enabled unit uses GX_TEXCOORDN.
+// The texture matrix and glTexGen are folded in a single GX texture matrix
+// (GX_TEXMTXN) which is applied to the vertex texcoords, the object space
+// position (OBJECT_LINEAR, EYE_LINEAR) or the normal (SPHERE_MAP).
+// Textures copied from the EFB are stored upside down, so their T coordinate
+// is flipped too. Returns the number of coordinates generated.
+// GX is only set up again when the units, the texture matrices, the texgen
+// state or (for eye linear and sphere mapping) the modelview change.
+int __setup_texcoordgen(int texen) {
+	Mtx normalm;
+	float (*modelview)[4] = glparamstate.modelview_matrix;
+	int unit, n = 0, i, j, k;
+
+	int flipped = 0, eyespace = 0, sphere = 0;
+	for (unit = 0; unit < MAX_TEXTURE_UNITS; unit++) {
+		if (!(texen & (1 << unit))) continue;
+		struct texunit * tu = &glparamstate.texunit[unit];
+		if (texture_list[tu->glcurtex].flipped) flipped |= 1 << unit;
+		for (i = 0; i < 4; i++) {
+			if (!(tu->texgen_enabled & (1 << i))) continue;
+			if (tu->texgen_mode[i] == GL_SPHERE_MAP) sphere = 1;
+			if (tu->texgen_mode[i] == GL_EYE_LINEAR) eyespace = 1;
+		}
+		n++;
+	}
+	if (!glparamstate.dirty.bits.dirty_texmtx && texen == glparamstate.texgen_texen &&
+	    flipped == glparamstate.texgen_flipped &&
+	    !((eyespace || sphere) && glparamstate.dirty.bits.dirty_matrices))
+		return n;
+	glparamstate.texgen_texen = texen;
+	glparamstate.texgen_flipped = flipped;
+	glparamstate.dirty.bits.dirty_texmtx = 0;
+	n = 0;
+
+	// Normal matrix, for sphere mapping
+	if (sphere) {
+		Mtx mvinverse;
+		_mtx_inverse(modelview,mvinverse);
+		_mtx_transpose(mvinverse,normalm);
+	}
+
+	for (unit = 0; unit < MAX_TEXTURE_UNITS; unit++) {
+		if (!(texen & (1 << unit))) continue;
+		struct texunit * tu = &glparamstate.texunit[unit];
+
+		// gen maps the GX source (s,t,1,1), (x,y,z,1) or (nx,ny,nz,1) to GL (s,t,r,q)
+		float gen[4][4], final[4][4];
+		memset(gen,0,sizeof(gen));
+		gen[3][3] = 1;
+
+		unsigned int src = GX_TG_TEX0 + unit;
+		if (tu->texgen_enabled & 3) {
+			src = GX_TG_POS;
+			for (i = 0; i < 2; i++)
+				if ((tu->texgen_enabled & (1 << i)) && tu->texgen_mode[i] == GL_SPHERE_MAP)
+					src = GX_TG_NRM;
+
+			// GX takes a single source per coordinate, anything else is left as zero
+			for (i = 0; i < 4; i++) {
+				if (!(tu->texgen_enabled & (1 << i))) continue;
+				if (src == GX_TG_NRM) {
+					if (i >= 2 || tu->texgen_mode[i] != GL_SPHERE_MAP) continue;
+					// Eye space normal scaled and biased to [0,1]
+					for (j = 0; j < 3; j++)
+						gen[i][j] = 0.5f*normalm[i][j];
+					gen[i][3] = 0.5f;
+				}else if (tu->texgen_mode[i] == GL_OBJECT_LINEAR) {
+					for (j = 0; j < 4; j++)
+						gen[i][j] = tu->texgen_objplane[i][j];
+				}else if (tu->texgen_mode[i] == GL_EYE_LINEAR) {
+					for (j = 0; j < 4; j++) {
+						gen[i][j] = 0;
+						for (k = 0; k < 4; k++)
+							gen[i][j] += tu->texgen_eyeplane[i][k]*modelview[k][j];
+					}
+				}
+			}
+		}else{
+			gen[0][0] = 1;
+			gen[1][1] = 1;
+		}
+
+		// final = texture matrix * gen
+		_mtx44_concat(tu->texture_matrix,gen,final);
+
+		if (texture_list[tu->glcurtex].flipped) {
+			// t/q -> 1 - t/q
+			for (j = 0; j < 4; j++)
+				final[1][j] = final[3][j] - final[1][j];
+		}
+
+		int projected = (final[3][0] != 0 || final[3][1] != 0 || final[3][2] != 0 || final[3][3] != 1);
+		if (!projected && src == GX_TG_TEX0 + unit &&
+			final[0][0] == 1 && final[0][1] == 0 && final[0][2] == 0 && final[0][3] == 0 &&
+			final[1][0] == 0 && final[1][1] == 1 && final[1][2] == 0 && final[1][3] == 0) {
+			GX_SetTexCoordGen(GX_TEXCOORD0 + n, GX_TG_MTX2x4, src, GX_IDENTITY);
+		}else{
+			Mtx texmtx;
+			for (j = 0; j < 4; j++) {
+				texmtx[0][j] = final[0][j];
+				texmtx[1][j] = final[1][j];
+				texmtx[2][j] = final[3][j];
+			}
+			if (projected) {
+				GX_LoadTexMtxImm(texmtx,GX_TEXMTX0 + n*3,GX_MTX3x4);
+				GX_SetTexCoordGen(GX_TEXCOORD0 + n, GX_TG_MTX3x4, src, GX_TEXMTX0 + n*3);
+			}else{
+				GX_LoadTexMtxImm(texmtx,GX_TEXMTX0 + n*3,GX_MTX2x4);
+				GX_SetTexCoordGen(GX_TEXCOORD0 + n, GX_TG_MTX2x4, src, GX_TEXMTX0 + n*3);
+			}
+		}
+		n++;
+	}
+	GX_SetNumTexGens(n);
+	return n;
+}
+
+// Sets up the stages modulating the previous stage result with every enabled
+// texture unit, starting at TEV stage "stage" and texture coordinate "texcoord".
+// Returns the number of TEV stages in use.
+int __setup_texture_stages(int texen, int stage, int texcoord) {
+	int unit;
+	for (unit = 0; unit < MAX_TEXTURE_UNITS; unit++) {
+		if (!(texen & (1 << unit))) continue;
+
+		// In data: c: Texture Color b: Previous value (CPREV)
+		GX_SetTevColorIn (GX_TEVSTAGE0 + stage,GX_CC_ZERO,GX_CC_CPREV,GX_CC_TEXC,GX_CC_ZERO);
+		GX_SetTevAlphaIn (GX_TEVSTAGE0 + stage,GX_CA_ZERO,GX_CA_APREV,GX_CA_TEXA,GX_CA_ZERO);
+		// Operation: b*c
+		GX_SetTevColorOp (GX_TEVSTAGE0 + stage,GX_TEV_ADD,GX_TB_ZERO,GX_CS_SCALE_1,GX_TRUE,GX_TEVPREV);
+		GX_SetTevAlphaOp (GX_TEVSTAGE0 + stage,GX_TEV_ADD,GX_TB_ZERO,GX_CS_SCALE_1,GX_TRUE,GX_TEVPREV);
+		// Do not select any raster value, the unit texture map and its texture coordinates
+		GX_SetTevOrder   (GX_TEVSTAGE0 + stage,GX_TEXCOORD0 + texcoord,GX_TEXMAP0 + unit,GX_COLORNULL);
+		stage++;
+		texcoord++;
+	}
+	return stage;
+}
+
+// Bitmask of the texture units which are enabled and have texture coordinates
+// (either from an array or generated)
+int __enabled_texture_units() {
+	int unit, texen = 0;
+	for (unit = 0; unit < MAX_TEXTURE_UNITS; unit++) {
+		struct texunit * tu = &glparamstate.texunit[unit];
+		if (tu->enabled && (tu->texcoord_enabled || (tu->texgen_enabled & 3)) && texture_list[tu->glcurtex].data != 0)
+			texen |= (1 << unit);
+	}
+	return texen;
+}
+
+// Subset of texen which takes the texture coordinates from the vertex data
+int __texcoord_units(int texen) {
+	int unit, texc = 0;
+	for (unit = 0; unit < MAX_TEXTURE_UNITS; unit++) {
+		if ((texen & (1 << unit)) && !(glparamstate.texunit[unit].texgen_enabled & 3))
+			texc |= (1 << unit);
+	}
+	return texc;
+}
+
 void __setup_render_stages(int texen) {
 	if (glparamstate.lighting.enabled) {
-		int light_mask = __prepare_lighting();
+		int i;
+		char vtx = __vertex_colors();
+
+		// Material, glColorMaterial replaces one of its colors with the current color
+		float matamb[4], matdiff[4], matspec[4], matemis[4];
+		memcpy(matamb, glparamstate.lighting.matambient, sizeof(matamb));
+		memcpy(matdiff,glparamstate.lighting.matdiffuse, sizeof(matdiff));
+		memcpy(matspec,glparamstate.lighting.matspecular,sizeof(matspec));
+		memcpy(matemis,glparamstate.lighting.matemission,sizeof(matemis));
+		if (glparamstate.lighting.color_material) {
+			float * ccol = glparamstate.imm_mode.current_color;
+			switch (glparamstate.lighting.color_material_mode) {
+			case GL_AMBIENT_AND_DIFFUSE:
+				memcpy(matamb, ccol,sizeof(matamb));
+				memcpy(matdiff,ccol,sizeof(matdiff));
+				break;
+			case GL_DIFFUSE:  memcpy(matdiff,ccol,sizeof(matdiff)); break;
+			case GL_AMBIENT:  memcpy(matamb, ccol,sizeof(matamb));  break;
+			case GL_SPECULAR: memcpy(matspec,ccol,sizeof(matspec)); break;
+			case GL_EMISSION: memcpy(matemis,ccol,sizeof(matemis)); break;
+			}
+		}
 
-		GXColor color_zero = {0,0,0,0};
-		GXColor color_gamb = {
-							_clampf_01(glparamstate.lighting.matambient[0]*glparamstate.lighting.globalambient[0])*255.0f,
-							_clampf_01(glparamstate.lighting.matambient[1]*glparamstate.lighting.globalambient[1])*255.0f,
-							_clampf_01(glparamstate.lighting.matambient[2]*glparamstate.lighting.globalambient[2])*255.0f,
-							_clampf_01(glparamstate.lighting.matambient[3]*glparamstate.lighting.globalambient[3])*255.0f  };
+		int spec_mask;
+		int light_mask = __prepare_lighting(matspec, &spec_mask);
+
+		GXColor color_white = {255,255,255,0};
+		// Ambient: the global one and the one of the lights
+		float amb[4] = { glparamstate.lighting.globalambient[0], glparamstate.lighting.globalambient[1],
+		                 glparamstate.lighting.globalambient[2], 1.0f };
+		for (i = 0; i < MAX_LIGHTS; i++) {
+			if (!glparamstate.lighting.lights[i].enabled) continue;
+			amb[0] += glparamstate.lighting.lights[i].ambient_color[0];
+			amb[1] += glparamstate.lighting.lights[i].ambient_color[1];
+			amb[2] += glparamstate.lighting.lights[i].ambient_color[2];
+		}
+		// Color0 computes diffuse*(ambient register + lights). When the ambient
+		// material is the vertex color (GL_AMBIENT_AND_DIFFUSE) that's exact with
+		// the ambient lights in the register. With a register diffuse material
+		// the register holds ambient*matambient/matdiffuse, as long as that fits
+		// in [0,1]. Otherwise the register is black and ambient*matambient is
+		// added to the raster color in TEV stage 0 as a konst color, before any
+		// texture modulates it.
+		float amb0[4] = { 0, 0, 0, 1.0f };
+		float ambk[4] = { 0, 0, 0, 1.0f };
+		if (vtx && glparamstate.lighting.color_material_mode == GL_AMBIENT_AND_DIFFUSE) {
+			memcpy(amb0,amb,sizeof(amb0));
+		}else{
+			char fits = !vtx;
+			for (i = 0; i < 3; i++) {
+				ambk[i] = amb[i]*matamb[i];
+				if (ambk[i] <= 0)
+					amb0[i] = 0;
+				else if (matdiff[i] >= ambk[i])
+					amb0[i] = ambk[i]/matdiff[i];
+				else
+					fits = 0;
+			}
+			if (fits)
+				ambk[0] = ambk[1] = ambk[2] = 0;
+			else
+				amb0[0] = amb0[1] = amb0[2] = 0;
+		}
+		GXColor color_amb = _lit_color(amb0, _one4);
+		GXColor color_ambk = _lit_color(ambk, _one4);
+		char use_ambk = color_ambk.r || color_ambk.g || color_ambk.b;
+		float emis[4] = { matemis[0], matemis[1], matemis[2], 1.0f };
+		GXColor color_emis = _lit_color(emis, _one4);
+		color_emis.a = 0;
 
-		GX_SetNumChans(2);
-		GX_SetNumTevStages(2);
-		GX_SetNumTexGens(0);
+		// The specular channel is only needed with specular lights or emission
+		char use_spec = spec_mask || color_emis.r || color_emis.g || color_emis.b;
 
+		// Material (diffuse) color, the alpha is the material one too
 		unsigned char vert_color_src = GX_SRC_VTX;
-		if (!glparamstate.color_enabled) {
+		if (!vtx) {
 			vert_color_src = GX_SRC_REG;
+			GX_SetChanMatColor(GX_COLOR0A0,_lit_color(matdiff, _one4));
+		}
 
-			GXColor ccol = {
-				glparamstate.imm_mode.current_color[0]*255.0f,
-				glparamstate.imm_mode.current_color[1]*255.0f,
-				glparamstate.imm_mode.current_color[2]*255.0f,
-				glparamstate.imm_mode.current_color[3]*255.0f  };
+		// Color0 channel: Multiplies the light raster result with the material color. Ambient is set to register (see above)
+		// The alpha is the material one (no lights)
+		GX_SetChanCtrl   (GX_COLOR0,GX_TRUE,GX_SRC_REG,vert_color_src,light_mask,GX_DF_CLAMP,GX_AF_SPOT);
+		GX_SetChanCtrl   (GX_ALPHA0,GX_TRUE,GX_SRC_REG,vert_color_src,0,GX_DF_NONE,GX_AF_NONE);
+		GX_SetChanAmbColor (GX_COLOR0A0,color_amb);
 
-			GX_SetChanMatColor(GX_COLOR0A0,ccol);
-			GX_SetChanMatColor(GX_COLOR1A1,ccol);
-		}
+		// Color1 channel: Specular lights, material is white (premultiplied in the lights) and ambient is the emission
+		GX_SetChanCtrl   (GX_COLOR1,GX_TRUE,GX_SRC_REG,GX_SRC_REG,spec_mask,GX_DF_NONE,GX_AF_SPEC);
+		GX_SetChanCtrl   (GX_ALPHA1,GX_FALSE,GX_SRC_REG,GX_SRC_REG,0,GX_DF_NONE,GX_AF_NONE);
+		GX_SetChanMatColor (GX_COLOR1A1,color_white);
+		GX_SetChanAmbColor (GX_COLOR1A1,color_emis);
 
-		// Color0 channel: Multiplies the light raster result with the vertex color. Ambient is set to register (which is zero)
-		GX_SetChanCtrl   (GX_COLOR0A0,GX_TRUE,GX_SRC_REG,vert_color_src,light_mask,GX_DF_NONE,GX_AF_SPOT);
-		GX_SetChanAmbColor (GX_COLOR0A0,color_gamb);
+		GX_SetNumChans(use_spec ? 2 : 1);
 
-		// Color1 channel: Multiplies the light raster result with the vertex color. Ambient is set to register (which is global ambient)
-		GX_SetChanCtrl   (GX_COLOR1A1,GX_TRUE,GX_SRC_REG,vert_color_src,light_mask << 4,GX_DF_CLAMP,GX_AF_SPOT);
-		GX_SetChanAmbColor (GX_COLOR1A1,color_zero);
+		int first = 0;
+		if (texen)
+			while (!(texen & (1 << first))) first++;
 
-		// STAGE 0: ambient*vert_color -> cprev
-		// In data: d: Raster Color
-		GX_SetTevColorIn (GX_TEVSTAGE0,GX_CC_ZERO,GX_CC_ZERO,GX_CC_ZERO,GX_CC_RASC);
-		GX_SetTevAlphaIn (GX_TEVSTAGE0,GX_CA_ZERO,GX_CA_ZERO,GX_CA_ZERO,GX_CA_RASA);
-		// Operation: Pass d
+		int stage = 1;
+		if (use_ambk) {
+			// STAGE 0: (ambient+diffuse)*vert_color + ambient konst -> cprev
+			// In data: a: Konst Color d: Raster Color
+			GX_SetTevKColorSel(GX_TEVSTAGE0,GX_TEV_KCSEL_K0);
+			GX_SetTevKColor  (GX_KCOLOR0,color_ambk);
+			GX_SetTevColorIn (GX_TEVSTAGE0,GX_CC_KONST,GX_CC_ZERO,GX_CC_ZERO,GX_CC_RASC);
+			GX_SetTevAlphaIn (GX_TEVSTAGE0,GX_CA_ZERO,GX_CA_ZERO,GX_CA_ZERO,GX_CA_RASA);
+			GX_SetTevOrder   (GX_TEVSTAGE0,GX_TEXCOORDNULL,GX_TEXMAP_DISABLE,GX_COLOR0A0);
+			// STAGE 1..N: cprev * texc -> cprev, one per texture unit
+			__setup_texcoordgen(texen);
+			if (texen)
+				stage = __setup_texture_stages(texen,1,0);
+		}else if (texen) {
+			// STAGE 0: (ambient+diffuse)*vert_color * texc -> cprev
+			// In data: b: Raster Color c: Texture Color
+			GX_SetTevColorIn (GX_TEVSTAGE0,GX_CC_ZERO,GX_CC_RASC,GX_CC_TEXC,GX_CC_ZERO);
+			GX_SetTevAlphaIn (GX_TEVSTAGE0,GX_CA_ZERO,GX_CA_RASA,GX_CA_TEXA,GX_CA_ZERO);
+			// Select COLOR0A0 for the rasterizer, first unit texture map and TEXCOORD0 slot for tex coordinates
+			GX_SetTevOrder   (GX_TEVSTAGE0,GX_TEXCOORD0,GX_TEXMAP0 + first,GX_COLOR0A0);
+			// STAGE 1..N: cprev * texc -> cprev, one per other texture unit
+			__setup_texcoordgen(texen);
+			stage = __setup_texture_stages(texen & ~(1 << first),1,1);
+		}else{
+			// STAGE 0: (ambient+diffuse)*vert_color -> cprev
+			// In data: d: Raster Color
+			GX_SetTevColorIn (GX_TEVSTAGE0,GX_CC_ZERO,GX_CC_ZERO,GX_CC_ZERO,GX_CC_RASC);
+			GX_SetTevAlphaIn (GX_TEVSTAGE0,GX_CA_ZERO,GX_CA_ZERO,GX_CA_ZERO,GX_CA_RASA);
+			// Select COLOR0A0 for the rasterizer, disable all textures
+			GX_SetTevOrder   (GX_TEVSTAGE0,GX_TEXCOORDNULL,GX_TEXMAP_DISABLE,GX_COLOR0A0);
+			__setup_texcoordgen(0);
+		}
 		GX_SetTevColorOp (GX_TEVSTAGE0,GX_TEV_ADD,GX_TB_ZERO,GX_CS_SCALE_1,GX_TRUE,GX_TEVPREV);
 		GX_SetTevAlphaOp (GX_TEVSTAGE0,GX_TEV_ADD,GX_TB_ZERO,GX_CS_SCALE_1,GX_TRUE,GX_TEVPREV);
-		// Select COLOR0A0 for the rasterizer, disable all textures
-		GX_SetTevOrder   (GX_TEVSTAGE0,GX_TEXCOORDNULL,GX_TEXMAP_DISABLE,GX_COLOR0A0);
-
-		// STAGE 1: diffuse*vert_color + cprev -> cprev
-		// In data: d: Raster Color a: CPREV
-		GX_SetTevColorIn (GX_TEVSTAGE1,GX_CC_CPREV,GX_CC_ZERO,GX_CC_ZERO,GX_CC_RASC);
-		GX_SetTevAlphaIn (GX_TEVSTAGE1,GX_CA_APREV,GX_CA_ZERO,GX_CA_ZERO,GX_CA_RASA);
-		// Operation: Sum a + d
-		GX_SetTevColorOp (GX_TEVSTAGE1,GX_TEV_ADD,GX_TB_ZERO,GX_CS_SCALE_1,GX_TRUE,GX_TEVPREV);
-		GX_SetTevAlphaOp (GX_TEVSTAGE1,GX_TEV_ADD,GX_TB_ZERO,GX_CS_SCALE_1,GX_TRUE,GX_TEVPREV);
-		// Select COLOR1A1 for the rasterizer, disable all textures
-		GX_SetTevOrder   (GX_TEVSTAGE1,GX_TEXCOORDNULL,GX_TEXMAP_DISABLE,GX_COLOR1A1);
 
-		if (texen) {
-			// STAGE 2: cprev * texc -> cprev
-			// In data: c: Texture Color b: Previous value (CPREV)
-			GX_SetTevColorIn (GX_TEVSTAGE2,GX_CC_ZERO,GX_CC_CPREV,GX_CC_TEXC,GX_CC_ZERO);
-			GX_SetTevAlphaIn (GX_TEVSTAGE2,GX_CA_ZERO,GX_CA_APREV,GX_CA_TEXA,GX_CA_ZERO);
-			// Operation: b*c
-			GX_SetTevColorOp (GX_TEVSTAGE2,GX_TEV_ADD,GX_TB_ZERO,GX_CS_SCALE_1,GX_TRUE,GX_TEVPREV);
-			GX_SetTevAlphaOp (GX_TEVSTAGE2,GX_TEV_ADD,GX_TB_ZERO,GX_CS_SCALE_1,GX_TRUE,GX_TEVPREV);
-			// Do not select any raster value, Texture 0 for texture rasterizer and TEXCOORD0 slot for tex coordinates
-			GX_SetTevOrder   (GX_TEVSTAGE2,GX_TEXCOORD0,GX_TEXMAP0,GX_COLORNULL);
-			// Set up the data for the TEXCOORD0 (use a identity matrix, TODO: allow user texture matrices)
-			GX_SetNumTexGens (1);
-			GX_SetTexCoordGen(GX_TEXCOORD0, GX_TG_MTX2x4, GX_TG_TEX0, GX_IDENTITY);
-
-			GX_SetNumTevStages(3);
+		if (use_spec) {
+			// LAST STAGE: specular + emission + cprev -> cprev, alpha is kept
+			// In data: d: Raster Color a: CPREV
+			GX_SetTevColorIn (GX_TEVSTAGE0 + stage,GX_CC_CPREV,GX_CC_ZERO,GX_CC_ZERO,GX_CC_RASC);
+			GX_SetTevAlphaIn (GX_TEVSTAGE0 + stage,GX_CA_ZERO,GX_CA_ZERO,GX_CA_ZERO,GX_CA_APREV);
+			// Operation: Sum a + d
+			GX_SetTevColorOp (GX_TEVSTAGE0 + stage,GX_TEV_ADD,GX_TB_ZERO,GX_CS_SCALE_1,GX_TRUE,GX_TEVPREV);
+			GX_SetTevAlphaOp (GX_TEVSTAGE0 + stage,GX_TEV_ADD,GX_TB_ZERO,GX_CS_SCALE_1,GX_TRUE,GX_TEVPREV);
+			// Select COLOR1A1 for the rasterizer, disable all textures
+			GX_SetTevOrder   (GX_TEVSTAGE0 + stage,GX_TEXCOORDNULL,GX_TEXMAP_DISABLE,GX_COLOR1A1);
+			stage++;
 		}
+		GX_SetNumTevStages(stage);
 	}else{
 		// Unlit scene
 		// TEV STAGE 0: Modulate the vertex color with the texture 0. Outputs to GX_TEVPREV
@@ -1580,11 +3988,13 @@ void __setup_render_stages(int texen) {
 			// Operation: Multiply b*c and the same goes for alphas
 			GX_SetTevColorOp (GX_TEVSTAGE0,GX_TEV_ADD,GX_TB_ZERO,GX_CS_SCALE_1,GX_TRUE,GX_TEVPREV);
 			GX_SetTevAlphaOp (GX_TEVSTAGE0,GX_TEV_ADD,GX_TB_ZERO,GX_CS_SCALE_1,GX_TRUE,GX_TEVPREV);
-			// Select COLOR0A0 for the rasterizer, Texture 0 for texture rasterizer and TEXCOORD0 slot for tex coordinates
-			GX_SetTevOrder   (GX_TEVSTAGE0,GX_TEXCOORD0,GX_TEXMAP0,rasterized_color);
-			// Set up the data for the TEXCOORD0 (use a identity matrix, TODO: allow user texture matrices)
-			GX_SetNumTexGens (1);
-			GX_SetTexCoordGen(GX_TEXCOORD0, GX_TG_MTX2x4, GX_TG_TEX0, GX_IDENTITY);
+			// Select COLOR0A0 for the rasterizer, first unit texture map and TEXCOORD0 slot for tex coordinates
+			int first = 0;
+			while (!(texen & (1 << first))) first++;
+			GX_SetTevOrder   (GX_TEVSTAGE0,GX_TEXCOORD0,GX_TEXMAP0 + first,rasterized_color);
+			// Any other unit modulates the result in its own stage
+			__setup_texcoordgen(texen);
+			GX_SetNumTevStages(__setup_texture_stages(texen & ~(1 << first),1,1));
 		}else{
 			// In data: d: Raster Color
 			GX_SetTevColorIn (GX_TEVSTAGE0,GX_CC_ZERO,GX_CC_ZERO,GX_CC_ZERO,vertex_color_register);
@@ -1594,33 +4004,78 @@ void __setup_render_stages(int texen) {
 			GX_SetTevAlphaOp (GX_TEVSTAGE0,GX_TEV_ADD,GX_TB_ZERO,GX_CS_SCALE_1,GX_TRUE,GX_TEVPREV);
 			// Select COLOR0A0 for the rasterizer, Texture 0 for texture rasterizer and TEXCOORD0 slot for tex coordinates
 			GX_SetTevOrder   (GX_TEVSTAGE0,GX_TEXCOORDNULL,GX_TEXMAP_DISABLE,rasterized_color);
-			GX_SetNumTexGens (0);
+			__setup_texcoordgen(0);
 		}
 	}
 }
 
-void glDrawArrays( GLenum mode, GLint first, GLsizei count ) {
-
-	unsigned char gxmode = __draw_mode(mode);
-	if (gxmode == ~0) return;
+// Fog is computed by GX from the screen Z, so it needs the eye space near and
+// far planes of the projection (GX maps them to -w and 0). GL exp fog,
+// e^-(density*z), is GX exp fog, 1-2^-8x, with x = z/end, and likewise for exp2.
+void __setup_fog() {
+	GXColor color = {
+		_clampf_01(glparamstate.fog.color[0])*255.0f,
+		_clampf_01(glparamstate.fog.color[1])*255.0f,
+		_clampf_01(glparamstate.fog.color[2])*255.0f,
+		_clampf_01(glparamstate.fog.color[3])*255.0f  };
+
+	if (!glparamstate.fog.enabled || (glparamstate.fog.mode != GL_LINEAR && glparamstate.fog.density <= 0)) {
+		GX_SetFog(GX_FOG_NONE, 0, 1, 0.1f, 1, color);
+		GX_SetFogRangeAdj(GX_DISABLE, 0, NULL);
+		return;
+	}
 
-	int texen = glparamstate.texcoord_enabled & glparamstate.texture_enabled;
-	int color_provide = 0;
-	if (glparamstate.color_enabled) {	// Vertex colouring
-		if (glparamstate.lighting.enabled) color_provide = 2;  // Lighting requires two color channels
-		else color_provide = 1;
+	float a = glparamstate.projection_matrix[2][2];
+	float b = glparamstate.projection_matrix[2][3];
+	char ortho = glparamstate.projection_kind != MTX_PROJECTIVE;
+	float nearz = ortho ? (b + 1)/a : b/(a - 1);
+	float farz = b/a;
+
+	float start = 0, end;
+	unsigned char type;
+	switch (glparamstate.fog.mode) {
+	case GL_EXP:
+		end = 8*M_LN2/glparamstate.fog.density;
+		type = ortho ? GX_FOG_ORTHO_EXP : GX_FOG_PERSP_EXP;
+		break;
+	case GL_EXP2:
+		end = sqrtf(8*M_LN2)/glparamstate.fog.density;
+		type = ortho ? GX_FOG_ORTHO_EXP2 : GX_FOG_PERSP_EXP2;
+		break;
+	default:
+		start = glparamstate.fog.start;
+		end = glparamstate.fog.end;
+		type = ortho ? GX_FOG_ORTHO_LIN : GX_FOG_PERSP_LIN;
+		break;
 	}
+	GX_SetFog(type, start, end, nearz, farz, color);
 
-	// Create data pointers
-	float * ptr_pos = glparamstate.vertex_array;
-	float * ptr_texc = glparamstate.texcoord_array;
-	float * ptr_color = glparamstate.color_array;
-	float * ptr_normal = glparamstate.normal_array;
+	// GL_NICEST: use the distance to the eye instead of the depth, GX
+	// approximates it adjusting the fog along the screen X
+	if (glparamstate.fog.hint == GL_NICEST && !ortho) {
+		GX_InitFogAdjTable(&glparamstate.fog.adjtable, glparamstate.viewport[2], glparamstate.projection_matrix);
+		GX_SetFogRangeAdj(GX_ENABLE, glparamstate.viewport[0] + glparamstate.viewport[2]/2, &glparamstate.fog.adjtable);
+	}else{
+		GX_SetFogRangeAdj(GX_DISABLE, 0, NULL);
+	}
+}
 
-	ptr_pos += (glparamstate.vertex_stride*first);
-	ptr_texc += (glparamstate.texcoord_stride*first);
-	ptr_color += (glparamstate.color_stride*first);
-	ptr_normal += (glparamstate.normal_stride*first);
+// Transfers the vertex format, TEV, blending, Z and matrix state to GX. It's
+// shared by all the draw calls, so multi-draws only pay for it once.
+// Returns the mask of texture units which take their coordinates from the
+// vertex data, color_provide is set when vertex colors are sent.
+int __draw_setup(int * color_provide) {
+	// Anything pending was set up with the previous state
+	__flush_batch();
+	glparamstate.efb_clear.clean = 0;
+	_dynres_frame_start();
+
+	int texen = __enabled_texture_units();
+	int texc = __texcoord_units(texen);
+	int unit;
+
+	// Vertex colouring, lit or not the color goes to the first channel
+	*color_provide = __vertex_colors();
 
 	__setup_render_stages(texen);
 
@@ -1628,16 +4083,16 @@ void glDrawArrays( GLenum mode, GLint first, GLsizei count ) {
 	GX_ClearVtxDesc();
 	if (glparamstate.vertex_enabled)   GX_SetVtxDesc(GX_VA_POS, GX_DIRECT);
 	if (glparamstate.normal_enabled)   GX_SetVtxDesc(GX_VA_NRM, GX_DIRECT);
-	if (color_provide)                 GX_SetVtxDesc(GX_VA_CLR0, GX_DIRECT);
-	if (color_provide == 2)            GX_SetVtxDesc(GX_VA_CLR1, GX_DIRECT);
-	if (texen)                         GX_SetVtxDesc(GX_VA_TEX0, GX_DIRECT);
+	if (*color_provide)                GX_SetVtxDesc(GX_VA_CLR0, GX_DIRECT);
+	for (unit = 0; unit < MAX_TEXTURE_UNITS; unit++)
+		if (texc & (1 << unit))        GX_SetVtxDesc(GX_VA_TEX0 + unit, GX_DIRECT);
 
 	// Using floats
 	GX_SetVtxAttrFmt (GX_VTXFMT0, GX_VA_POS,  GX_POS_XYZ,  GX_F32,   0);
 	GX_SetVtxAttrFmt (GX_VTXFMT0, GX_VA_NRM,  GX_NRM_XYZ,  GX_F32,   0);
-	GX_SetVtxAttrFmt (GX_VTXFMT0, GX_VA_TEX0, GX_TEX_ST,   GX_F32,   0);
 	GX_SetVtxAttrFmt (GX_VTXFMT0, GX_VA_CLR0, GX_CLR_RGBA, GX_RGBA8, 0);
-	GX_SetVtxAttrFmt (GX_VTXFMT0, GX_VA_CLR1, GX_CLR_RGBA, GX_RGBA8, 0);
+	for (unit = 0; unit < MAX_TEXTURE_UNITS; unit++)
+		if (texc & (1 << unit))        GX_SetVtxAttrFmt (GX_VTXFMT0, GX_VA_TEX0 + unit, GX_TEX_ST, GX_F32, 0);
 
 	// Invalidate vertex data as may have been modified by the user
 	GX_InvVtxCache();
@@ -1646,6 +4101,18 @@ void glDrawArrays( GLenum mode, GLint first, GLsizei count ) {
 	if (glparamstate.dirty.bits.dirty_z)
 		GX_SetZMode(glparamstate.ztest, glparamstate.zfunc, glparamstate.zwrite & glparamstate.ztest);
 
+	// Z is tested before texturing (early Z) unless the alpha test can
+	// discard pixels, otherwise their Z would be written anyway
+	if (glparamstate.dirty.bits.dirty_alpha) {
+		if (glparamstate.alphatest) {
+			GX_SetAlphaCompare(glparamstate.alphafunc, glparamstate.alpharef, GX_AOP_AND, GX_ALWAYS, 0);
+			GX_SetZCompLoc(GX_FALSE);
+		}else{
+			GX_SetAlphaCompare(GX_ALWAYS, 0, GX_AOP_AND, GX_ALWAYS, 0);
+			GX_SetZCompLoc(GX_TRUE);
+		}
+	}
+
 	if (glparamstate.dirty.bits.dirty_blend) {
 		if (glparamstate.blendenabled)
 			GX_SetBlendMode(GX_BM_BLEND, glparamstate.srcblend, glparamstate.dstblend, GX_LO_CLEAR);
@@ -1653,119 +4120,858 @@ void glDrawArrays( GLenum mode, GLint first, GLsizei count ) {
 			GX_SetBlendMode(GX_BM_NONE,  glparamstate.srcblend, glparamstate.dstblend, GX_LO_CLEAR);
 	}
 
+	// Fog depends on the projection too
+	if (glparamstate.dirty.bits.dirty_fog || (glparamstate.fog.enabled && glparamstate.dirty.bits.dirty_matrices))
+		__setup_fog();
+
 	// Matrix stuff
 	if (glparamstate.dirty.bits.dirty_matrices) {
 		MODELVIEW_UPDATE
 		PROJECTION_UPDATE
 	}
-	if (glparamstate.dirty.bits.dirty_matrices | glparamstate.dirty.bits.dirty_lighting) {
-		NORMAL_UPDATE
+
+	// All the state has been transferred, no need to update it again next time
+	glparamstate.dirty.all = 0;
+
+	// Matrix palette: every vertex selects its slot (GX_VA_PNMTXIDX). The
+	// slots might be reused, so the modelview has to be looked up again next time
+	if (_palette_active()) {
+		int p;
+		for (p = 0; p < glparamstate.palette_size; p++)
+			glparamstate.palette_slot[p] = _load_pnmtx(glparamstate.palette_matrix[p],MTX_AFFINE);
+		GX_SetVtxDesc(GX_VA_PNMTXIDX, GX_DIRECT);
+		glparamstate.dirty.bits.dirty_matrices = 1;
 	}
+	return texc;
+}
+
+// Emits vertices first..first+count-1 of the client arrays
+void __draw_arrays_range(unsigned char gxmode, int first, int count, int texc, int color_provide) {
+	// Create data pointers
+	float * ptr_pos = glparamstate.vertex_array;
+	float * ptr_texc[MAX_TEXTURE_UNITS];
+	float * ptr_color = glparamstate.color_array;
+	float * ptr_normal = glparamstate.normal_array;
+
+	int unit;
+	ptr_pos += (glparamstate.vertex_stride*first);
+	for (unit = 0; unit < MAX_TEXTURE_UNITS; unit++)
+		ptr_texc[unit] = glparamstate.texunit[unit].texcoord_array + glparamstate.texunit[unit].texcoord_stride*first;
+	ptr_color += (glparamstate.color_stride*first);
+	ptr_normal += (glparamstate.normal_stride*first);
 
 	GX_Begin(gxmode,GX_VTXFMT0,count);
 
-	if (glparamstate.normal_enabled && !glparamstate.color_enabled) {
-		if (texen) {
-			__draw_arrays_pos_normal_texc(ptr_pos, ptr_texc, ptr_normal, count);
+	if (_palette_active()) {
+		int i;
+		for (i = 0; i < count; i++)
+			_emit_vertex(first + i, texc, color_provide);
+	}else if (glparamstate.normal_enabled && !glparamstate.color_enabled && (texc == 0 || texc == 1)) {
+		if (texc) {
+			__draw_arrays_pos_normal_texc(ptr_pos, ptr_texc[0], ptr_normal, count);
 		}else{
 			__draw_arrays_pos_normal(ptr_pos, ptr_normal, count);
 		}
 	}else{
-		__draw_arrays_general(ptr_pos, ptr_normal, ptr_texc, ptr_color, count, glparamstate.normal_enabled, color_provide, texen);
+		__draw_arrays_general(ptr_pos, ptr_normal, ptr_texc, ptr_color, count, glparamstate.normal_enabled, color_provide, texc);
 	}
 	GX_End();
+}
 
-	// All the state has been transferred, no need to update it again next time
-	glparamstate.dirty.all = 0;
+// Reads index i of a GL_UNSIGNED_BYTE, GL_UNSIGNED_SHORT or GL_UNSIGNED_INT array
+static inline unsigned int _read_index(const GLvoid * indices, GLenum type, int i) {
+	switch (type) {
+	case GL_UNSIGNED_BYTE: return ((const GLubyte*)indices)[i];
+	case GL_UNSIGNED_INT:  return ((const GLuint*)indices)[i];
+	default:               return ((const GLushort*)indices)[i];
+	}
 }
 
+// Emits vertex "index" of the client arrays
+static void _emit_vertex(unsigned int index, int texc, int color_provide) {
+	int unit;
+	float * ptr_pos = glparamstate.vertex_array + glparamstate.vertex_stride*index;
+	float * ptr_color = glparamstate.color_array + glparamstate.color_stride*index;
+	float * ptr_normal = glparamstate.normal_array + glparamstate.normal_stride*index;
+
+	if (_palette_active()) {
+		unsigned int p = _read_index(glparamstate.matrixindex_array, glparamstate.matrixindex_type,
+		                             glparamstate.matrixindex_stride*index);
+		if (p >= MAX_PALETTE_MATRICES) p = 0;
+		GX_MatrixIndex1x8(GX_PNMTX0 + glparamstate.palette_slot[p]*3);
+	}
 
-void glDrawElements( GLenum mode, GLsizei count, GLenum type, const GLvoid *indices ) {
+	GX_Position3f32(ptr_pos[0],ptr_pos[1],ptr_pos[2]);
 
-	unsigned char gxmode = __draw_mode(mode);
-	if (gxmode == ~0) return;
+	if (glparamstate.normal_enabled) {
+		GX_Normal3f32(ptr_normal[0],ptr_normal[1],ptr_normal[2]);
+	}
 
-	int texen = glparamstate.texcoord_enabled & glparamstate.texture_enabled;
-	int color_provide = 0;
-	if (glparamstate.color_enabled) {	// Vertex colouring
-		if (glparamstate.lighting.enabled) color_provide = 2;  // Lighting requires two color channels
-		else color_provide = 1;
+	// If the data stream doesn't contain any color data just
+	// send the current color (the last glColor* call)
+	if (color_provide) {
+		unsigned char arr[4] = {ptr_color[0]*255.0f,ptr_color[1]*255.0f,ptr_color[2]*255.0f,ptr_color[3]*255.0f};
+		GX_Color4u8(arr[0],arr[1],arr[2],arr[3]);
 	}
 
-	// Create data pointers
-	unsigned short * ind = (unsigned short*)indices;
+	for (unit = 0; unit < MAX_TEXTURE_UNITS; unit++) {
+		if (texc & (1 << unit)) {
+			float * ptr_texc = glparamstate.texunit[unit].texcoord_array + glparamstate.texunit[unit].texcoord_stride*index;
+			GX_TexCoord2f32(ptr_texc[0],ptr_texc[1]);
+		}
+	}
+}
 
-	__setup_render_stages(texen);
+// Emits the vertices referenced by count indices. Vertex data is sent
+// directly, so any index width works (no need to split 32 bit indices)
+void __draw_elements_range(unsigned char gxmode, int count, const GLvoid * indices, GLenum type, int texc, int color_provide) {
+	int i;
 
-	// Not using indices
-	GX_ClearVtxDesc();
-	if (glparamstate.vertex_enabled)   GX_SetVtxDesc(GX_VA_POS, GX_DIRECT);
-	if (glparamstate.normal_enabled)   GX_SetVtxDesc(GX_VA_NRM, GX_DIRECT);
-	if (color_provide)                 GX_SetVtxDesc(GX_VA_CLR0, GX_DIRECT);
-	if (color_provide == 2)            GX_SetVtxDesc(GX_VA_CLR1, GX_DIRECT);
-	if (texen)                         GX_SetVtxDesc(GX_VA_TEX0, GX_DIRECT);
+	GX_Begin(gxmode,GX_VTXFMT0,count);
+	for (i = 0; i < count; i++)
+		_emit_vertex(_read_index(indices, type, i), texc, color_provide);
+	GX_End();
+}
 
-	// Using floats
-	GX_SetVtxAttrFmt (GX_VTXFMT0, GX_VA_POS,  GX_POS_XYZ,  GX_F32,   0);
-	GX_SetVtxAttrFmt (GX_VTXFMT0, GX_VA_NRM,  GX_NRM_XYZ,  GX_F32,   0);
-	GX_SetVtxAttrFmt (GX_VTXFMT0, GX_VA_TEX0, GX_TEX_ST,   GX_F32,   0);
-	GX_SetVtxAttrFmt (GX_VTXFMT0, GX_VA_CLR0, GX_CLR_RGBA, GX_RGBA8, 0);
-	GX_SetVtxAttrFmt (GX_VTXFMT0, GX_VA_CLR1, GX_CLR_RGBA, GX_RGBA8, 0);
+// Emits the coalesced draws, it must be called before anything which changes
+// the GX state or depends on the rendering being submitted. With deferred
+// rendering the recorded commands are executed first.
+void __flush_batch() {
+	_defer_sync();
+	if (draw_batch.numverts == 0) return;
+
+	int i, unit;
+	float * ptr = draw_batch.data;
+	GX_Begin(draw_batch.gxmode,GX_VTXFMT0,draw_batch.numverts);
+	for (i = 0; i < draw_batch.numverts; i++) {
+		GX_Position3f32(ptr[0],ptr[1],ptr[2]);
+		ptr += 3;
+
+		if (draw_batch.normal_enabled) {
+			GX_Normal3f32(ptr[0],ptr[1],ptr[2]);
+			ptr += 3;
+		}
 
-	// Invalidate vertex data as may have been modified by the user
-	GX_InvVtxCache();
+		if (draw_batch.color_provide) {
+			unsigned char arr[4];
+			memcpy(arr,ptr,4);
+			GX_Color4u8(arr[0],arr[1],arr[2],arr[3]);
+			ptr++;
+		}
 
-	// Set up the OGL state to GX state
-	if (glparamstate.dirty.bits.dirty_z)
-		GX_SetZMode(glparamstate.ztest, glparamstate.zfunc, glparamstate.zwrite & glparamstate.ztest);
+		for (unit = 0; unit < MAX_TEXTURE_UNITS; unit++) {
+			if (draw_batch.texc & (1 << unit)) {
+				GX_TexCoord2f32(ptr[0],ptr[1]);
+				ptr += 2;
+			}
+		}
+	}
+	GX_End();
 
-	if (glparamstate.dirty.bits.dirty_blend) {
-		if (glparamstate.blendenabled)
-			GX_SetBlendMode(GX_BM_BLEND, glparamstate.srcblend, glparamstate.dstblend, GX_LO_CLEAR);
-		else
-			GX_SetBlendMode(GX_BM_NONE,  glparamstate.srcblend, glparamstate.dstblend, GX_LO_CLEAR);
+	draw_batch.numverts = 0;
+	draw_batch.batches++;
+}
+
+// Copies vertex "index" of the client arrays to the batch
+static float * _batch_vertex(float * dst, int index) {
+	int unit;
+	float * ptr_pos = glparamstate.vertex_array + glparamstate.vertex_stride*index;
+	*dst++ = ptr_pos[0]; *dst++ = ptr_pos[1]; *dst++ = ptr_pos[2];
+
+	if (draw_batch.normal_enabled) {
+		float * ptr_normal = glparamstate.normal_array + glparamstate.normal_stride*index;
+		*dst++ = ptr_normal[0]; *dst++ = ptr_normal[1]; *dst++ = ptr_normal[2];
 	}
 
-	if (glparamstate.dirty.bits.dirty_matrices) {
-		MODELVIEW_UPDATE
-		PROJECTION_UPDATE
+	if (draw_batch.color_provide) {
+		float * ptr_color = glparamstate.color_array + glparamstate.color_stride*index;
+		unsigned char arr[4] = {ptr_color[0]*255.0f,ptr_color[1]*255.0f,ptr_color[2]*255.0f,ptr_color[3]*255.0f};
+		memcpy(dst++,arr,4);
+	}
+
+	for (unit = 0; unit < MAX_TEXTURE_UNITS; unit++) {
+		if (draw_batch.texc & (1 << unit)) {
+			float * ptr_texc = glparamstate.texunit[unit].texcoord_array + glparamstate.texunit[unit].texcoord_stride*index;
+			*dst++ = ptr_texc[0]; *dst++ = ptr_texc[1];
+		}
+	}
+	return dst;
+}
+
+// Tries to add a draw (indices of the given type or first..first+count-1) to the current batch,
+// starting a new one if the state changed. Returns 0 if it can't be batched.
+static int _batch_draw(unsigned char gxmode, int first, int count, const GLvoid * ind, GLenum type) {
+	int i, unit;
+	if (gxmode != GX_QUADS && gxmode != GX_TRIANGLES && gxmode != GX_LINES && gxmode != GX_POINTS)
+		return 0;
+	if (_palette_active()) return 0;
+
+	int texen = __enabled_texture_units();
+	int texc = __texcoord_units(texen);
+	int color_provide = __vertex_colors();
+
+	int vertsize = 3 + (glparamstate.normal_enabled ? 3 : 0) + (color_provide ? 1 : 0);
+	for (unit = 0; unit < MAX_TEXTURE_UNITS; unit++)
+		if (texc & (1 << unit)) vertsize += 2;
+
+	int capacity = BATCH_BUFFER_SIZE/sizeof(float)/vertsize;
+	if (capacity > MAX_BATCH_VERTS) capacity = MAX_BATCH_VERTS;
+	if (count > capacity) return 0;
+
+	draw_batch.draws++;
+	if (draw_batch.numverts > 0 && glparamstate.dirty.all == 0 &&
+		draw_batch.gxmode == gxmode && draw_batch.texen == texen && draw_batch.texc == texc &&
+		draw_batch.color_provide == color_provide &&
+		draw_batch.vertex_enabled == glparamstate.vertex_enabled &&
+		draw_batch.normal_enabled == glparamstate.normal_enabled &&
+		memcmp(draw_batch.color,glparamstate.imm_mode.current_color,sizeof(float)*4) == 0 &&
+		draw_batch.numverts + count <= capacity) {
+		draw_batch.merged++;
+	}else{
+		// Flushes the previous batch and sets the state up for this one
+		int cp;
+		__draw_setup(&cp);
+		draw_batch.gxmode = gxmode;
+		draw_batch.texen = texen;
+		draw_batch.texc = texc;
+		draw_batch.color_provide = color_provide;
+		draw_batch.vertex_enabled = glparamstate.vertex_enabled;
+		draw_batch.normal_enabled = glparamstate.normal_enabled;
+		memcpy(draw_batch.color,glparamstate.imm_mode.current_color,sizeof(float)*4);
+	}
+
+	float * dst = draw_batch.data + draw_batch.numverts*vertsize;
+	for (i = 0; i < count; i++)
+		dst = _batch_vertex(dst, ind ? _read_index(ind, type, i) : first + i);
+	draw_batch.numverts += count;
+	return 1;
+}
+
+void glDrawArrays( GLenum mode, GLint first, GLsizei count ) {
+	if (_deferring() && _defer_draw(mode, first, count, NULL, 0)) return;
+
+	unsigned char gxmode = __draw_mode(mode);
+	if (gxmode == (unsigned char)~0 || _draw_culled()) return;
+	if (draw_batch.enabled && _batch_draw(gxmode, first, count, NULL, 0)) return;
+
+	int color_provide;
+	int texc = __draw_setup(&color_provide);
+	__draw_arrays_range(gxmode, first, count, texc, color_provide);
+}
+
+// 8 bit indices of small meshes are handed to GX (GX_INDEX8), which fetches
+// the vertex data itself: the index stream is half the size of the 16 bit
+// one and the vertex data isn't copied through the FIFO. GX only fetches the
+// float attributes (vertex colors are float arrays), indices must stay below
+// 255 (reserved) and strides must fit in a byte. [start,end] is the index
+// range, it's computed if unknown (start < 0). Returns 0 if not possible.
+// GX reads the arrays after the call returns, so this is only done when the
+// application opted in (ogxSetIndexedFetch) or for the deferred renderer's
+// own copies, which are fenced.
+static int _draw_elements_indexed8(unsigned char gxmode, int count, const GLubyte * ind, int start, int end, int texc, int color_provide) {
+	int i, unit;
+	if (!glparamstate.indexed_fetch || color_provide || !glparamstate.vertex_enabled || _palette_active()) return 0;
+	if (glparamstate.vertex_stride*sizeof(float) > 255) return 0;
+	if (glparamstate.normal_enabled && glparamstate.normal_stride*sizeof(float) > 255) return 0;
+	for (unit = 0; unit < MAX_TEXTURE_UNITS; unit++)
+		if ((texc & (1 << unit)) && glparamstate.texunit[unit].texcoord_stride*sizeof(float) > 255) return 0;
+
+	if (start < 0) {
+		start = 255; end = 0;
+		for (i = 0; i < count; i++) {
+			if (ind[i] < start) start = ind[i];
+			if (ind[i] > end) end = ind[i];
+		}
+	}
+	if (end >= 255 || start > end) return 0;
+
+	// Only the referenced part of the arrays has to reach main memory
+	int nverts = end - start + 1;
+	DCFlushRange(glparamstate.vertex_array + glparamstate.vertex_stride*start,
+	             (glparamstate.vertex_stride*(nverts-1) + 3)*sizeof(float));
+	GX_SetVtxDesc(GX_VA_POS, GX_INDEX8);
+	GX_SetArray(GX_VA_POS, glparamstate.vertex_array, glparamstate.vertex_stride*sizeof(float));
+	if (glparamstate.normal_enabled) {
+		DCFlushRange(glparamstate.normal_array + glparamstate.normal_stride*start,
+		             (glparamstate.normal_stride*(nverts-1) + 3)*sizeof(float));
+		GX_SetVtxDesc(GX_VA_NRM, GX_INDEX8);
+		GX_SetArray(GX_VA_NRM, glparamstate.normal_array, glparamstate.normal_stride*sizeof(float));
 	}
-	if (glparamstate.dirty.bits.dirty_matrices | glparamstate.dirty.bits.dirty_lighting) {
-		NORMAL_UPDATE
+	for (unit = 0; unit < MAX_TEXTURE_UNITS; unit++) {
+		if (texc & (1 << unit)) {
+			struct texunit * tu = &glparamstate.texunit[unit];
+			DCFlushRange(tu->texcoord_array + tu->texcoord_stride*start,
+			             (tu->texcoord_stride*(nverts-1) + 2)*sizeof(float));
+			GX_SetVtxDesc(GX_VA_TEX0 + unit, GX_INDEX8);
+			GX_SetArray(GX_VA_TEX0 + unit, tu->texcoord_array, tu->texcoord_stride*sizeof(float));
+		}
 	}
+	GX_InvVtxCache();
 
 	GX_Begin(gxmode,GX_VTXFMT0,count);
-	int i;
 	for (i = 0; i < count; i++) {
-		int index = *ind++;
-		float * ptr_pos = glparamstate.vertex_array + glparamstate.vertex_stride*index;
-		float * ptr_texc = glparamstate.texcoord_array + glparamstate.texcoord_stride*index;
-		float * ptr_color = glparamstate.color_array + glparamstate.color_stride*index;
-		float * ptr_normal = glparamstate.normal_array + glparamstate.normal_stride*index;
+		int index = ind[i];
+		GX_Position1x8(index);
+		if (glparamstate.normal_enabled)
+			GX_Normal1x8(index);
+		for (unit = 0; unit < MAX_TEXTURE_UNITS; unit++)
+			if (texc & (1 << unit))
+				GX_TexCoord1x8(index);
+	}
+	GX_End();
+	return 1;
+}
 
-		GX_Position3f32(ptr_pos[0],ptr_pos[1],ptr_pos[2]);
+static void _draw_elements(GLenum mode, GLsizei count, GLenum type, const GLvoid *indices, int start, int end) {
+	if (_deferring() && _defer_draw(mode, 0, count, indices, type)) return;
 
-		if (glparamstate.normal_enabled) {
-			GX_Normal3f32(ptr_normal[0],ptr_normal[1],ptr_normal[2]);
+	unsigned char gxmode = __draw_mode(mode);
+	if (gxmode == (unsigned char)~0 || _draw_culled()) return;
+	if (type != GL_UNSIGNED_BYTE && type != GL_UNSIGNED_SHORT && type != GL_UNSIGNED_INT) return;
+	if (draw_batch.enabled && _batch_draw(gxmode, 0, count, indices, type)) return;
+
+	int color_provide;
+	int texc = __draw_setup(&color_provide);
+	if (type == GL_UNSIGNED_BYTE && _draw_elements_indexed8(gxmode, count, indices, start, end, texc, color_provide))
+		return;
+	__draw_elements_range(gxmode, count, indices, type, texc, color_provide);
+}
+
+void glDrawElements( GLenum mode, GLsizei count, GLenum type, const GLvoid *indices ) {
+	_draw_elements(mode, count, type, indices, -1, -1);
+}
+
+// Indices are known to be in [start,end], so only that part of the arrays
+// is flushed when GX fetches the vertex data (8 bit indices)
+void glDrawRangeElements( GLenum mode, GLuint start, GLuint end, GLsizei count, GLenum type, const GLvoid *indices ) {
+	if (end < start || count <= 0) return;
+	_draw_elements(mode, count, type, indices, start, end);
+}
+
+// The state is set up once, every range is a GX_Begin/GX_End of its own
+void glMultiDrawArrays( GLenum mode, GLint *first, GLsizei *count, GLsizei primcount ) {
+
+	unsigned char gxmode = __draw_mode(mode);
+	if (gxmode == (unsigned char)~0 || primcount <= 0 || _draw_culled()) return;
+
+	int i, color_provide;
+	int texc = __draw_setup(&color_provide);
+	for (i = 0; i < primcount; i++) {
+		if (count[i] > 0)
+			__draw_arrays_range(gxmode, first[i], count[i], texc, color_provide);
+	}
+}
+
+void glMultiDrawElements( GLenum mode, const GLsizei *count, GLenum type, const GLvoid* *indices, GLsizei primcount ) {
+
+	unsigned char gxmode = __draw_mode(mode);
+	if (gxmode == (unsigned char)~0 || primcount <= 0 || _draw_culled()) return;
+	if (type != GL_UNSIGNED_BYTE && type != GL_UNSIGNED_SHORT && type != GL_UNSIGNED_INT) return;
+
+	int i, color_provide;
+	int texc = __draw_setup(&color_provide);
+	for (i = 0; i < primcount; i++) {
+		if (count[i] > 0)
+			__draw_elements_range(gxmode, count[i], indices[i], type, texc, color_provide);
+	}
+}
+
+// Whether any of the texture units texgen is set up for depends on the
+// modelview (eye linear and sphere mapping)
+static int _texgen_eyespace() {
+	int unit, i;
+	for (unit = 0; unit < MAX_TEXTURE_UNITS; unit++) {
+		if (!(glparamstate.texgen_texen & (1 << unit))) continue;
+		struct texunit * tu = &glparamstate.texunit[unit];
+		for (i = 0; i < 4; i++)
+			if ((tu->texgen_enabled & (1 << i)) &&
+			    (tu->texgen_mode[i] == GL_EYE_LINEAR || tu->texgen_mode[i] == GL_SPHERE_MAP))
+				return 1;
+	}
+	return 0;
+}
+
+// Whether the bounding box, placed by the instance matrix mi, is not visible.
+// The box is transformed into modelview object space and bounded again.
+static int _instance_culled(Mtx44 mi) {
+	float bmin[3], bmax[3];
+	int i, j;
+	if (!glparamstate.autocull || !glparamstate.bbox_set) return 0;
+	for (i = 0; i < 3; i++) {
+		bmin[i] = bmax[i] = mi[i][3];
+		for (j = 0; j < 3; j++) {
+			float a = mi[i][j]*glparamstate.bbox_min[j];
+			float b = mi[i][j]*glparamstate.bbox_max[j];
+			bmin[i] += a < b ? a : b;
+			bmax[i] += a < b ? b : a;
 		}
+	}
+	return !ogxIsBoxVisible(bmin,bmax);
+}
 
-		// If the data stream doesn't contain any color data just
-		// send the current color (the last glColor* call)
-		if (color_provide) {
-			unsigned char arr[4] = {ptr_color[0]*255.0f,ptr_color[1]*255.0f,ptr_color[2]*255.0f,ptr_color[3]*255.0f};
-			GX_Color4u8(arr[0],arr[1],arr[2],arr[3]);
-			if (color_provide == 2)
-				GX_Color4u8(arr[0],arr[1],arr[2],arr[3]);
+// Sets up instance i (matrices are column major, 16 floats each, affine):
+// the current matrix becomes modelview * matrices[i] and, when texgen uses
+// the eye space, the texture matrices are built for it too.
+// Returns 0 if the instance is culled.
+static int _instance_setup(const GLfloat * matrices, int i, int eyespace) {
+	Mtx44 mi, mv;
+	_mtx44_transpose(&matrices[i*16],mi);
+	if (_instance_culled(mi)) return 0;
+	_mtx44_concat(glparamstate.modelview_matrix,mi,mv);
+	GX_SetCurrentMtx(GX_PNMTX0 + _load_pnmtx(mv,MTX_AFFINE)*3);
+	if (eyespace) {
+		Mtx44 saved;
+		memcpy(saved,glparamstate.modelview_matrix,sizeof(saved));
+		memcpy(glparamstate.modelview_matrix,mv,sizeof(mv));
+		glparamstate.dirty.bits.dirty_texmtx = 1;
+		__setup_texcoordgen(glparamstate.texgen_texen);
+		memcpy(glparamstate.modelview_matrix,saved,sizeof(saved));
+	}
+	return 1;
+}
+
+// The current matrix (and eye space texgen) no longer match the modelview
+static void _instance_done(int eyespace) {
+	glparamstate.dirty.bits.dirty_matrices = 1;
+	if (eyespace) glparamstate.dirty.bits.dirty_texmtx = 1;
+}
+
+// Draws instancecount copies of the same geometry paying for the setup once.
+// Without matrices all the instances use the current modelview. With auto
+// culling the bounding box is tested for every instance.
+void ogxDrawArraysInstanced(GLenum mode, GLint first, GLsizei count, GLsizei instancecount, const GLfloat * matrices) {
+
+	unsigned char gxmode = __draw_mode(mode);
+	if (gxmode == (unsigned char)~0 || count <= 0 || instancecount <= 0) return;
+	if (!matrices && _draw_culled()) return;
+
+	int i, color_provide;
+	int texc = __draw_setup(&color_provide);
+	int eyespace = matrices && _texgen_eyespace();
+	for (i = 0; i < instancecount; i++) {
+		if (matrices && !_instance_setup(matrices, i, eyespace)) continue;
+		__draw_arrays_range(gxmode, first, count, texc, color_provide);
+	}
+	if (matrices) _instance_done(eyespace);
+}
+
+void ogxDrawElementsInstanced(GLenum mode, GLsizei count, GLenum type, const GLvoid * indices,
+                              GLsizei instancecount, const GLfloat * matrices) {
+
+	unsigned char gxmode = __draw_mode(mode);
+	if (gxmode == (unsigned char)~0 || count <= 0 || instancecount <= 0) return;
+	if (type != GL_UNSIGNED_BYTE && type != GL_UNSIGNED_SHORT && type != GL_UNSIGNED_INT) return;
+	if (!matrices && _draw_culled()) return;
+
+	int i, color_provide;
+	int texc = __draw_setup(&color_provide);
+	int eyespace = matrices && _texgen_eyespace();
+	for (i = 0; i < instancecount; i++) {
+		if (matrices && !_instance_setup(matrices, i, eyespace)) continue;
+		__draw_elements_range(gxmode, count, indices, type, texc, color_provide);
+	}
+	if (matrices) _instance_done(eyespace);
+}
+
+// There's no gl_InstanceID in the fixed pipeline, the instances are identical
+void glDrawArraysInstanced(GLenum mode, GLint first, GLsizei count, GLsizei instancecount) {
+	ogxDrawArraysInstanced(mode, first, count, instancecount, NULL);
+}
+void glDrawElementsInstanced(GLenum mode, GLsizei count, GLenum type, const GLvoid * indices, GLsizei instancecount) {
+	ogxDrawElementsInstanced(mode, count, type, indices, instancecount, NULL);
+}
+void glDrawArraysInstancedEXT(GLenum mode, GLint first, GLsizei count, GLsizei instancecount) {
+	ogxDrawArraysInstanced(mode, first, count, instancecount, NULL);
+}
+void glDrawElementsInstancedEXT(GLenum mode, GLsizei count, GLenum type, const GLvoid * indices, GLsizei instancecount) {
+	ogxDrawElementsInstanced(mode, count, type, indices, instancecount, NULL);
+}
+
+/*
+
+  Deferred rendering. GL calls are recorded into a command ring and a render
+  thread translates them into GX commands, so the application thread keeps
+  going while the render thread is stalled by a full GX FIFO or waits for a
+  retrace. The render thread has a higher priority than the main thread and
+  is woken up when a good chunk of commands is queued, at glFlush and at the
+  buffer swap.
+
+  Calls which are not recorded (queries, texture and framebuffer management,
+  ...) wait for the render thread to run out of commands and then execute
+  right away, on the calling thread. Immediate mode is recorded as is, the
+  render thread owns the vertices between glBegin and glEnd. Draws copy the
+  vertex data of the client arrays, so they can be modified after the call.
+  The recorder keeps its own copy of the client array state for that.
+
+*/
+
+static int _deferring() {
+	return defer.enabled && LWP_GetSelf() != defer.thread;
+}
+
+// Wakes the render thread up
+static void _defer_kick() {
+	LWP_MutexLock(defer.mutex);
+	defer.kicked = defer.wr;
+	if (defer.waiting) LWP_CondSignal(defer.work);
+	LWP_MutexUnlock(defer.mutex);
+}
+
+// Waits for the render thread to execute all the recorded commands, the
+// caller can then use the GL state (and GX) directly
+static void _defer_sync() {
+	if (!_deferring()) return;
+
+	_defer_kick();
+	LWP_MutexLock(defer.mutex);
+	while (defer.rd != defer.wr)
+		LWP_CondWait(defer.done, defer.mutex);
+	LWP_MutexUnlock(defer.mutex);
+
+	// The direct calls might change the client arrays
+	defer.stale = 1;
+}
+
+static void _read_client_arrays(struct _defer_client * c) {
+	int unit;
+	c->vertex_array = glparamstate.vertex_array;
+	c->vertex_stride = glparamstate.vertex_stride;
+	c->vertex_enabled = glparamstate.vertex_enabled;
+	c->normal_array = glparamstate.normal_array;
+	c->normal_stride = glparamstate.normal_stride;
+	c->normal_enabled = glparamstate.normal_enabled;
+	c->color_array = glparamstate.color_array;
+	c->color_stride = glparamstate.color_stride;
+	c->color_enabled = glparamstate.color_enabled;
+	c->matrixindex_enabled = glparamstate.matrixindex_enabled;
+	for (unit = 0; unit < MAX_TEXTURE_UNITS; unit++) {
+		c->texcoord_array[unit] = glparamstate.texunit[unit].texcoord_array;
+		c->texcoord_stride[unit] = glparamstate.texunit[unit].texcoord_stride;
+		c->texcoord_enabled[unit] = glparamstate.texunit[unit].texcoord_enabled;
+	}
+	c->client_active_texture = glparamstate.client_active_texture;
+}
+
+static void _write_client_arrays(const struct _defer_client * c) {
+	int unit;
+	glparamstate.vertex_array = c->vertex_array;
+	glparamstate.vertex_stride = c->vertex_stride;
+	glparamstate.vertex_enabled = c->vertex_enabled;
+	glparamstate.normal_array = c->normal_array;
+	glparamstate.normal_stride = c->normal_stride;
+	glparamstate.normal_enabled = c->normal_enabled;
+	glparamstate.color_array = c->color_array;
+	glparamstate.color_stride = c->color_stride;
+	glparamstate.color_enabled = c->color_enabled;
+	glparamstate.matrixindex_enabled = c->matrixindex_enabled;
+	for (unit = 0; unit < MAX_TEXTURE_UNITS; unit++) {
+		glparamstate.texunit[unit].texcoord_array = c->texcoord_array[unit];
+		glparamstate.texunit[unit].texcoord_stride = c->texcoord_stride[unit];
+		glparamstate.texunit[unit].texcoord_enabled = c->texcoord_enabled[unit];
+	}
+	glparamstate.client_active_texture = c->client_active_texture;
+}
+
+// Marks the executed commands as reusable, but keeps the ones after a draw
+// which GX fetches from the ring until the GPU is past it (mutex held)
+static void _defer_release() {
+	if (defer.fenced && _draw_sync_passed(defer.fence))
+		defer.fenced = 0;
+	if (!defer.fenced)
+		defer.freed = defer.rd;
+}
+
+// Reserves a command with n argument words. Returns NULL (after a sync, so
+// the call can be executed directly) if it's too big for the ring.
+static glcmdword_ * _defer_begin(int op, int n) {
+	unsigned int size = n + 1;
+	if (size > DEFER_RING_WORDS/2) {
+		_defer_sync();
+		return NULL;
+	}
+	if (defer.stale) {
+		_read_client_arrays(&defer.client);
+		defer.stale = 0;
+	}
+
+	// Commands are contiguous, the end of the ring is skipped if needed
+	unsigned int pos = defer.wr % DEFER_RING_WORDS;
+	unsigned int pad = (pos + size > DEFER_RING_WORDS) ? DEFER_RING_WORDS - pos : 0;
+	if (defer.wr + pad + size - defer.freed > DEFER_RING_WORDS) {
+		_defer_kick();
+		LWP_MutexLock(defer.mutex);
+		for (;;) {
+			_defer_release();
+			if (defer.wr + pad + size - defer.freed <= DEFER_RING_WORDS) break;
+			if (defer.rd == defer.wr) {
+				// The render thread is idle, only the GPU is left
+				LWP_MutexUnlock(defer.mutex);
+				GX_DrawDone();
+				LWP_MutexLock(defer.mutex);
+			}else{
+				LWP_CondWait(defer.done, defer.mutex);
+			}
 		}
+		LWP_MutexUnlock(defer.mutex);
+	}
+	if (pad) {
+		defer.ring[pos].hdr.op = DEFER_NOP;
+		defer.ring[pos].hdr.size = pad;
+		pos = 0;
+	}
+	defer.ring[pos].hdr.op = op;
+	defer.ring[pos].hdr.size = size;
+	defer.pending = pad + size;
+	return &defer.ring[pos+1];
+}
 
-		if (texen) {
-			GX_TexCoord2f32(ptr_texc[0],ptr_texc[1]);
+// Makes the command (and the padding before it) visible to the render thread
+static void _defer_end(glcmdword_ * args) {
+	LWP_MutexLock(defer.mutex);
+	defer.wr += defer.pending;
+	int kick = defer.wr - defer.kicked > DEFER_RING_WORDS/4;
+	LWP_MutexUnlock(defer.mutex);
+	if (kick) _defer_kick();
+}
+
+// Floats per vertex of a recorded draw: position, normal, color and the
+// coordinates of every enabled texture coordinate array
+static int _defer_vertex_size(const struct _defer_client * c) {
+	int unit, size = 3;
+	if (c->normal_enabled) size += 3;
+	if (c->color_enabled) size += 4;
+	for (unit = 0; unit < MAX_TEXTURE_UNITS; unit++)
+		if (c->texcoord_enabled[unit]) size += 2;
+	return size;
+}
+
+// Records a draw (indices of the given type or first..first+count-1),
+// returns 0 if it has to be executed directly. The referenced range of the
+// client arrays is copied interleaved, followed by the indices rebased to
+// the range in the smallest type they fit (so small meshes can still be
+// fetched by GX with 8 bit indices).
+static int _defer_draw(GLenum mode, int first, int count, const GLvoid * indices, GLenum type) {
+	int i, unit;
+	if (defer.stale) {
+		_read_client_arrays(&defer.client);
+		defer.stale = 0;
+	}
+	// Matrix indices are not copied
+	if (defer.client.matrixindex_enabled || !defer.client.vertex_enabled || count <= 0 ||
+	    (indices && type != GL_UNSIGNED_BYTE && type != GL_UNSIGNED_SHORT && type != GL_UNSIGNED_INT)) {
+		_defer_sync();
+		return 0;
+	}
+
+	int start = first, end = first + count - 1;
+	GLenum itype = 0;
+	int isize = 0;
+	if (indices) {
+		start = _read_index(indices, type, 0); end = start;
+		for (i = 1; i < count; i++) {
+			int index = _read_index(indices, type, i);
+			if (index < start) start = index;
+			if (index > end) end = index;
 		}
+		if (end - start < 256) { itype = GL_UNSIGNED_BYTE; isize = 1; }
+		else if (end - start < 65536) { itype = GL_UNSIGNED_SHORT; isize = 2; }
+		else { itype = GL_UNSIGNED_INT; isize = 4; }
 	}
-	GX_End();
+	int numverts = end - start + 1;
+
+	int vertsize = _defer_vertex_size(&defer.client);
+	int words = 5 + (numverts*vertsize*sizeof(float) + count*isize + sizeof(glcmdword_)-1)/sizeof(glcmdword_);
+	glcmdword_ * c = _defer_begin(DEFER_DRAW, words);
+	if (!c) return 0;
+
+	c[0].i = mode;
+	c[1].i = count;
+	c[2].i = vertsize;
+	c[3].i = numverts;
+	c[4].i = itype;
+	float * dst = &c[5].f;
+	for (i = start; i <= end; i++) {
+		float * src = defer.client.vertex_array + defer.client.vertex_stride*i;
+		*dst++ = src[0]; *dst++ = src[1]; *dst++ = src[2];
+		if (defer.client.normal_enabled) {
+			src = defer.client.normal_array + defer.client.normal_stride*i;
+			*dst++ = src[0]; *dst++ = src[1]; *dst++ = src[2];
+		}
+		if (defer.client.color_enabled) {
+			src = defer.client.color_array + defer.client.color_stride*i;
+			*dst++ = src[0]; *dst++ = src[1]; *dst++ = src[2]; *dst++ = src[3];
+		}
+		for (unit = 0; unit < MAX_TEXTURE_UNITS; unit++) {
+			if (defer.client.texcoord_enabled[unit]) {
+				src = defer.client.texcoord_array[unit] + defer.client.texcoord_stride[unit]*i;
+				*dst++ = src[0]; *dst++ = src[1];
+			}
+		}
+	}
+	for (i = 0; i < count && indices; i++) {
+		int index = _read_index(indices, type, i) - start;
+		switch (itype) {
+		case GL_UNSIGNED_BYTE:  ((GLubyte*)dst)[i] = index; break;
+		case GL_UNSIGNED_SHORT: ((GLushort*)dst)[i] = index; break;
+		default:                ((GLuint*)dst)[i] = index; break;
+		}
+	}
+	_defer_end(c);
+	return 1;
+}
 
-	// All the state has been transferred, no need to update it again next time
-	glparamstate.dirty.all = 0;
+// Draws the copied vertices, pointing the client arrays to them meanwhile.
+// Returns 1 if GX may fetch the vertices from the ring (8 bit indices).
+static int _defer_replay_draw(glcmdword_ * a) {
+	int unit;
+	int count = a[1].i, vertsize = a[2].i, numverts = a[3].i;
+	GLenum itype = a[4].i;
+	float * data = &a[5].f;
+	const GLvoid * indices = data + numverts*vertsize;
+
+	struct _defer_client saved;
+	_read_client_arrays(&saved);
+	// The recorder shadows the client state, the layouts must agree
+	if (_defer_vertex_size(&saved) != vertsize)
+		return 0;
+
+	glparamstate.vertex_array = data;
+	glparamstate.vertex_stride = vertsize;
+	data += 3;
+	if (glparamstate.normal_enabled) {
+		glparamstate.normal_array = data;
+		glparamstate.normal_stride = vertsize;
+		data += 3;
+	}
+	if (glparamstate.color_enabled) {
+		glparamstate.color_array = data;
+		glparamstate.color_stride = vertsize;
+		data += 4;
+	}
+	for (unit = 0; unit < MAX_TEXTURE_UNITS; unit++) {
+		if (glparamstate.texunit[unit].texcoord_enabled) {
+			glparamstate.texunit[unit].texcoord_array = data;
+			glparamstate.texunit[unit].texcoord_stride = vertsize;
+			data += 2;
+		}
+	}
+
+	if (itype) {
+		// The ring is fenced, so GX may fetch the copied vertices
+		char indexed_fetch = glparamstate.indexed_fetch;
+		glparamstate.indexed_fetch = 1;
+		_draw_elements(a[0].i, count, itype, indices, 0, numverts-1);
+		glparamstate.indexed_fetch = indexed_fetch;
+	}else
+		glDrawArrays(a[0].i, 0, count);
+
+	_write_client_arrays(&saved);
+	return itype == GL_UNSIGNED_BYTE;
+}
+
+// Returns 1 if GX may still fetch data from the command
+static int _defer_execute(glcmdword_ * cmd) {
+	glcmdword_ * a = cmd + 1;
+	switch (cmd->hdr.op) {
+	case DEFER_NOP: break;
+	case DEFER_ENABLE:         glEnable(a[0].i); break;
+	case DEFER_DISABLE:        glDisable(a[0].i); break;
+	case DEFER_BIND_TEXTURE:   glBindTexture(a[0].i, a[1].i); break;
+	case DEFER_ACTIVE_TEXTURE: glActiveTexture(a[0].i); break;
+	case DEFER_MATRIX_MODE:    glMatrixMode(a[0].i); break;
+	case DEFER_LOAD_IDENTITY:  glLoadIdentity(); break;
+	case DEFER_PUSH_MATRIX:    glPushMatrix(); break;
+	case DEFER_POP_MATRIX:     glPopMatrix(); break;
+	case DEFER_LOAD_MATRIX:    glLoadMatrixf(&a[0].f); break;
+	case DEFER_MULT_MATRIX:    glMultMatrixf(&a[0].f); break;
+	case DEFER_TRANSLATE:      glTranslatef(a[0].f, a[1].f, a[2].f); break;
+	case DEFER_ROTATE:         glRotatef(a[0].f, a[1].f, a[2].f, a[3].f); break;
+	case DEFER_SCALE:          glScalef(a[0].f, a[1].f, a[2].f); break;
+	case DEFER_COLOR:          glColor4f(a[0].f, a[1].f, a[2].f, a[3].f); break;
+	case DEFER_NORMAL:         glNormal3f(a[0].f, a[1].f, a[2].f); break;
+	case DEFER_TEXCOORD:       glTexCoord2f(a[0].f, a[1].f); break;
+	case DEFER_BEGIN:          glBegin(a[0].i); break;
+	case DEFER_VERTEX:         glVertex3f(a[0].f, a[1].f, a[2].f); break;
+	case DEFER_LIGHT:          glLightfv(a[0].i, a[1].i, &a[2].f); break;
+	case DEFER_MATERIAL:       glMaterialfv(a[0].i, a[1].i, &a[2].f); break;
+	case DEFER_BLEND_FUNC:     glBlendFunc(a[0].i, a[1].i); break;
+	case DEFER_DEPTH_FUNC:     glDepthFunc(a[0].i); break;
+	case DEFER_DEPTH_MASK:     glDepthMask(a[0].i); break;
+	case DEFER_CLEAR_COLOR:    glClearColor(a[0].f, a[1].f, a[2].f, a[3].f); break;
+	case DEFER_CLEAR:          glClear(a[0].i); break;
+	case DEFER_VIEWPORT:       glViewport(a[0].i, a[1].i, a[2].i, a[3].i); break;
+	case DEFER_ENABLE_CLIENT:  glEnableClientState(a[0].i); break;
+	case DEFER_DISABLE_CLIENT: glDisableClientState(a[0].i); break;
+	case DEFER_CLIENT_ACTIVE_TEXTURE: glClientActiveTexture(a[0].i); break;
+	case DEFER_VERTEX_POINTER:   glVertexPointer(a[0].i, a[1].i, a[2].i, a[3].p); break;
+	case DEFER_NORMAL_POINTER:   glNormalPointer(a[0].i, a[1].i, a[2].p); break;
+	case DEFER_TEXCOORD_POINTER: glTexCoordPointer(a[0].i, a[1].i, a[2].i, a[3].p); break;
+	case DEFER_DRAW:           return _defer_replay_draw(a);
+	case DEFER_FLUSH:          glFlush(); break;
+	case DEFER_SWAP:           ogxSwapBuffers(); break;
+	case DEFER_END:            glEnd(); break;
+	}
+	return 0;
+}
+
+static void * _defer_worker(void * arg) {
+	for (;;) {
+		LWP_MutexLock(defer.mutex);
+		while (defer.rd == defer.wr && !defer.quit) {
+			defer.waiting = 1;
+			LWP_CondWait(defer.work, defer.mutex);
+			defer.waiting = 0;
+		}
+		if (defer.rd == defer.wr) {
+			LWP_MutexUnlock(defer.mutex);
+			break;
+		}
+		glcmdword_ * cmd = &defer.ring[defer.rd % DEFER_RING_WORDS];
+		LWP_MutexUnlock(defer.mutex);
+
+		int fetch = _defer_execute(cmd);
+		unsigned short token = fetch ? _issue_draw_sync() : 0;
+
+		LWP_MutexLock(defer.mutex);
+		if (fetch) {
+			if (!defer.fenced) defer.freed = defer.rd;
+			defer.fence = token;
+			defer.fenced = 1;
+		}
+		defer.rd += cmd->hdr.size;
+		_defer_release();
+		LWP_CondBroadcast(defer.done);
+		LWP_MutexUnlock(defer.mutex);
+	}
+	return NULL;
+}
+
+void ogxSetDeferredRendering(GLboolean enable) {
+	if (enable && !defer.enabled) {
+		__flush_batch();
+		LWP_MutexInit(&defer.mutex, GX_FALSE);
+		LWP_CondInit(&defer.work);
+		LWP_CondInit(&defer.done);
+		defer.rd = defer.wr = defer.kicked = defer.freed = 0;
+		defer.fenced = 0;
+		defer.quit = 0;
+		defer.stale = 1;
+		LWP_CreateThread(&defer.thread, _defer_worker, 0, 0, DEFER_STACK, DEFER_PRIO);
+		defer.enabled = 1;
+	}else if (!enable && defer.enabled && _deferring()) {
+		_defer_sync();
+		LWP_MutexLock(defer.mutex);
+		defer.quit = 1;
+		LWP_CondSignal(defer.work);
+		LWP_MutexUnlock(defer.mutex);
+		LWP_JoinThread(defer.thread, NULL);
+		if (defer.fenced) GX_DrawDone();   // The ring must not be in use if enabled again
+		defer.enabled = 0;
+		defer.thread = LWP_THREAD_NULL;
+		LWP_CondDestroy(defer.work);
+		LWP_CondDestroy(defer.done);
+		LWP_MutexDestroy(defer.mutex);
+	}
 }
 
 void __draw_arrays_pos_normal_texc (float * ptr_pos, float * ptr_texc, float * ptr_normal, int count) {
@@ -1778,7 +4984,7 @@ void __draw_arrays_pos_normal_texc (float * ptr_pos, float * ptr_texc, float * p
 		ptr_normal += glparamstate.normal_stride;
 
 		GX_TexCoord2f32(ptr_texc[0],ptr_texc[1]);
-		ptr_texc += glparamstate.texcoord_stride;
+		ptr_texc += glparamstate.texunit[0].texcoord_stride;
 	}
 }
 void __draw_arrays_pos_normal (float * ptr_pos, float * ptr_normal, int count) {
@@ -1791,10 +4997,10 @@ void __draw_arrays_pos_normal (float * ptr_pos, float * ptr_normal, int count) {
 		ptr_normal += glparamstate.normal_stride;
 	}
 }
-void __draw_arrays_general (float * ptr_pos, float * ptr_normal, float * ptr_texc, float * ptr_color, int count,
+void __draw_arrays_general (float * ptr_pos, float * ptr_normal, float ** ptr_texc, float * ptr_color, int count,
 							int ne, int color_provide, int texen) {
 
-	int i;
+	int i, unit;
 	for (i = 0; i < count; i++) {
 		GX_Position3f32(ptr_pos[0],ptr_pos[1],ptr_pos[2]);
 		ptr_pos += glparamstate.vertex_stride;
@@ -1810,13 +5016,13 @@ void __draw_arrays_general (float * ptr_pos, float * ptr_normal, float * ptr_tex
 			unsigned char arr[4] = {ptr_color[0]*255.0f,ptr_color[1]*255.0f,ptr_color[2]*255.0f,ptr_color[3]*255.0f};
 			GX_Color4u8(arr[0],arr[1],arr[2],arr[3]);
 			ptr_color += glparamstate.color_stride;
-			if (color_provide == 2)
-				GX_Color4u8(arr[0],arr[1],arr[2],arr[3]);
 		}
 
-		if (texen) {
-			GX_TexCoord2f32(ptr_texc[0],ptr_texc[1]);
-			ptr_texc += glparamstate.texcoord_stride;
+		for (unit = 0; unit < MAX_TEXTURE_UNITS; unit++) {
+			if (texen & (1 << unit)) {
+				GX_TexCoord2f32(ptr_texc[unit][0],ptr_texc[unit][1]);
+				ptr_texc[unit] += glparamstate.texunit[unit].texcoord_stride;
+			}
 		}
 	}
 }
@@ -1942,7 +5148,13 @@ void glBlendEquation(GLenum mode) {}
 void glClearStencil( GLint s ) {}
 void glStencilMask( GLuint mask ) {}  // Should use Alpha testing to achieve similar results
 void glShadeModel( GLenum mode ) {}   // In theory we don't have GX equivalent?
-void glHint( GLenum target, GLenum mode ) {}
+void glHint( GLenum target, GLenum mode ) {
+	_defer_sync();
+	if (target == GL_FOG_HINT) {
+		glparamstate.fog.hint = mode;
+		glparamstate.dirty.bits.dirty_fog = 1;
+	}
+}
 
 unsigned char _gcgl_texwrap_conv(GLint param) {
 	switch (param) {
@@ -1957,6 +5169,7 @@ unsigned char _gcgl_texwrap_conv(GLint param) {
 }
 
 void glTexParameteri( GLenum target, GLenum pname, GLint param ) {
+	__flush_batch();
 	if (target != GL_TEXTURE_2D) return;
 
 	gltexture_ * currtex = &texture_list[glparamstate.glcurtex];
@@ -1965,37 +5178,75 @@ void glTexParameteri( GLenum target, GLenum pname, GLint param ) {
 	case GL_TEXTURE_WRAP_S:
 		currtex->wraps = _gcgl_texwrap_conv(param);
 		GX_InitTexObjWrapMode(&currtex->texobj,currtex->wraps,currtex->wrapt);
+		_reload_texture_units(currtex);
 		break;
 	case GL_TEXTURE_WRAP_T:
 		texture_list[glparamstate.glcurtex].wrapt = _gcgl_texwrap_conv(param);
 		GX_InitTexObjWrapMode(&currtex->texobj,currtex->wraps,currtex->wrapt);
+		_reload_texture_units(currtex);
+		break;
+	case GL_GENERATE_MIPMAP:
+		currtex->genmipmap = (param != GL_FALSE);
 		break;
 	};
 }
 
 // XXX: Need to finish glGets, important!!!
 void glGetIntegerv(GLenum pname, GLint * params) {
+	_defer_sync();
 	switch (pname) {
 	case GL_MAX_TEXTURE_SIZE:
 		*params = 1024;
 		return;
+	case GL_MAX_TEXTURE_UNITS:
+		*params = MAX_TEXTURE_UNITS;
+		return;
 	case GL_MODELVIEW_STACK_DEPTH:
 		*params = MAX_MODV_STACK;
 		return;
 	case GL_PROJECTION_STACK_DEPTH:
 		*params = MAX_PROJ_STACK;
 		return;
+	case GL_TEXTURE_STACK_DEPTH:
+		*params = MAX_TEX_STACK;
+		return;
+	case GL_MAX_PALETTE_MATRICES_ARB:
+		*params = MAX_PALETTE_MATRICES;
+		return;
+	case GL_MAX_VERTEX_UNITS_ARB:
+		*params = 1;
+		return;
+	case GL_MAX_LIGHTS:
+		*params = MAX_LIGHTS;
+		return;
+	case GL_RED_BITS: case GL_GREEN_BITS: case GL_BLUE_BITS:
+		switch (glparamstate.pixelfmt) {
+		case GX_PF_RGBA6_Z24:  *params = 6; break;
+		case GX_PF_RGB565_Z16: *params = pname == GL_GREEN_BITS ? 6 : 5; break;
+		default:               *params = 8; break;
+		}
+		return;
+	case GL_ALPHA_BITS:
+		*params = glparamstate.pixelfmt == GX_PF_RGBA6_Z24 ? 6 : 0;
+		return;
+	case GL_DEPTH_BITS:
+		*params = glparamstate.pixelfmt == GX_PF_RGB565_Z16 ? 16 : 24;
+		return;
 	default:
 		return;
 	};
 }
 void glGetFloatv(GLenum pname, GLfloat * params) {
+	_defer_sync();
 	switch (pname) {
 	case GL_MODELVIEW_MATRIX:
-		memcpy(params,glparamstate.modelview_matrix,sizeof(float)*16);
+		_mtx44_transpose(&glparamstate.modelview_matrix[0][0],(float (*)[4])params);
 		return;
 	case GL_PROJECTION_MATRIX:
-		memcpy(params,glparamstate.projection_matrix,sizeof(float)*16);
+		_mtx44_transpose(&glparamstate.projection_matrix[0][0],(float (*)[4])params);
+		return;
+	case GL_TEXTURE_MATRIX:
+		_mtx44_transpose(&glparamstate.texunit[glparamstate.active_texture].texture_matrix[0][0],(float (*)[4])params);
 		return;
 	default:
 		return;
@@ -2009,8 +5260,22 @@ const GLubyte * glGetString( GLenum name ) { return gl_null_string; }
 void glPushAttrib( GLbitfield mask ) {}
 void glPopAttrib( void ) {}
 void glReadBuffer(GLenum mode) {}
-void glReadPixels(GLint x, GLint y, GLsizei width, GLsizei height, GLenum format, GLenum type, GLvoid * data) {}
-void glAlphaFunc(GLenum func, GLclampf ref) {} // We need a TEVSTAGE for comparing and discarding pixels by alpha value
+void glAlphaFunc(GLenum func, GLclampf ref) {
+	__flush_batch();
+	switch (func) {
+	case GL_NEVER:     glparamstate.alphafunc = GX_NEVER; break;
+	case GL_LESS:      glparamstate.alphafunc = GX_LESS; break;
+	case GL_EQUAL:     glparamstate.alphafunc = GX_EQUAL; break;
+	case GL_LEQUAL:    glparamstate.alphafunc = GX_LEQUAL; break;
+	case GL_GREATER:   glparamstate.alphafunc = GX_GREATER; break;
+	case GL_NOTEQUAL:  glparamstate.alphafunc = GX_NEQUAL; break;
+	case GL_GEQUAL:    glparamstate.alphafunc = GX_GEQUAL; break;
+	case GL_ALWAYS:    glparamstate.alphafunc = GX_ALWAYS; break;
+	default: return;
+	}
+	glparamstate.alpharef = _clampf_01(ref)*255.0f;
+	glparamstate.dirty.bits.dirty_alpha = 1;
+}
 
 
 /*
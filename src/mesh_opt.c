@@ -0,0 +1,339 @@
+/*****************************************************************************
+
+             MESH OPTIMIZATION
+
+     Index reordering for the GX vertex cache (Tom Forsyth's linear speed
+     vertex cache optimisation), triangle strip generation with strip
+     stitching, vertex fetch reordering and a cache simulator.
+
+     The code doesn't depend on GX, so it can also be built on the host
+     and used from asset conversion tools to optimize meshes offline.
+
+*****************************************************************************/
+
+#include <GL/opengx.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define FORSYTH_CACHE_SIZE  32   // Size of the modelled LRU cache used for scoring
+#define NO_TRIANGLE        (~0u)
+
+// Every index must address one of the vertex_count vertices
+static int _valid_indices(const GLushort * indices, int count, int vertex_count) {
+	int i;
+	for (i = 0; i < count; i++)
+		if (indices[i] >= vertex_count) return 0;
+	return 1;
+}
+
+// Vertex to triangle adjacency: triangles using vertex v are
+// tris[offset[v]] .. tris[offset[v]+count[v]-1]
+typedef struct {
+	unsigned int * offset;
+	unsigned int * count;
+	unsigned int * tris;
+} adjacency_t;
+
+static int _build_adjacency(adjacency_t * adj, const GLushort * indices, int numtris, int numverts) {
+	int i;
+	adj->offset = calloc(numverts,sizeof(unsigned int));
+	adj->count  = calloc(numverts,sizeof(unsigned int));
+	adj->tris   = malloc(sizeof(unsigned int)*numtris*3 + 1);
+	if (!adj->offset || !adj->count || !adj->tris) {
+		free(adj->offset); free(adj->count); free(adj->tris);
+		return 0;
+	}
+
+	for (i = 0; i < numtris*3; i++)
+		adj->count[indices[i]]++;
+
+	unsigned int sum = 0;
+	for (i = 0; i < numverts; i++) {
+		adj->offset[i] = sum;
+		sum += adj->count[i];
+		adj->count[i] = 0;
+	}
+
+	for (i = 0; i < numtris*3; i++) {
+		int v = indices[i];
+		adj->tris[adj->offset[v] + adj->count[v]++] = i/3;
+	}
+	return 1;
+}
+
+static void _free_adjacency(adjacency_t * adj) {
+	free(adj->offset);
+	free(adj->count);
+	free(adj->tris);
+}
+
+// Forsyth's vertex score: recently used vertices score high (except the last
+// triangle ones, to avoid strips that are too long) and so do vertices with
+// few remaining triangles, to get rid of them early
+static float _vertex_score(int cache_pos, int remaining) {
+	if (remaining == 0) return -1.0f;
+
+	float score = 0;
+	if (cache_pos >= 0) {
+		if (cache_pos < 3) {
+			score = 0.75f;
+		}else{
+			float s = 1.0f - (float)(cache_pos - 3)/(FORSYTH_CACHE_SIZE - 3);
+			score = powf(s,1.5f);
+		}
+	}
+	return score + 2.0f/sqrtf(remaining);
+}
+
+GLboolean ogxOptimizeIndices(GLushort * indices, GLsizei count, GLsizei vertex_count) {
+	int numtris = count/3;
+	int i, j, k;
+	if (!_valid_indices(indices,numtris*3,vertex_count)) return GL_FALSE;
+	if (numtris <= 1) return GL_TRUE;
+
+	adjacency_t adj;
+	if (!_build_adjacency(&adj,indices,numtris,vertex_count)) return GL_FALSE;
+
+	int   * remaining = malloc(sizeof(int)*vertex_count);
+	int   * cachepos  = malloc(sizeof(int)*vertex_count);
+	float * vscore    = malloc(sizeof(float)*vertex_count);
+	float * tscore    = malloc(sizeof(float)*numtris);
+	char  * emitted   = calloc(numtris,1);
+	GLushort * output = malloc(sizeof(GLushort)*numtris*3);
+	if (!remaining || !cachepos || !vscore || !tscore || !emitted || !output) {
+		free(remaining); free(cachepos); free(vscore); free(tscore); free(emitted); free(output);
+		_free_adjacency(&adj);
+		return GL_FALSE;
+	}
+
+	for (i = 0; i < vertex_count; i++) {
+		remaining[i] = adj.count[i];
+		cachepos[i] = -1;
+		vscore[i] = _vertex_score(-1,remaining[i]);
+	}
+	for (i = 0; i < numtris; i++)
+		tscore[i] = vscore[indices[i*3]] + vscore[indices[i*3+1]] + vscore[indices[i*3+2]];
+
+	// LRU cache, with room for the three vertices being pushed
+	int cache[FORSYTH_CACHE_SIZE+3];
+	int cachesize = 0;
+
+	unsigned int best = NO_TRIANGLE;
+	int next_scan = 0;  // Triangles before this one have all been emitted
+	int out;
+	for (out = 0; out < numtris; out++) {
+		if (best == NO_TRIANGLE) {
+			// No candidate in the cache, do a (slow) full search
+			float bestscore = -1.0f;
+			while (emitted[next_scan]) next_scan++;
+			for (i = next_scan; i < numtris; i++) {
+				if (!emitted[i] && tscore[i] > bestscore) {
+					bestscore = tscore[i];
+					best = i;
+				}
+			}
+		}
+
+		// Emit the triangle and remove it from the adjacency of its vertices
+		emitted[best] = 1;
+		for (k = 0; k < 3; k++) {
+			int v = indices[best*3+k];
+			output[out*3+k] = v;
+
+			unsigned int * vt = &adj.tris[adj.offset[v]];
+			for (j = 0; j < remaining[v]; j++) {
+				if (vt[j] == best) {
+					vt[j] = vt[remaining[v]-1];
+					break;
+				}
+			}
+			remaining[v]--;
+		}
+
+		// Push the vertices to the front of the cache (in reverse so v0 ends up first)
+		for (k = 2; k >= 0; k--) {
+			int v = indices[best*3+k];
+			int pos = cachepos[v] >= 0 ? cachepos[v] : cachesize++;
+			for (j = pos; j > 0; j--)
+				cache[j] = cache[j-1];
+			cache[0] = v;
+			for (j = 0; j <= pos; j++)
+				cachepos[cache[j]] = j;
+		}
+
+		// Vertices falling out of the cache
+		for (j = FORSYTH_CACHE_SIZE; j < cachesize; j++)
+			cachepos[cache[j]] = -1;
+
+		// Update the scores of the cached vertices and pick the next triangle among their triangles
+		for (j = 0; j < cachesize; j++) {
+			int v = cache[j];
+			vscore[v] = _vertex_score(cachepos[v],remaining[v]);
+		}
+		float bestscore = -1.0f;
+		best = NO_TRIANGLE;
+		for (j = 0; j < cachesize; j++) {
+			int v = cache[j];
+			for (k = 0; k < remaining[v]; k++) {
+				unsigned int t = adj.tris[adj.offset[v]+k];
+				tscore[t] = vscore[indices[t*3]] + vscore[indices[t*3+1]] + vscore[indices[t*3+2]];
+				if (tscore[t] > bestscore) {
+					bestscore = tscore[t];
+					best = t;
+				}
+			}
+		}
+		if (cachesize > FORSYTH_CACHE_SIZE) cachesize = FORSYTH_CACHE_SIZE;
+	}
+
+	memcpy(indices,output,sizeof(GLushort)*numtris*3);
+
+	free(remaining); free(cachepos); free(vscore); free(tscore); free(emitted); free(output);
+	_free_adjacency(&adj);
+	return GL_TRUE;
+}
+
+GLsizei ogxOptimizeVertexFetch(GLushort * indices, GLsizei count, GLsizei vertex_count, GLushort * remap) {
+	int i;
+	GLsizei next = 0;
+	// New indices must stay below the 0xFFFF marker
+	if (vertex_count > 0xFFFF || !_valid_indices(indices,count,vertex_count)) return 0;
+	for (i = 0; i < vertex_count; i++)
+		remap[i] = 0xFFFF;
+
+	// Number the vertices in order of first use, so they are fetched sequentially
+	for (i = 0; i < count; i++) {
+		int v = indices[i];
+		if (remap[v] == 0xFFFF)
+			remap[v] = next++;
+		indices[i] = remap[v];
+	}
+	return next;
+}
+
+void ogxRemapVertexArray(GLvoid * dst, const GLvoid * src, GLsizei vertex_count, GLsizei stride, const GLushort * remap) {
+	int i;
+	for (i = 0; i < vertex_count; i++) {
+		if (remap[i] != 0xFFFF)
+			memcpy((char*)dst + remap[i]*stride,(const char*)src + i*stride,stride);
+	}
+}
+
+// Returns whether (a,b,c) has the same winding as triangle t
+static int _same_winding(const GLushort * t, int a, int b, int c) {
+	return (t[0] == a && t[1] == b && t[2] == c) ||
+	       (t[1] == a && t[2] == b && t[0] == c) ||
+	       (t[2] == a && t[0] == b && t[1] == c);
+}
+
+// Looks for an unused triangle which continues the strip ending in (u,v)
+// keeping the winding. Odd positions in a strip have their winding reversed.
+static unsigned int _strip_next(const GLushort * indices, adjacency_t * adj, const char * used,
+                                int u, int v, int odd, int * w) {
+	unsigned int i;
+	for (i = 0; i < adj->count[u]; i++) {
+		unsigned int t = adj->tris[adj->offset[u]+i];
+		const GLushort * tri = &indices[t*3];
+		if (used[t]) continue;
+
+		int k;
+		for (k = 0; k < 3; k++) {
+			int x = tri[k];
+			if (x == u || x == v) continue;
+			if ((tri[0] == v || tri[1] == v || tri[2] == v) &&
+			    (odd ? _same_winding(tri,v,u,x) : _same_winding(tri,u,v,x))) {
+				*w = x;
+				return t;
+			}
+		}
+	}
+	return NO_TRIANGLE;
+}
+
+GLsizei ogxStripifyIndices(const GLushort * indices, GLsizei count, GLsizei vertex_count, GLushort * strip) {
+	int numtris = count/3;
+	int i, k;
+	if (numtris == 0 || !_valid_indices(indices,numtris*3,vertex_count)) return 0;
+
+	adjacency_t adj;
+	char * used = calloc(numtris,1);
+	if (!used || !_build_adjacency(&adj,indices,numtris,vertex_count)) {
+		free(used);
+		return 0;
+	}
+
+	GLsizei len = 0;
+	for (i = 0; i < numtris; i++) {
+		if (used[i]) continue;
+		const GLushort * tri = &indices[i*3];
+
+		// Start with the rotation which can be continued, if any
+		int rot = 0, w;
+		for (k = 0; k < 3; k++) {
+			if (_strip_next(indices,&adj,used,tri[(k+1)%3],tri[(k+2)%3],1,&w) != NO_TRIANGLE) {
+				rot = k;
+				break;
+			}
+		}
+		int a = tri[rot], b = tri[(rot+1)%3], c = tri[(rot+2)%3];
+		used[i] = 1;
+
+		// Stitch to the previous strip with degenerate triangles,
+		// making sure the new strip starts at an even position
+		if (len > 0) {
+			strip[len] = strip[len-1]; len++;
+			strip[len++] = a;
+			if (len & 1) strip[len++] = a;
+		}
+		int start = len;
+		strip[len++] = a;
+		strip[len++] = b;
+		strip[len++] = c;
+
+		for (;;) {
+			unsigned int t = _strip_next(indices,&adj,used,strip[len-2],strip[len-1],(len - start) & 1,&w);
+			if (t == NO_TRIANGLE) break;
+			used[t] = 1;
+			strip[len++] = w;
+		}
+	}
+
+	free(used);
+	_free_adjacency(&adj);
+	return len;
+}
+
+float ogxSimulateVertexCache(const GLushort * indices, GLsizei count, GLenum mode, int cache_size) {
+	int fifo[64];
+	int i, j, head = 0, filled = 0, misses = 0;
+	if (cache_size > 64) cache_size = 64;
+	if (cache_size < 1) cache_size = 1;
+
+	// FIFO replacement, hits don't refresh the entry
+	for (i = 0; i < count; i++) {
+		int v = indices[i], hit = 0;
+		for (j = 0; j < filled; j++) {
+			if (fifo[j] == v) { hit = 1; break; }
+		}
+		if (!hit) {
+			misses++;
+			fifo[head] = v;
+			head = (head+1) % cache_size;
+			if (filled < cache_size) filled++;
+		}
+	}
+
+	int numtris = 0;
+	if (mode == GL_TRIANGLES) {
+		numtris = count/3;
+	}else if (mode == GL_TRIANGLE_STRIP) {
+		// Degenerate (stitching) triangles are not counted
+		for (i = 2; i < count; i++) {
+			if (indices[i] != indices[i-1] && indices[i] != indices[i-2] && indices[i-1] != indices[i-2])
+				numtris++;
+		}
+	}
+	if (numtris == 0) return 0;
+	return (float)misses/numtris;
+}
@@ -0,0 +1,81 @@
+/*****************************************************************************
+
+             MATRIX KERNELS
+
+     Portable C versions of the libogc paired single matrix routines used
+     by opengx (ps_guMtxConcat, ps_guMtxInverse, ps_guMtxTranspose,
+     ps_guVecMultiply and ps_guVecMultiplySR). Mtx is row major 3x4,
+     destinations can alias the sources.
+
+     Mtx, guVector and u32 must be defined before including this file, so
+     the kernels can be built on the host too (see tests/).
+
+*****************************************************************************/
+
+#ifndef OGX_MTX_KERNELS_H
+#define OGX_MTX_KERNELS_H
+
+#include <string.h>
+
+static void _mtx_concat(Mtx a, Mtx b, Mtx ab) {
+	Mtx t;
+	int i, j;
+	for (i = 0; i < 3; i++) {
+		for (j = 0; j < 4; j++)
+			t[i][j] = a[i][0]*b[0][j] + a[i][1]*b[1][j] + a[i][2]*b[2][j];
+		t[i][3] += a[i][3];
+	}
+	memcpy(ab,t,sizeof(Mtx));
+}
+static u32 _mtx_inverse(Mtx src, Mtx inv) {
+	// Cofactors of the 3x3 part
+	float c00 = src[1][1]*src[2][2] - src[1][2]*src[2][1];
+	float c01 = src[1][2]*src[2][0] - src[1][0]*src[2][2];
+	float c02 = src[1][0]*src[2][1] - src[1][1]*src[2][0];
+	float det = src[0][0]*c00 + src[0][1]*c01 + src[0][2]*c02;
+	if (det == 0) return 0;
+	float id = 1.0f/det;
+
+	Mtx t;
+	int i;
+	t[0][0] = c00*id;
+	t[0][1] = (src[0][2]*src[2][1] - src[0][1]*src[2][2])*id;
+	t[0][2] = (src[0][1]*src[1][2] - src[0][2]*src[1][1])*id;
+	t[1][0] = c01*id;
+	t[1][1] = (src[0][0]*src[2][2] - src[0][2]*src[2][0])*id;
+	t[1][2] = (src[0][2]*src[1][0] - src[0][0]*src[1][2])*id;
+	t[2][0] = c02*id;
+	t[2][1] = (src[0][1]*src[2][0] - src[0][0]*src[2][1])*id;
+	t[2][2] = (src[0][0]*src[1][1] - src[0][1]*src[1][0])*id;
+	// Translation: -inv3x3 * t
+	for (i = 0; i < 3; i++)
+		t[i][3] = -(t[i][0]*src[0][3] + t[i][1]*src[1][3] + t[i][2]*src[2][3]);
+	memcpy(inv,t,sizeof(Mtx));
+	return 1;
+}
+static void _mtx_transpose(Mtx src, Mtx xpose) {
+	Mtx t;
+	int i, j;
+	for (i = 0; i < 3; i++) {
+		for (j = 0; j < 3; j++)
+			t[i][j] = src[j][i];
+		t[i][3] = 0;
+	}
+	memcpy(xpose,t,sizeof(Mtx));
+}
+static void _mtx_vec_multiply(Mtx m, guVector * src, guVector * dst) {
+	guVector t;
+	t.x = m[0][0]*src->x + m[0][1]*src->y + m[0][2]*src->z + m[0][3];
+	t.y = m[1][0]*src->x + m[1][1]*src->y + m[1][2]*src->z + m[1][3];
+	t.z = m[2][0]*src->x + m[2][1]*src->y + m[2][2]*src->z + m[2][3];
+	*dst = t;
+}
+static void _mtx_vec_multiply_sr(Mtx m, guVector * src, guVector * dst) {
+	guVector t;
+	t.x = m[0][0]*src->x + m[0][1]*src->y + m[0][2]*src->z;
+	t.y = m[1][0]*src->x + m[1][1]*src->y + m[1][2]*src->z;
+	t.z = m[2][0]*src->x + m[2][1]*src->y + m[2][2]*src->z;
+	*dst = t;
+}
+
+#endif
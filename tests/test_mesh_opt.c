@@ -0,0 +1,167 @@
+/*****************************************************************************
+
+             MESH OPTIMIZATION TESTS
+
+     Runs the mesh optimization functions (src/mesh_opt.c) on the host:
+     the optimized meshes must keep their triangles (and windings) and
+     improve the simulated vertex cache, invalid input must be rejected.
+
+*****************************************************************************/
+
+#include <GL/opengx.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define GRID 20
+#define GRID_VERTS ((GRID+1)*(GRID+1))
+#define GRID_INDICES (GRID*GRID*6)
+
+static int failures = 0;
+
+#define CHECK(cond, what) do { \
+	if (!(cond)) { printf("FAIL %s\n", what); failures++; } \
+} while (0)
+
+// GRID x GRID quads, two triangles each, in a random order
+static void _make_grid(GLushort * indices) {
+	int x, y, i, n = 0;
+	for (y = 0; y < GRID; y++) {
+		for (x = 0; x < GRID; x++) {
+			int v = y*(GRID+1) + x;
+			indices[n++] = v; indices[n++] = v + 1; indices[n++] = v + GRID + 1;
+			indices[n++] = v + 1; indices[n++] = v + GRID + 2; indices[n++] = v + GRID + 1;
+		}
+	}
+	for (i = GRID_INDICES/3 - 1; i > 0; i--) {
+		int j = rand() % (i + 1);
+		GLushort t[3];
+		memcpy(t, &indices[i*3], sizeof(t));
+		memcpy(&indices[i*3], &indices[j*3], sizeof(t));
+		memcpy(&indices[j*3], t, sizeof(t));
+	}
+}
+
+// Triangle rotated to start with its smallest index, keeping the winding
+static void _canonical(const GLushort * t, GLushort * c) {
+	int r = 0;
+	if (t[1] < t[r]) r = 1;
+	if (t[2] < t[r]) r = 2;
+	c[0] = t[r]; c[1] = t[(r+1)%3]; c[2] = t[(r+2)%3];
+}
+
+static int _cmp_tri(const void * a, const void * b) {
+	return memcmp(a, b, sizeof(GLushort)*3);
+}
+
+// Non degenerate triangles of a list or a strip, in canonical form and sorted
+static int _triangles(const GLushort * indices, int count, GLenum mode, GLushort * tris) {
+	int i, n = 0;
+	if (mode == GL_TRIANGLES) {
+		for (i = 0; i + 2 < count; i += 3)
+			_canonical(&indices[i], &tris[3*n++]);
+	}else{
+		for (i = 2; i < count; i++) {
+			GLushort t[3] = { indices[i-2], indices[i-1], indices[i] };
+			if (t[0] == t[1] || t[1] == t[2] || t[0] == t[2]) continue;
+			if (i & 1) { GLushort s = t[0]; t[0] = t[1]; t[1] = s; }
+			_canonical(t, &tris[3*n++]);
+		}
+	}
+	qsort(tris, n, sizeof(GLushort)*3, _cmp_tri);
+	return n;
+}
+
+static int _same_triangles(const GLushort * a, int acount, GLenum amode, const GLushort * b, int bcount, GLenum bmode) {
+	static GLushort ta[GRID_INDICES*2], tb[GRID_INDICES*2];
+	int na = _triangles(a, acount, amode, ta);
+	int nb = _triangles(b, bcount, bmode, tb);
+	return na == nb && memcmp(ta, tb, sizeof(GLushort)*3*na) == 0;
+}
+
+static void test_optimize_indices() {
+	GLushort indices[GRID_INDICES], original[GRID_INDICES];
+	_make_grid(indices);
+	memcpy(original, indices, sizeof(indices));
+
+	float before = ogxSimulateVertexCache(indices, GRID_INDICES, GL_TRIANGLES, OGX_VERTEX_CACHE_SIZE);
+	CHECK(ogxOptimizeIndices(indices, GRID_INDICES, GRID_VERTS), "optimize indices");
+	float after = ogxSimulateVertexCache(indices, GRID_INDICES, GL_TRIANGLES, OGX_VERTEX_CACHE_SIZE);
+
+	CHECK(_same_triangles(indices, GRID_INDICES, GL_TRIANGLES, original, GRID_INDICES, GL_TRIANGLES),
+	      "optimized indices keep the triangles");
+	CHECK(after < before, "optimized indices lower the ACMR");
+	printf("ACMR %.3f -> %.3f\n", before, after);
+}
+
+static void test_vertex_fetch() {
+	GLushort indices[GRID_INDICES], original[GRID_INDICES], remap[GRID_VERTS + 1];
+	float src[GRID_VERTS + 1], dst[GRID_VERTS + 1];
+	int i;
+	_make_grid(indices);
+	memcpy(original, indices, sizeof(indices));
+	for (i = 0; i <= GRID_VERTS; i++)
+		src[i] = i;
+
+	// One more vertex than used
+	GLsizei used = ogxOptimizeVertexFetch(indices, GRID_INDICES, GRID_VERTS + 1, remap);
+	CHECK(used == GRID_VERTS, "vertex fetch counts the used vertices");
+	CHECK(remap[GRID_VERTS] == 0xFFFF, "unused vertex marked");
+
+	// Vertices are numbered in order of first use
+	int next = 0;
+	for (i = 0; i < GRID_INDICES; i++) {
+		CHECK(indices[i] <= next, "vertices in order of first use");
+		if (indices[i] == next) next++;
+	}
+
+	// The remapped array gives the same positions
+	ogxRemapVertexArray(dst, src, GRID_VERTS + 1, sizeof(float), remap);
+	for (i = 0; i < GRID_INDICES; i++)
+		CHECK(dst[indices[i]] == src[original[i]], "remapped vertex data");
+}
+
+static void test_stripify() {
+	static GLushort indices[GRID_INDICES], strip[GRID_INDICES*2];
+	_make_grid(indices);
+	ogxOptimizeIndices(indices, GRID_INDICES, GRID_VERTS);
+
+	GLsizei len = ogxStripifyIndices(indices, GRID_INDICES, GRID_VERTS, strip);
+	CHECK(len > 0 && len <= GRID_INDICES*2, "stripify");
+	CHECK(_same_triangles(strip, len, GL_TRIANGLE_STRIP, indices, GRID_INDICES, GL_TRIANGLES),
+	      "strip keeps the triangles and their winding");
+	printf("Strip length %d for %d indices\n", (int)len, GRID_INDICES);
+}
+
+static void test_invalid_indices() {
+	GLushort indices[6] = { 0, 1, 2, 2, 1, 3 }, copy[6], remap[4], strip[12];
+	memcpy(copy, indices, sizeof(indices));
+
+	// Index 3 with 3 vertices
+	CHECK(!ogxOptimizeIndices(indices, 6, 3), "optimize rejects out of range indices");
+	CHECK(ogxOptimizeVertexFetch(indices, 6, 3, remap) == 0, "vertex fetch rejects out of range indices");
+	CHECK(ogxStripifyIndices(indices, 6, 3, strip) == 0, "stripify rejects out of range indices");
+	CHECK(memcmp(indices, copy, sizeof(indices)) == 0, "rejected indices are untouched");
+
+	// 0xFFFF marks unused vertices, so it can't be a new index
+	GLushort * big = malloc(sizeof(GLushort)*65536);
+	CHECK(ogxOptimizeVertexFetch(indices, 6, 65536, big) == 0, "vertex fetch rejects 65536 vertices");
+	free(big);
+
+	CHECK(ogxOptimizeIndices(indices, 6, 4), "valid indices are accepted");
+}
+
+int main() {
+	srand(1);
+	test_optimize_indices();
+	test_vertex_fetch();
+	test_stripify();
+	test_invalid_indices();
+
+	if (failures) {
+		printf("%d failures\n", failures);
+		return 1;
+	}
+	printf("Mesh optimization OK\n");
+	return 0;
+}
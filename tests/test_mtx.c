@@ -0,0 +1,192 @@
+/*****************************************************************************
+
+             MATRIX KERNEL TESTS
+
+     Checks the C matrix kernels (src/mtx_kernels.h, used instead of the
+     paired single ones with OGX_MTX_USE_C) against double precision
+     reference results, on the host.
+
+*****************************************************************************/
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+typedef uint32_t u32;
+typedef float Mtx[3][4];
+typedef struct { float x, y, z; } guVector;
+
+#include "../src/mtx_kernels.h"
+
+static int failures = 0;
+
+static void _check(const char * what, double got, double expected) {
+	if (fabs(got - expected) > 1e-4*(1.0 + fabs(expected))) {
+		printf("FAIL %s: %f, expected %f\n", what, got, expected);
+		failures++;
+	}
+}
+
+// Affine matrix as a 4x4 one with the (0,0,0,1) row
+static void _to_4x4(Mtx m, double r[4][4]) {
+	int i, j;
+	for (i = 0; i < 3; i++)
+		for (j = 0; j < 4; j++)
+			r[i][j] = m[i][j];
+	r[3][0] = r[3][1] = r[3][2] = 0;
+	r[3][3] = 1;
+}
+
+static void _ref_concat(Mtx a, Mtx b, double ab[4][4]) {
+	double ra[4][4], rb[4][4];
+	int i, j, k;
+	_to_4x4(a, ra);
+	_to_4x4(b, rb);
+	for (i = 0; i < 4; i++)
+		for (j = 0; j < 4; j++) {
+			ab[i][j] = 0;
+			for (k = 0; k < 4; k++)
+				ab[i][j] += ra[i][k]*rb[k][j];
+		}
+}
+
+static void _check_mtx(const char * what, Mtx m, double ref[4][4]) {
+	int i, j;
+	for (i = 0; i < 3; i++)
+		for (j = 0; j < 4; j++)
+			_check(what, m[i][j], ref[i][j]);
+}
+
+static void _random_mtx(Mtx m) {
+	int i, j;
+	for (i = 0; i < 3; i++)
+		for (j = 0; j < 4; j++)
+			m[i][j] = (rand() % 2001 - 1000)/250.0f;
+}
+
+static void test_concat() {
+	Mtx a, b, ab;
+	double ref[4][4];
+	_random_mtx(a);
+	_random_mtx(b);
+	_ref_concat(a, b, ref);
+
+	_mtx_concat(a, b, ab);
+	_check_mtx("concat", ab, ref);
+
+	// glMultMatrixf multiplies in place
+	_mtx_concat(a, b, a);
+	_check_mtx("concat ab == a", a, ref);
+}
+
+static void test_concat_aliased_b() {
+	Mtx a, b;
+	double ref[4][4];
+	_random_mtx(a);
+	_random_mtx(b);
+	_ref_concat(a, b, ref);
+	_mtx_concat(a, b, b);
+	_check_mtx("concat ab == b", b, ref);
+}
+
+static double _ref_det(Mtx m) {
+	return m[0][0]*((double)m[1][1]*m[2][2] - (double)m[1][2]*m[2][1]) -
+	       m[0][1]*((double)m[1][0]*m[2][2] - (double)m[1][2]*m[2][0]) +
+	       m[0][2]*((double)m[1][0]*m[2][1] - (double)m[1][1]*m[2][0]);
+}
+
+static void test_inverse() {
+	Mtx m, inv, copy;
+	double prod[4][4];
+	int i, j;
+	// Well conditioned matrices only, the kernels are single precision
+	do {
+		_random_mtx(m);
+	} while (fabs(_ref_det(m)) < 1.0);
+
+	if (!_mtx_inverse(m, inv)) {
+		printf("FAIL inverse of a regular matrix failed\n");
+		failures++;
+		return;
+	}
+	// m * inverse(m) is the identity
+	_ref_concat(m, inv, prod);
+	for (i = 0; i < 3; i++)
+		for (j = 0; j < 4; j++)
+			_check("inverse", prod[i][j], i == j ? 1 : 0);
+
+	memcpy(copy, m, sizeof(Mtx));
+	_mtx_inverse(copy, copy);
+	for (i = 0; i < 3; i++)
+		for (j = 0; j < 4; j++)
+			_check("inverse src == inv", copy[i][j], inv[i][j]);
+}
+
+static void test_singular() {
+	Mtx m = { {1,2,3,4}, {2,4,6,8}, {0,1,0,0} }, inv;
+	if (_mtx_inverse(m, inv)) {
+		printf("FAIL inverse of a singular matrix succeeded\n");
+		failures++;
+	}
+}
+
+static void test_transpose() {
+	Mtx m, t;
+	int i, j;
+	_random_mtx(m);
+	_mtx_transpose(m, t);
+	for (i = 0; i < 3; i++) {
+		for (j = 0; j < 3; j++)
+			_check("transpose", t[i][j], m[j][i]);
+		_check("transpose translation", t[i][3], 0);
+	}
+	Mtx copy;
+	memcpy(copy, m, sizeof(Mtx));
+	_mtx_transpose(copy, copy);
+	for (i = 0; i < 3; i++)
+		for (j = 0; j < 3; j++)
+			_check("transpose src == xpose", copy[i][j], m[j][i]);
+}
+
+static void test_vec_multiply() {
+	Mtx m;
+	guVector v = { 1.5f, -2.0f, 0.25f }, r;
+	int i;
+	_random_mtx(m);
+
+	_mtx_vec_multiply(m, &v, &r);
+	float * out = &r.x;
+	for (i = 0; i < 3; i++)
+		_check("vec multiply", out[i], (double)m[i][0]*v.x + (double)m[i][1]*v.y + (double)m[i][2]*v.z + m[i][3]);
+
+	_mtx_vec_multiply_sr(m, &v, &r);
+	for (i = 0; i < 3; i++)
+		_check("vec multiply sr", out[i], (double)m[i][0]*v.x + (double)m[i][1]*v.y + (double)m[i][2]*v.z);
+
+	guVector w = v;
+	_mtx_vec_multiply(m, &w, &w);
+	out = &w.x;
+	for (i = 0; i < 3; i++)
+		_check("vec multiply src == dst", out[i], (double)m[i][0]*v.x + (double)m[i][1]*v.y + (double)m[i][2]*v.z + m[i][3]);
+}
+
+int main() {
+	int i;
+	srand(1);
+	for (i = 0; i < 100; i++) {
+		test_concat();
+		test_concat_aliased_b();
+		test_inverse();
+		test_transpose();
+		test_vec_multiply();
+	}
+	test_singular();
+
+	if (failures) {
+		printf("%d failures\n", failures);
+		return 1;
+	}
+	printf("Matrix kernels OK\n");
+	return 0;
+}